@@ -233,6 +233,7 @@ void Shader::setFlags(int flags)
 	if (changedFlags&RELEVANT_FLAGS) //only blend flag changes are relevant	
 	{
 		D3D::render();
+		D3D::stats.stateChanges++;
 
 		//Set blend state		
 		if(changedFlags & BLEND_FLAGS) //Only set blend state if it actually changed
@@ -1,35 +1,74 @@
+#include <new>
+#include <algorithm>
 #include "shader_complexsurface.h"
+#include "worldgeometrybuffer.h"
 
-Shader_ComplexSurface::Shader_ComplexSurface(bool simulateMultipassTexturing): simulateMultipassTexturing(simulateMultipassTexturing), Shader_Unreal()
-{
+static const int BUFFER_SIZE = 60000; //Indices per frame; world geometry is most of what the engine sends
+static const int WORLD_VERTICES = 1<<18; //Vertices of cached world geometry
 
+Shader_ComplexSurface::Shader_ComplexSurface(bool simulateMultipassTexturing): Shader_Unreal(sizeof(Vertex_ComplexSurface),BUFFER_SIZE), simulateMultipassTexturing(simulateMultipassTexturing), surfaceBuffer(nullptr), surfaceView(nullptr)
+{
+	surfaces.resize(MAX_SURFACES);
 }
 
 Shader_ComplexSurface::~Shader_ComplexSurface()
 {
 	SAFE_RELEASE(bstate_Translucent_ComplexSurface);
+	SAFE_RELEASE(surfaceView);
+	SAFE_RELEASE(surfaceBuffer);
 }
 
 
 bool Shader_ComplexSurface::compile(const D3D10_SHADER_MACRO *macros, DWORD shaderFlags)
 {
+	//World geometry is cached on the GPU instead of going in a regular dynamic geometry buffer; Shader_Unreal::compile() leaves an existing buffer alone
+	if(geometryBuffer==nullptr)
+	{
+		WorldGeometryBuffer *buf = new (std::nothrow) WorldGeometryBuffer(device);
+		if(!buf || !buf->create(WORLD_VERTICES,BUFFER_SIZE,MAX_SURFACES))
+		{
+			UD3D10RenderDevice::debugs("Failed to create world geometry buffer.");
+			delete buf;
+			return false;
+		}
+		geometryBuffer = buf;
+	}
+
 	Shader_Unreal::compile(macros,shaderFlags);
 	D3D10_INPUT_ELEMENT_DESC layoutDesc[] =
     {
 		{ "POSITION",   0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "TEXCOORD",   0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "TEXCOORD",   1, DXGI_FORMAT_R32G32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "TEXCOORD",   2, DXGI_FORMAT_R32G32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "TEXCOORD",   3, DXGI_FORMAT_R32G32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "TEXCOORD",   4, DXGI_FORMAT_R32G32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
 		{ "BLENDINDICES", 0, DXGI_FORMAT_R32_UINT, 0, D3D10_APPEND_ALIGNED_ELEMENT,  D3D10_INPUT_PER_VERTEX_DATA, 0 },
     };
 
 	if(!Shader_Unreal::compileUnrealShader("d3d10drv\\complexsurface.fx",macros,shaderFlags,layoutDesc,sizeof(layoutDesc)/sizeof(layoutDesc[0])))
 		return false;
+
+	if(surfaceBuffer==nullptr)
+	{
+		D3D10_BUFFER_DESC desc;
+		desc.ByteWidth = MAX_SURFACES*sizeof(ComplexSurfaceRecord);
+		desc.Usage = D3D10_USAGE_DEFAULT; //Dynamic buffers can only be mapped with discard when bound as a shader resource, which would lose records still to be drawn
+		desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
+		desc.CPUAccessFlags = 0;
+		desc.MiscFlags = 0;
+
+		D3D10_SHADER_RESOURCE_VIEW_DESC viewDesc;
+		viewDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+		viewDesc.ViewDimension = D3D10_SRV_DIMENSION_BUFFER;
+		viewDesc.Buffer.ElementOffset = 0;
+		viewDesc.Buffer.ElementWidth = MAX_SURFACES*sizeof(ComplexSurfaceRecord)/16;
+		if(FAILED(device->CreateBuffer(&desc,nullptr,&surfaceBuffer)) || FAILED(device->CreateShaderResourceView(surfaceBuffer,&viewDesc,&surfaceView)))
+		{
+			UD3D10RenderDevice::debugs("Error creating surface buffer.");
+			return false;
+		}
+	}
 	
 	variables.useTexturePass = effect->GetVariableByName("useTexturePass")->AsScalar();
 	variables.textures = effect->GetVariableByName("textures")->AsShaderResource();
+	variables.surfaces = effect->GetVariableByName("surfaces")->AsShaderResource();
+	variables.surfaces->SetResource(surfaceView);
 	effect->GetVariableByName("bstate_Translucent_ComplexSurface")->AsBlend()->GetBlendState(0,&bstate_Translucent_ComplexSurface);
 	
 	return true;
@@ -40,6 +79,7 @@ void Shader_ComplexSurface::switchPass(TextureCache::TexturePass pass, BOOL val)
 	if(useTexturePass[pass-1]!=val)	
 	{
 		D3D::render(); //draw geometry that might have used other textures
+		D3D::stats.stateChanges++;
 		enableChanged = true;
 	}
 	useTexturePass[pass-1]=val;
@@ -49,6 +89,26 @@ void Shader_ComplexSurface::switchPass(TextureCache::TexturePass pass, BOOL val)
 
 void Shader_ComplexSurface::apply() 
 {
+	//Upload records changed since the last draw, a run of consecutive slots at a time
+	if(!dirtySurfaces.empty())
+	{
+		std::sort(dirtySurfaces.begin(),dirtySurfaces.end());
+		dirtySurfaces.erase(std::unique(dirtySurfaces.begin(),dirtySurfaces.end()),dirtySurfaces.end());
+		for(size_t i=0;i<dirtySurfaces.size();)
+		{
+			size_t end = i+1;
+			while(end<dirtySurfaces.size() && dirtySurfaces[end]==dirtySurfaces[end-1]+1)
+				end++;
+			UINT first = dirtySurfaces[i];
+			UINT last = dirtySurfaces[end-1]+1;
+			D3D10_BOX box = {(UINT)(first*sizeof(ComplexSurfaceRecord)),0,0,(UINT)(last*sizeof(ComplexSurfaceRecord)),1,1};
+			device->UpdateSubresource(surfaceBuffer,0,&box,&surfaces[first],0,0);
+			D3D::stats.vertexBytes += (last-first)*sizeof(ComplexSurfaceRecord);
+			i = end;
+		}
+		dirtySurfaces.clear();
+	}
+
 	//apply texture enabled array
 
 	if(enableChanged)
@@ -79,4 +139,23 @@ void Shader_ComplexSurface::setFlags(int flags)
 	Shader::setFlags(flags);
 	states.bstate_Translucent = b;
 	
+}
+
+/**
+Returns true if a record slot already holds these texture coordinate parameters.
+*/
+bool Shader_ComplexSurface::isSurface(UINT slot, const ComplexSurfaceRecord &surface) const
+{
+	return memcmp(&surfaces[slot],&surface,sizeof(ComplexSurfaceRecord))==0;
+}
+
+/**
+Set a surface's texture coordinate parameters; uploaded with the next draw.
+\param slot Record slot of the facet, see WorldGeometryBuffer::Facet.
+\note Geometry using the slot that wasn't drawn yet will use the new record too.
+*/
+void Shader_ComplexSurface::setSurface(UINT slot, const ComplexSurfaceRecord &surface)
+{
+	surfaces[slot] = surface;
+	dirtySurfaces.push_back(slot);
 }
\ No newline at end of file
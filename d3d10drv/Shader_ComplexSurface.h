@@ -1,5 +1,6 @@
 #pragma once
 
+#include <vector>
 #include "shader_unreal.h"
 #include "texturecache.h"
 
@@ -10,14 +11,27 @@ private:
 	{
 		ID3D10EffectScalarVariable* useTexturePass; /**< Bool whether to use each texture pass (shader side) */
 		ID3D10EffectShaderResourceVariable* textures;		 
+		ID3D10EffectShaderResourceVariable* surfaces; /**< Buffer of ComplexSurfaceRecords */
 	} variables;
 	ID3D10BlendState *bstate_Translucent_ComplexSurface; /**< Special blend state to enable the Glide renderer's multi pass rendering, see shader for details */
 	static const int numBools = TextureCache::DUMMY_NUM_TEXTURE_PASSES -1; //-1 because diffuse is always enabled
 	bool enableChanged;
 	BOOL useTexturePass[numBools];
 	bool simulateMultipassTexturing;
+
+	/**@name Surface records
+	Each facet cached in the WorldGeometryBuffer has a record slot. Records are kept on the CPU as well; changed ones are uploaded before each draw, see apply().
+	*/
+	//@{
+	ID3D10Buffer *surfaceBuffer;
+	ID3D10ShaderResourceView *surfaceView;
+	std::vector<ComplexSurfaceRecord> surfaces;
+	std::vector<UINT> dirtySurfaces; /**< Slots changed since the last upload */
+	//@}
 	
 public:	
+	static const UINT MAX_SURFACES = 32768;
+
 	Shader_ComplexSurface(bool simulateMultipassTexturing);
 	~Shader_ComplexSurface();
 	bool compile(const D3D10_SHADER_MACRO *macros, DWORD shaderFlags) override;	
@@ -25,4 +39,6 @@ public:
 	void apply() override;	
 	void Shader_ComplexSurface::setTexture(int pass,ID3D10ShaderResourceView *texture) const;
 	void setFlags(int flags) override;
+	bool isSurface(UINT slot, const ComplexSurfaceRecord &surface) const;
+	void setSurface(UINT slot, const ComplexSurfaceRecord &surface);
 };
\ No newline at end of file
@@ -4,7 +4,9 @@ Rune distance fog
 
 #include "shader_fogsurface.h"
 
-Shader_FogSurface::Shader_FogSurface(): Shader_Unreal()
+static const int BUFFER_SIZE = 20000; //Size of buffer for geometry sent by the engine
+
+Shader_FogSurface::Shader_FogSurface(): Shader_Unreal(sizeof(Vertex_FogSurface),BUFFER_SIZE)
 {
 
 }
@@ -1,6 +1,11 @@
 #include "Shader_GouraudPolygon.h"
+#include "polyflags.h"
 
-Shader_GouraudPolygon::Shader_GouraudPolygon(): Shader_Unreal()
+static const int BUFFER_SIZE = 30000; //Meshes and particles
+
+const DWORD Shader_GouraudPolygon::BATCH_FLAGS = PF_Masked|PF_Modulated|PF_Translucent|PF_AlphaBlend|PF_RenderFog|PF_NoSmooth;
+
+Shader_GouraudPolygon::Shader_GouraudPolygon(): Shader_Unreal(sizeof(Vertex_GouraudPolygon),BUFFER_SIZE), batchFlags(0)
 {
 
 }
@@ -11,10 +16,9 @@ bool Shader_GouraudPolygon::compile(const D3D10_SHADER_MACRO *macros, DWORD shad
 	D3D10_INPUT_ELEMENT_DESC layoutDesc[] =
     {
 		{ "POSITION",   0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "COLOR",   0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "COLOR",   1, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
+		{ "COLOR",   0, DXGI_FORMAT_R10G10B10A2_UNORM, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
+		{ "COLOR",   1, DXGI_FORMAT_R8G8B8A8_UNORM, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
 		{ "TEXCOORD",     0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,  D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "BLENDINDICES", 0, DXGI_FORMAT_R32_UINT, 0, D3D10_APPEND_ALIGNED_ELEMENT,  D3D10_INPUT_PER_VERTEX_DATA, 0 },
     };
 
 	if(!Shader_Unreal::compileUnrealShader("d3d10drv\\gouraudpolygon.fx",macros,shaderFlags,layoutDesc,sizeof(layoutDesc)/sizeof(layoutDesc[0])))
@@ -22,6 +26,8 @@ bool Shader_GouraudPolygon::compile(const D3D10_SHADER_MACRO *macros, DWORD shad
 
 	variables.fogColor = effect->GetVariableByName("fogColor")->AsVector();
 	variables.fogDist = effect->GetVariableByName("fogDist")->AsScalar();
+	variables.polyFlags = effect->GetVariableByName("polyFlags")->AsScalar();
+	variables.polyFlags->SetInt(batchFlags);
 	return true;
 }
 
@@ -34,3 +40,18 @@ void Shader_GouraudPolygon::fog(float dist,Vec4 *color)  const
 	}
 }
 
+/**
+Polyflags are a shader constant instead of a vertex attribute, which only costs a draw when the flags the shader reads change.
+\note CommandList keeps these flags in its state keys, so recorded meshes are batched by them.
+*/
+void Shader_GouraudPolygon::setFlags(int flags)
+{
+	if((flags&BATCH_FLAGS)!=batchFlags)
+	{
+		D3D::render(); //Buffered geometry was meant for the old flags
+		D3D::stats.stateChanges++;
+		batchFlags = flags&BATCH_FLAGS;
+		variables.polyFlags->SetInt(batchFlags);
+	}
+	Shader::setFlags(flags);
+}
@@ -12,9 +12,16 @@ public:
 		ID3D10EffectScalarVariable* projectionMode; /**< Projection transform mode (near/far) */		
 		ID3D10EffectVectorVariable* fogColor; /**< Fog color */
 		ID3D10EffectScalarVariable* fogDist; /**< Fog end distance */
+		ID3D10EffectScalarVariable* polyFlags; /**< Flags of the batch being drawn */
 	} variables;
 
+	static const DWORD BATCH_FLAGS; /**< Polyflags the shader reads */
+
 	Shader_GouraudPolygon();
 	bool compile(const D3D10_SHADER_MACRO *macros, DWORD shaderFlags) override;
 	void fog(float dist,Vec4 *color)  const;
+	void setFlags(int flags) override;
+
+private:
+	DWORD batchFlags; /**< BATCH_FLAGS part of the flags last set */
 };
\ No newline at end of file
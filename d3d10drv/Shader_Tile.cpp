@@ -1,20 +1,38 @@
+#include <new>
 #include "shader_tile.h"
+#include "instancegeometrybuffer.h"
 
-Shader_Tile::Shader_Tile(): Shader_Unreal()
+static const int BUFFER_SIZE = 10000; //Tiles per instance buffer
+
+Shader_Tile::Shader_Tile(): Shader_Unreal(sizeof(Vertex_Tile),BUFFER_SIZE)
 {
-	this->topology = D3D10_PRIMITIVE_TOPOLOGY_POINTLIST;	
+	this->topology = D3D10_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP;
 }
 
 bool Shader_Tile::compile(const D3D10_SHADER_MACRO *macros, DWORD shaderFlags)
 {
+	//Tiles are instanced quads instead of going in a regular dynamic geometry buffer; Shader_Unreal::compile() leaves an existing buffer alone
+	if(geometryBuffer==nullptr)
+	{
+		InstanceGeometryBuffer *buf = new (std::nothrow) InstanceGeometryBuffer(device);
+		if(!buf || !buf->create(BUFFER_SIZE,sizeof(Vertex_Tile)))
+		{
+			UD3D10RenderDevice::debugs("Failed to create tile instance buffer.");
+			delete buf;
+			return false;
+		}
+		geometryBuffer = buf;
+	}
+
 	Shader_Unreal::compile(macros,shaderFlags);
 	D3D10_INPUT_ELEMENT_DESC layoutDesc[] =
     {
-		{ "POSITION",   0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "POSITION",   1, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "COLOR",   0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "PSIZE",     0, DXGI_FORMAT_R32_FLOAT, 0, D3D10_APPEND_ALIGNED_ELEMENT,  D3D10_INPUT_PER_VERTEX_DATA, 0 },
-		{ "BLENDINDICES", 0, DXGI_FORMAT_R32_UINT, 0, D3D10_APPEND_ALIGNED_ELEMENT,  D3D10_INPUT_PER_VERTEX_DATA, 0 },
+		{ "TEXCOORD",   0, DXGI_FORMAT_R32G32_FLOAT, 0, 0,   D3D10_INPUT_PER_VERTEX_DATA, 0 },
+		{ "POSITION",   0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_INSTANCE_DATA, 1 },
+		{ "POSITION",   1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_INSTANCE_DATA, 1 },
+		{ "COLOR",   0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D10_APPEND_ALIGNED_ELEMENT,   D3D10_INPUT_PER_INSTANCE_DATA, 1 },
+		{ "PSIZE",     0, DXGI_FORMAT_R32_FLOAT, 1, D3D10_APPEND_ALIGNED_ELEMENT,  D3D10_INPUT_PER_INSTANCE_DATA, 1 },
+		{ "BLENDINDICES", 0, DXGI_FORMAT_R32_UINT, 1, D3D10_APPEND_ALIGNED_ELEMENT,  D3D10_INPUT_PER_INSTANCE_DATA, 1 },
     };
 
 	if(!Shader_Unreal::compileUnrealShader("d3d10drv\\tile.fx",macros,shaderFlags,layoutDesc,sizeof(layoutDesc)/sizeof(layoutDesc[0])))
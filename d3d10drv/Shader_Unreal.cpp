@@ -1,14 +1,15 @@
 /**
-Shaders that implement the basic Unreal geometry pipeline inherit from this. They share a few shader variables and use the same (dynamic) geometry buffer.
-THIS MEANS THAT THEY MUST USE EQUAL SIZE VERTICES
+Shaders that implement the basic Unreal geometry pipeline inherit from this. They share a few shader variables; each has its own dynamic geometry buffer
+with the exact stride of its vertex format and a capacity that fits how it's used.
+As the buffers are independent, switching shaders only draws and unmaps the buffer of the shader being left; the others stay mapped and keep appending.
 */
 
 #include <new>
 #include "Shader_Unreal.h"
 #include "DynamicGeometryBuffer.h" 
+#include "fanencoder.h"
 #include <xnamath.h>
 
-DynamicGeometryBuffer *Shader_Unreal::dynamicGeometryBuffer;
 ID3D10EffectPool *Shader_Unreal::pool;
 Shader_Unreal::_variables Shader_Unreal::variables;
 ID3D10RenderTargetView *Shader_Unreal::unrealRTV;
@@ -16,39 +17,33 @@ ID3D10DepthStencilView *Shader_Unreal::unrealDSV;
 ID3D10ShaderResourceView *Shader_Unreal::unrealSRV;
 ID3D10DepthStencilView *Shader_Unreal::noMSAADSV;
 
-static const int BUFFER_SIZE = 20000; //Size of buffer for geometry sent by the engine
-
-Shader_Unreal::Shader_Unreal(): Shader()
+/**
+\param vertexSize Size of the vertex format the shader takes.
+\param bufferSize Number of indices (and at most as many vertices) its geometry buffer holds before it has to be drawn and discarded.
+*/
+Shader_Unreal::Shader_Unreal(UINT vertexSize, size_t bufferSize): Shader(), vertexSize(vertexSize), bufferSize(bufferSize)
 {
-
+	topology = FanEncoder::getTopology(); //Geometry comes in fans
 }
 
 Shader_Unreal::~Shader_Unreal()
 {	
 	SAFE_RELEASE(pool);
-
-	//Make sure the static members only get deleted once
-	if(dynamicGeometryBuffer)
-	{
-		delete dynamicGeometryBuffer;
-		dynamicGeometryBuffer = nullptr;		
-	}
-	geometryBuffer = nullptr;
 }
 
 bool Shader_Unreal::compile(const D3D10_SHADER_MACRO *macros, DWORD shaderFlags)
 {
 	
-	if(dynamicGeometryBuffer==nullptr)
+	if(geometryBuffer==nullptr)
 	{
-
-		dynamicGeometryBuffer = new (std::nothrow) DynamicGeometryBuffer(device);		
-		if(!dynamicGeometryBuffer || !dynamicGeometryBuffer->create(BUFFER_SIZE,sizeof(Vertex_ComplexSurface)))
+		DynamicGeometryBuffer *buf = new (std::nothrow) DynamicGeometryBuffer(device);
+		if(!buf || !buf->create(bufferSize,vertexSize))
 		{
 			UD3D10RenderDevice::debugs("Failed to create dynamic geometry buffer.");
+			delete buf;
 			return false;
 		}
-		
+		geometryBuffer = buf;
 	}
 	if(pool==nullptr)
 	{
@@ -60,8 +55,10 @@ bool Shader_Unreal::compile(const D3D10_SHADER_MACRO *macros, DWORD shaderFlags)
 		variables.viewportHeight = pool->AsEffect()->GetVariableByName("viewportHeight")->AsScalar();
 		variables.viewportWidth = pool->AsEffect()->GetVariableByName("viewportWidth")->AsScalar();
 		variables.diffuseTexture = pool->AsEffect()->GetVariableByName("texDiffuse")->AsShaderResource();
+		variables.diffuseIndices = pool->AsEffect()->GetVariableByName("texDiffuseIndices")->AsShaderResource(); //These three are invalid (setting them does nothing) if the GPUPalettes option is off
+		variables.palette = pool->AsEffect()->GetVariableByName("texPalette")->AsShaderResource();
+		variables.diffusePaletteRow = pool->AsEffect()->GetVariableByName("diffusePaletteRow")->AsScalar();
 	}
-	this->geometryBuffer = dynamicGeometryBuffer; //All 'Unreal' shaders share the same dynamic geometry buffer
 	return true;
 }
 
@@ -176,6 +173,26 @@ void Shader_Unreal::setTexture(int pass,ID3D10ShaderResourceView *texture) const
 		variables.diffuseTexture->SetResourceArray(&texture,pass,1);	
 }
 
+/**
+Set the diffuse texture's palette.
+\param indices Paletted (R8_UINT) diffuse texture; ignored if paletteRow is -1.
+\param paletteRow Row of the palette texture to use, -1 to use the regular diffuse texture instead.
+*/
+void Shader_Unreal::setDiffusePalette(ID3D10ShaderResourceView *indices, int paletteRow) const
+{
+	if(paletteRow>=0)
+		variables.diffuseIndices->SetResource(indices);
+	variables.diffusePaletteRow->SetInt(paletteRow);
+}
+
+/**
+Set the texture holding the palettes for paletted diffuse textures, see TextureCache::cachePalette().
+*/
+void Shader_Unreal::setPaletteTexture(ID3D10ShaderResourceView *palette)
+{
+	variables.palette->SetResource(palette);
+}
+
 /**
 Clear backbuffer(s)
 \param clearColor The color with which the screen is cleared.
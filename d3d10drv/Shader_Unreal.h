@@ -6,7 +6,6 @@
 class Shader_Unreal : public Shader
 {
 private:
-	static DynamicGeometryBuffer *dynamicGeometryBuffer;
 	static ID3D10EffectPool *pool;
 	static ID3D10RenderTargetView *unrealRTV;
 	static ID3D10DepthStencilView *unrealDSV;
@@ -19,15 +18,20 @@ private:
 		ID3D10EffectShaderResourceVariable* diffuseTexture;
 		ID3D10EffectScalarVariable* viewportHeight; /**< Viewport height in pixels */
 		ID3D10EffectScalarVariable* viewportWidth; /**< Viewport width in pixels */
+		ID3D10EffectShaderResourceVariable* diffuseIndices; /**< Paletted diffuse texture, GPUPalettes option only */
+		ID3D10EffectShaderResourceVariable* palette; /**< Palette texture, GPUPalettes option only */
+		ID3D10EffectScalarVariable* diffusePaletteRow; /**< Palette of the diffuse texture, -1 if it isn't paletted */
 	};
-	
+
+	UINT vertexSize; /**< Stride of this shader's geometry buffer */
+	size_t bufferSize; /**< Capacity of this shader's geometry buffer in indices */
 	
 public:
 	enum BUFFERS{BUFFER_MULTIPASS,BUFFER_HUD};
 
 	static _variables variables;
 
-	Shader_Unreal();
+	Shader_Unreal(UINT vertexSize, size_t bufferSize);
 	virtual ~Shader_Unreal();
 
 	//From Shader
@@ -39,6 +43,8 @@ public:
 	void Shader_Unreal::setProjection(float aspect, float XoverZ, float zNear, float zFar) const;
 	void Shader_Unreal::setViewportSize(float x, float y) const;
 	virtual void Shader_Unreal::setTexture(int  pass,ID3D10ShaderResourceView *texture) const;
+	void setDiffusePalette(ID3D10ShaderResourceView *indices, int paletteRow) const;
+	static void setPaletteTexture(ID3D10ShaderResourceView *palette);
 	void Shader_Unreal::clear(Vec4& clearColor) const;
 	void Shader_Unreal::clearDepth() const;
 	void switchBuffers(enum BUFFERS buffer);
@@ -37,20 +37,36 @@
 	
 
 
+/** Mesh vertex; polyflags are set per batch, see Shader_GouraudPolygon::setFlags() */
 struct Vertex_GouraudPolygon
 {
 	Vec3 Pos;
-	Vec4 Color;
-	Vec4 Fog;
+	DWORD Color; /**< R10G10B10A2, clamped to [0,1] like the shader always did */
+	DWORD Fog; /**< R8G8B8A8 */
 	Vec2 TexCoord;
-	DWORD flags;
 };
 
+/** World geometry vertex; texture coordinates are derived in the vertex shader from the surface's ComplexSurfaceRecord */
 struct Vertex_ComplexSurface
 {
 	Vec3 Pos;
-	Vec2 TexCoord[5];
+	UINT surface; /**< Index of the ComplexSurfaceRecord, see Shader_ComplexSurface::setSurface() */
+};
+
+/** Per surface texture coordinate generation parameters, shared by all of a surface's vertices */
+struct ComplexSurfaceRecord
+{
+	float XAxis[3]; /**< MapCoords axes and their dot products with the MapCoords origin */
+	float UDot;
+	float YAxis[3];
+	float VDot;
+	struct
+	{
+		float panU, panV; /**< Subtracted from the map coordinates */
+		float multU, multV; /**< Normalize to texture coordinates; 0 for unused passes */
+	} passes[5]; /**< Diffuse, light, detail, fog, macro */
 	DWORD flags;
+	DWORD padding[3]; /**< Whole float4s, as the shader reads these from a Buffer<float4> */
 };
 
 struct Vertex_Tile
@@ -67,7 +83,6 @@ struct Vertex_FogSurface
 	Vec3 Pos;
 	Vec4 Color;
 	DWORD flags;
-	char padding[24]; //So it can be used in a buffer together with the others
 };
 
 struct Vertex_Simple
@@ -0,0 +1,573 @@
+/**
+\class BCEncoder
+Block compression of converted R8G8B8A8 textures to BC1 (DXT1) and BC3 (DXT5), so static textures take a quarter or half the video memory and upload bandwidth.
+
+The encoder aims for speed as textures are compressed while the game loads. Per block:
+- The color endpoints are the bounding box of the block's colors, on the diagonal the colors' covariance points along, inset by a sixteenth of the range
+  so the extremes land between two palette entries instead of dragging the whole palette along.
+- Each pixel takes the closest of the four palette colors. This and the bounding box are done with SSE2 where the CPU has it, four pixels at a time.
+- BC1 blocks with transparent pixels (alpha below 128) use the three color mode, where index 3 is transparent black. That's exactly what the
+  paletted conversion makes of masked pixels, so masks come out unchanged; the colors of transparent pixels don't influence the endpoints.
+- BC3 alpha is interpolated between the block's exact minimum and maximum, so fully opaque and fully transparent pixels stay exact.
+
+Textures are split into runs of block rows and encoded with the help of the texture workers if they're large enough, see encodeMips().
+The D3D10BCBench command measures throughput and error on generated textures.
+*/
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <intrin.h>
+#include <emmintrin.h>
+#include "bcencoder.h"
+
+/**@name Color helpers
+Colors are DWORDs as R8G8B8A8 pixels are in memory: red in the lowest byte, alpha in the highest.
+*/
+//@{
+static inline int channel(DWORD color, int c)
+{
+	return (color>>(8*c)) & 0xFF;
+}
+
+static inline DWORD makeColor(int r, int g, int b, int a)
+{
+	return r | (g<<8) | (b<<16) | ((DWORD)a<<24);
+}
+
+static inline WORD to565(DWORD color)
+{
+	return (WORD)(((channel(color,0)*31+127)/255)<<11 | ((channel(color,1)*63+127)/255)<<5 | ((channel(color,2)*31+127)/255));
+}
+
+static inline DWORD from565(WORD c)
+{
+	int r = (c>>11)&31, g = (c>>5)&63, b = c&31;
+	return makeColor(r<<3|r>>2,g<<2|g>>4,b<<3|b>>2,255);
+}
+
+/**
+The palette a color block decodes to.
+\param fourColor Whether the block is in four color mode; in three color mode, the last entry is transparent black.
+*/
+static void buildPalette(WORD c0, WORD c1, bool fourColor, DWORD *palette)
+{
+	palette[0] = from565(c0);
+	palette[1] = from565(c1);
+	int p2[3], p3[3];
+	for(int c=0;c<3;c++)
+	{
+		int a = channel(palette[0],c), b = channel(palette[1],c);
+		p2[c] = fourColor ? (2*a+b)/3 : (a+b)/2;
+		p3[c] = fourColor ? (a+2*b)/3 : 0;
+	}
+	palette[2] = makeColor(p2[0],p2[1],p2[2],255);
+	palette[3] = fourColor ? makeColor(p3[0],p3[1],p3[2],255) : 0;
+}
+//@}
+
+/**@name Kernels
+Scalar and SSE2 versions of the per-pixel work, picked once by what the CPU supports.
+*/
+//@{
+
+/**
+Per channel minimum and maximum of a block's colors.
+\param skipMask Bit per pixel to leave out.
+*/
+static void colorBoundsScalar(const DWORD *pixels, int skipMask, DWORD &minColor, DWORD &maxColor)
+{
+	int lo[4] = {255,255,255,255}, hi[4] = {0,0,0,0};
+	for(int i=0;i<16;i++)
+	{
+		if(skipMask & (1<<i))
+			continue;
+		for(int c=0;c<4;c++)
+		{
+			lo[c] = min(lo[c],channel(pixels[i],c));
+			hi[c] = max(hi[c],channel(pixels[i],c));
+		}
+	}
+	minColor = makeColor(lo[0],lo[1],lo[2],lo[3]);
+	maxColor = makeColor(hi[0],hi[1],hi[2],hi[3]);
+}
+
+static void colorBoundsSSE2(const DWORD *pixels, int skipMask, DWORD &minColor, DWORD &maxColor)
+{
+	__m128i lo = _mm_set1_epi32(-1);
+	__m128i hi = _mm_setzero_si128();
+	for(int i=0;i<16;i+=4)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i*)(pixels+i));
+		int m = skipMask>>i;
+		__m128i skip = _mm_set_epi32(-((m>>3)&1),-((m>>2)&1),-((m>>1)&1),-(m&1));
+		lo = _mm_min_epu8(lo,_mm_or_si128(p,skip)); //Skipped pixels become white for the minimum and black for the maximum
+		hi = _mm_max_epu8(hi,_mm_andnot_si128(skip,p));
+	}
+	lo = _mm_min_epu8(lo,_mm_shuffle_epi32(lo,_MM_SHUFFLE(2,3,0,1)));
+	lo = _mm_min_epu8(lo,_mm_shuffle_epi32(lo,_MM_SHUFFLE(1,0,3,2)));
+	hi = _mm_max_epu8(hi,_mm_shuffle_epi32(hi,_MM_SHUFFLE(2,3,0,1)));
+	hi = _mm_max_epu8(hi,_mm_shuffle_epi32(hi,_MM_SHUFFLE(1,0,3,2)));
+	minColor = (DWORD)_mm_cvtsi128_si32(lo);
+	maxColor = (DWORD)_mm_cvtsi128_si32(hi);
+}
+
+/**
+Index of the closest palette color for each pixel, two bits per pixel. Alpha is ignored.
+*/
+static DWORD colorIndicesScalar(const DWORD *pixels, const DWORD *palette)
+{
+	DWORD indices = 0;
+	for(int i=0;i<16;i++)
+	{
+		int best = 0, bestDistance = INT_MAX;
+		for(int j=0;j<4;j++)
+		{
+			int distance = 0;
+			for(int c=0;c<3;c++)
+			{
+				int d = channel(pixels[i],c)-channel(palette[j],c);
+				distance += d*d;
+			}
+			if(distance<bestDistance)
+			{
+				best = j;
+				bestDistance = distance;
+			}
+		}
+		indices |= best<<(2*i);
+	}
+	return indices;
+}
+
+/**
+Squared distances between four pixels and a color.
+*/
+static inline __m128i colorDistancesSSE2(__m128i pixels, __m128i color, __m128i zero)
+{
+	__m128i diff = _mm_or_si128(_mm_subs_epu8(pixels,color),_mm_subs_epu8(color,pixels));
+	__m128i lo = _mm_unpacklo_epi8(diff,zero);
+	__m128i hi = _mm_unpackhi_epi8(diff,zero);
+	lo = _mm_madd_epi16(lo,lo); //R*R+G*G and B*B+A*A of pixels 0 and 1
+	hi = _mm_madd_epi16(hi,hi);
+	lo = _mm_add_epi32(lo,_mm_shuffle_epi32(lo,_MM_SHUFFLE(2,3,0,1)));
+	hi = _mm_add_epi32(hi,_mm_shuffle_epi32(hi,_MM_SHUFFLE(2,3,0,1)));
+	return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo),_mm_castsi128_ps(hi),_MM_SHUFFLE(2,0,2,0)));
+}
+
+static DWORD colorIndicesSSE2(const DWORD *pixels, const DWORD *palette)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgbMask = _mm_set1_epi32(0x00FFFFFF);
+	__m128i colors[4];
+	for(int j=0;j<4;j++)
+		colors[j] = _mm_set1_epi32(palette[j] & 0x00FFFFFF);
+
+	DWORD indices = 0;
+	for(int i=0;i<16;i+=4)
+	{
+		__m128i p = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pixels+i)),rgbMask);
+		__m128i best = colorDistancesSSE2(p,colors[0],zero);
+		__m128i bestIndex = zero;
+		for(int j=1;j<4;j++)
+		{
+			__m128i distance = colorDistancesSSE2(p,colors[j],zero);
+			__m128i closer = _mm_cmplt_epi32(distance,best);
+			best = _mm_or_si128(_mm_and_si128(closer,distance),_mm_andnot_si128(closer,best));
+			bestIndex = _mm_or_si128(_mm_and_si128(closer,_mm_set1_epi32(j)),_mm_andnot_si128(closer,bestIndex));
+		}
+		__declspec(align(16)) int found[4];
+		_mm_store_si128((__m128i*)found,bestIndex);
+		indices |= (found[0] | found[1]<<2 | found[2]<<4 | found[3]<<6) << (2*i);
+	}
+	return indices;
+}
+
+typedef void (*ColorBoundsFunc)(const DWORD *pixels, int skipMask, DWORD &minColor, DWORD &maxColor);
+typedef DWORD (*ColorIndicesFunc)(const DWORD *pixels, const DWORD *palette);
+
+static bool hasSSE2()
+{
+	int info[4];
+	__cpuid(info,1);
+	return (info[3] & (1<<26))!=0;
+}
+
+static const bool useSSE2 = hasSSE2();
+static const ColorBoundsFunc colorBounds = useSSE2 ? &colorBoundsSSE2 : &colorBoundsScalar;
+static const ColorIndicesFunc colorIndices = useSSE2 ? &colorIndicesSSE2 : &colorIndicesScalar;
+//@}
+
+/**@name Block encoding */
+//@{
+
+/**
+Turn a bounding box into endpoints along the diagonal the colors lie on. Green is the reference channel as it has the most weight.
+\param e0 Starts as the box's maximum; red and blue are swapped with e1's where they fall with green (or, for gray-green blocks, blue with red).
+*/
+static void chooseDiagonal(const DWORD *pixels, int skipMask, DWORD &e0, DWORD &e1)
+{
+	int center[3];
+	for(int c=0;c<3;c++)
+		center[c] = (channel(e0,c)+channel(e1,c))/2;
+	int covRG = 0, covBG = 0, covRB = 0;
+	for(int i=0;i<16;i++)
+	{
+		if(skipMask & (1<<i))
+			continue;
+		int r = channel(pixels[i],0)-center[0], g = channel(pixels[i],1)-center[1], b = channel(pixels[i],2)-center[2];
+		covRG += r*g;
+		covBG += b*g;
+		covRB += r*b;
+	}
+
+	DWORD swapMask = 0;
+	if(channel(e0,1)!=channel(e1,1))
+	{
+		if(covRG<0)
+			swapMask |= 0xFF;
+		if(covBG<0)
+			swapMask |= 0xFF0000;
+	}
+	else if(covRB<0)
+		swapMask |= 0xFF0000;
+	DWORD swapped = (e0^e1) & swapMask;
+	e0 ^= swapped;
+	e1 ^= swapped;
+}
+
+/**
+Move endpoints toward each other by a sixteenth of their distance.
+*/
+static void insetEndpoints(DWORD &e0, DWORD &e1)
+{
+	int a[3], b[3];
+	for(int c=0;c<3;c++)
+	{
+		a[c] = channel(e0,c);
+		b[c] = channel(e1,c);
+		int inset = (b[c]-a[c])/16;
+		a[c] += inset;
+		b[c] -= inset;
+	}
+	e0 = makeColor(a[0],a[1],a[2],255);
+	e1 = makeColor(b[0],b[1],b[2],255);
+}
+
+/**
+Encode the color half of a block.
+\param transparentMask Bit per pixel to make transparent; if any, the block uses the three color mode. Only BC1 supports this.
+\param skipMask Bit per pixel whose color doesn't matter, left out when choosing endpoints.
+*/
+static void encodeColorBlock(const DWORD *pixels, int transparentMask, int skipMask, BYTE *dest)
+{
+	WORD c0 = 0, c1 = 0;
+	DWORD indices = 0xFFFFFFFF; //All transparent
+	if(transparentMask!=0xFFFF)
+	{
+		DWORD e0, e1;
+		colorBounds(pixels,skipMask,e1,e0);
+		chooseDiagonal(pixels,skipMask,e0,e1);
+		insetEndpoints(e0,e1);
+		c0 = to565(e0);
+		c1 = to565(e1);
+
+		//The endpoint order selects the mode: c0>c1 for four colors, c0<=c1 for three and transparent. Equal endpoints decode the same either way.
+		bool fourColor = transparentMask==0;
+		if(fourColor ? c0<c1 : c0>c1)
+		{
+			WORD t = c0;
+			c0 = c1;
+			c1 = t;
+		}
+
+		DWORD palette[4];
+		buildPalette(c0,c1,fourColor,palette);
+		if(!fourColor)
+			palette[3] = palette[2]; //Never the closest; transparent pixels are set below
+		indices = colorIndices(pixels,palette);
+		for(int i=0;i<16;i++)
+		{
+			if(transparentMask & (1<<i))
+				indices |= 3u<<(2*i);
+		}
+	}
+	memcpy(dest,&c0,sizeof(WORD));
+	memcpy(dest+2,&c1,sizeof(WORD));
+	memcpy(dest+4,&indices,sizeof(DWORD));
+}
+
+/**
+Encode BC3's alpha half of a block, interpolating between the exact minimum and maximum with eight values.
+*/
+static void encodeAlphaBlock(const DWORD *pixels, BYTE *dest)
+{
+	int lo = 255, hi = 0;
+	for(int i=0;i<16;i++)
+	{
+		lo = min(lo,channel(pixels[i],3));
+		hi = max(hi,channel(pixels[i],3));
+	}
+	dest[0] = (BYTE)hi;
+	dest[1] = (BYTE)lo;
+
+	ULONGLONG indices = 0;
+	if(hi>lo)
+	{
+		int range = hi-lo;
+		for(int i=0;i<16;i++)
+		{
+			int step = ((hi-channel(pixels[i],3))*7+range/2)/range; //0 is the maximum, 7 the minimum
+			int index = step==0 ? 0 : step==7 ? 1 : step+1; //Indices 0 and 1 are the endpoints, 2-7 the values in between, from the maximum down
+			indices |= (ULONGLONG)index<<(3*i);
+		}
+	}
+	memcpy(dest+2,&indices,6);
+}
+//@}
+
+/**
+Bytes per block.
+*/
+UINT BCEncoder::getBlockBytes(DXGI_FORMAT format)
+{
+	return format==DXGI_FORMAT_BC1_UNORM ? 8 : 16;
+}
+
+/**
+Bytes per row of blocks of a mip.
+*/
+UINT BCEncoder::getPitch(DXGI_FORMAT format, UINT width)
+{
+	return max((width+3)/4,1u)*getBlockBytes(format);
+}
+
+UINT BCEncoder::countBlocks(UINT width, UINT height)
+{
+	return max((width+3)/4,1u)*max((height+3)/4,1u);
+}
+
+/**
+Encode a block of pixels.
+\param format DXGI_FORMAT_BC1_UNORM or DXGI_FORMAT_BC3_UNORM.
+\param pixels 16 R8G8B8A8 pixels, row by row.
+*/
+void BCEncoder::encodeBlock(DXGI_FORMAT format, const DWORD *pixels, BYTE *dest)
+{
+	if(format==DXGI_FORMAT_BC1_UNORM)
+	{
+		int transparent = 0;
+		for(int i=0;i<16;i++)
+		{
+			if(channel(pixels[i],3)<128)
+				transparent |= 1<<i;
+		}
+		encodeColorBlock(pixels,transparent,transparent,dest);
+	}
+	else
+	{
+		int invisible = 0;
+		for(int i=0;i<16;i++)
+		{
+			if(channel(pixels[i],3)==0)
+				invisible |= 1<<i;
+		}
+		encodeAlphaBlock(pixels,dest);
+		encodeColorBlock(pixels,0,invisible==0xFFFF ? 0 : invisible,dest+8);
+	}
+}
+
+/**
+Decode a block, as the GPU would; for measuring the error.
+*/
+void BCEncoder::decodeBlock(DXGI_FORMAT format, const BYTE *block, DWORD *pixels)
+{
+	BYTE alpha[8];
+	ULONGLONG alphaIndices = 0;
+	if(format==DXGI_FORMAT_BC3_UNORM)
+	{
+		alpha[0] = block[0];
+		alpha[1] = block[1];
+		for(int k=2;k<8;k++)
+			alpha[k] = alpha[0]>alpha[1] ? (BYTE)(((8-k)*alpha[0]+(k-1)*alpha[1])/7) : k<6 ? (BYTE)(((6-k)*alpha[0]+(k-1)*alpha[1])/5) : (k==6 ? 0 : 255);
+		memcpy(&alphaIndices,block+2,6);
+		block += 8;
+	}
+
+	WORD c0, c1;
+	DWORD indices;
+	memcpy(&c0,block,sizeof(WORD));
+	memcpy(&c1,block+2,sizeof(WORD));
+	memcpy(&indices,block+4,sizeof(DWORD));
+	DWORD palette[4];
+	buildPalette(c0,c1,c0>c1 || format!=DXGI_FORMAT_BC1_UNORM,palette); //BC3 color is always four color
+	for(int i=0;i<16;i++)
+	{
+		pixels[i] = palette[(indices>>(2*i))&3];
+		if(format==DXGI_FORMAT_BC3_UNORM)
+			pixels[i] = (pixels[i] & 0x00FFFFFF) | ((DWORD)alpha[(alphaIndices>>(3*i))&7]<<24);
+	}
+}
+
+/**
+Encode rows of blocks of a mip. Pixels past the edges of mips that aren't a whole number of blocks repeat the last row and column.
+\param source R8G8B8A8 pixels.
+\param width Mip width in pixels.
+\param height Mip height in pixels.
+\param dest Start of the encoded mip, not of the first row.
+\param firstRow First row of blocks to encode.
+*/
+void BCEncoder::encodeRows(DXGI_FORMAT format, const BYTE *source, UINT sourcePitch, UINT width, UINT height, BYTE *dest, UINT destPitch, UINT firstRow, UINT numRows)
+{
+	UINT blockBytes = getBlockBytes(format);
+	UINT blocksX = max((width+3)/4,1u);
+	DWORD pixels[16];
+	for(UINT by=firstRow;by<firstRow+numRows;by++)
+	{
+		BYTE *block = dest+by*destPitch;
+		for(UINT bx=0;bx<blocksX;bx++,block+=blockBytes)
+		{
+			for(UINT y=0;y<4;y++)
+			{
+				const DWORD *row = (const DWORD*)(source+min(by*4+y,height-1)*sourcePitch);
+				for(UINT x=0;x<4;x++)
+					pixels[y*4+x] = row[min(bx*4+x,width-1)];
+			}
+			encodeBlock(format,pixels,block);
+		}
+	}
+}
+
+/** Block rows of one mip; the unit of work when encoding on several threads */
+struct EncodeChunk
+{
+	UINT mip;
+	UINT firstRow;
+	UINT numRows;
+};
+
+/**
+Chunks of a texture shared between threads; each takes the next one until none are left.
+Helpers share ownership, as one may only get to run after the texture is done; it then finds no chunks left and doesn't touch the data.
+*/
+struct EncodeTask
+{
+	DXGI_FORMAT format;
+	UINT width;
+	UINT height;
+	const D3D10_SUBRESOURCE_DATA *source;
+	const D3D10_SUBRESOURCE_DATA *dest;
+	std::vector<EncodeChunk> chunks;
+	std::atomic<size_t> next;
+	std::atomic<size_t> done; /**< Chunks encoded; the data is only released once all are */
+	std::mutex mutex;
+	std::condition_variable allDone;
+
+	void run()
+	{
+		for(size_t c=next++;c<chunks.size();c=next++)
+		{
+			const EncodeChunk &chunk = chunks[c];
+			BCEncoder::encodeRows(format,(const BYTE*)source[chunk.mip].pSysMem,source[chunk.mip].SysMemPitch,max(width>>chunk.mip,1u),max(height>>chunk.mip,1u),
+				(BYTE*)dest[chunk.mip].pSysMem,dest[chunk.mip].SysMemPitch,chunk.firstRow,chunk.numRows);
+			if(++done==chunks.size())
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				allDone.notify_all();
+			}
+		}
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while(done<chunks.size())
+			allDone.wait(lock);
+	}
+};
+
+/** Worker job taking chunks of a texture alongside the thread that's encoding it */
+class EncodeHelper: public WorkerPool::Job
+{
+private:
+	std::shared_ptr<EncodeTask> task;
+public:
+	EncodeHelper(const std::shared_ptr<EncodeTask> &task): task(task){}
+	void run()
+	{
+		task->run();
+	}
+};
+
+/**
+Encode all mips of a texture. Large textures are split into runs of block rows across mips; workers of the given pool take runs alongside the calling thread.
+Workers busy with other jobs join late or not at all, in which case the calling thread encodes more of the texture itself.
+\param width Width of mip 0 in pixels.
+\param height Height of mip 0 in pixels.
+\param source R8G8B8A8 data per mip.
+\param dest Allocated block data per mip, with the pitch set (see getPitch()).
+\param helpers Pool whose workers help encode; NULL to encode on the calling thread only. Don't pass the pool of the calling thread.
+\param threads Threads to use at most, the calling one included.
+*/
+void BCEncoder::encodeMips(DXGI_FORMAT format, UINT width, UINT height, UINT numMips, const D3D10_SUBRESOURCE_DATA *source, const D3D10_SUBRESOURCE_DATA *dest, WorkerPool *helpers, int threads)
+{
+	static const UINT CHUNK_BLOCKS = 256;
+	std::shared_ptr<EncodeTask> task = std::make_shared<EncodeTask>();
+	task->format = format;
+	task->width = width;
+	task->height = height;
+	task->source = source;
+	task->dest = dest;
+	task->next = 0;
+	task->done = 0;
+	UINT totalBlocks = 0;
+	for(UINT i=0;i<numMips;i++)
+	{
+		UINT blocksX = max((max(width>>i,1u)+3)/4,1u);
+		UINT blocksY = max((max(height>>i,1u)+3)/4,1u);
+		UINT rowsPerChunk = max(CHUNK_BLOCKS/blocksX,1u);
+		for(UINT row=0;row<blocksY;row+=rowsPerChunk)
+		{
+			EncodeChunk chunk = {i,row,min(rowsPerChunk,blocksY-row)};
+			task->chunks.push_back(chunk);
+		}
+		totalBlocks += blocksX*blocksY;
+	}
+
+	if(helpers && totalBlocks>=PARALLEL_MIN_BLOCKS)
+	{
+		int numHelpers = min(min(threads-1,helpers->getNumThreads()),(int)task->chunks.size()-1);
+		for(int i=0;i<numHelpers;i++)
+		{
+			EncodeHelper *helper = new (std::nothrow) EncodeHelper(task);
+			if(helper)
+				helpers->submitHelper(helper);
+		}
+	}
+	task->run();
+	task->wait(); //For chunks helpers are still encoding
+}
+
+/**
+Decode a mip to R8G8B8A8 pixels.
+\param dest width*height pixels.
+*/
+void BCEncoder::decode(DXGI_FORMAT format, const BYTE *source, UINT sourcePitch, UINT width, UINT height, DWORD *dest)
+{
+	UINT blockBytes = getBlockBytes(format);
+	DWORD pixels[16];
+	for(UINT by=0;by<(height+3)/4;by++)
+	{
+		for(UINT bx=0;bx<(width+3)/4;bx++)
+		{
+			decodeBlock(format,source+by*sourcePitch+bx*blockBytes,pixels);
+			for(UINT y=0;y<4 && by*4+y<height;y++)
+			{
+				for(UINT x=0;x<4 && bx*4+x<width;x++)
+					dest[(by*4+y)*width+bx*4+x] = pixels[y*4+x];
+			}
+		}
+	}
+}
@@ -0,0 +1,26 @@
+/**
+\file bcencoder.h
+*/
+
+#pragma once
+
+class BCEncoder;
+
+#include <windows.h>
+#include <d3d10.h>
+#include "workerpool.h"
+
+class BCEncoder
+{
+public:
+	static const UINT PARALLEL_MIN_BLOCKS = 4096; /**< Textures with fewer blocks (256x256 pixels) are encoded on one thread; handing them to workers costs more than it gains */
+
+	static UINT getBlockBytes(DXGI_FORMAT format);
+	static UINT getPitch(DXGI_FORMAT format, UINT width);
+	static UINT countBlocks(UINT width, UINT height);
+	static void encodeBlock(DXGI_FORMAT format, const DWORD *pixels, BYTE *dest);
+	static void decodeBlock(DXGI_FORMAT format, const BYTE *block, DWORD *pixels);
+	static void encodeRows(DXGI_FORMAT format, const BYTE *source, UINT sourcePitch, UINT width, UINT height, BYTE *dest, UINT destPitch, UINT firstRow, UINT numRows);
+	static void encodeMips(DXGI_FORMAT format, UINT width, UINT height, UINT numMips, const D3D10_SUBRESOURCE_DATA *source, const D3D10_SUBRESOURCE_DATA *dest, WorkerPool *helpers, int threads);
+	static void decode(DXGI_FORMAT format, const BYTE *source, UINT sourcePitch, UINT width, UINT height, DWORD *dest);
+};
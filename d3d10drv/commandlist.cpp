@@ -0,0 +1,385 @@
+/**
+\class CommandList
+Per-frame list of opaque primitives whose submission is deferred so they can be sorted by render state.
+
+Drawing everything in the order the game sends it means a draw call for nearly every texture or flag change. Opaque geometry doesn't depend on draw order
+(depth testing takes care of that), so it's recorded here instead and sorted by shader, blend/depth class and bound textures when the list is flushed.
+Replaying then goes through the regular state setting functions; as these only commit buffered geometry when state actually changes, every group of
+equal state ends up as a single draw call.
+
+The list must be flushed before anything that relies on earlier geometry having been drawn: translucent and modulated primitives (these keep the game's order),
+depth clears, the postprocessing step in EndFlash(), viewport/projection changes and updates to textures recorded commands use. Realtime textures keep their
+last few versions (see TextureCache::updateMip()), so their updates only flush commands recorded with a version that's about to be overwritten.
+
+Optionally, translucent and modulated primitives are recorded too. These keep their place: each gets a segment of its own, and sorting only happens within segments.
+Then only real dependencies flush the list, usually just a few times per frame.
+
+On a flush, the geometry of all commands is written to the buffers first, with a single map per buffer, and then drawn range by range. Drawing straight
+from the buffers would unmap them before every draw call and map them again for the next write.
+*/
+
+#include <algorithm>
+#include "commandlist.h"
+#include "d3d10drv.h"
+#include "polyflags.h"
+#include "shader_complexsurface.h"
+#include "shader_gouraudpolygon.h"
+#include "dynamicgeometrybuffer.h"
+#include "worldgeometrybuffer.h"
+#include "fanencoder.h"
+
+/**
+Key with all passes disabled.
+\param shader D3D::ShaderName to draw with.
+*/
+CommandList::StateKey::StateKey(int shader): shader(shader), blendFlags(0)
+{
+	for(int i=0;i<TextureCache::DUMMY_NUM_TEXTURE_PASSES;i++)
+	{
+		textures[i]=0;
+		extraIndex[i]=-1;
+		versions[i]=0;
+	}
+}
+
+bool CommandList::StateKey::operator==(const StateKey &other) const
+{
+	if(shader!=other.shader || blendFlags!=other.blendFlags)
+		return false;
+	for(int i=0;i<TextureCache::DUMMY_NUM_TEXTURE_PASSES;i++)
+	{
+		if(textures[i]!=other.textures[i] || extraIndex[i]!=other.extraIndex[i] || versions[i]!=other.versions[i])
+			return false;
+	}
+	return true;
+}
+
+bool CommandList::StateKey::operator<(const StateKey &other) const
+{
+	if(shader!=other.shader)
+		return shader<other.shader;
+	if(blendFlags!=other.blendFlags)
+		return blendFlags<other.blendFlags;
+	for(int i=0;i<TextureCache::DUMMY_NUM_TEXTURE_PASSES;i++)
+	{
+		if(textures[i]!=other.textures[i])
+			return textures[i]<other.textures[i];
+		if(extraIndex[i]!=other.extraIndex[i])
+			return extraIndex[i]<other.extraIndex[i];
+		if(versions[i]!=other.versions[i])
+			return versions[i]<other.versions[i];
+	}
+	return false;
+}
+
+bool CommandList::Command::operator<(const Command &other) const
+{
+	if(segment!=other.segment)
+		return segment<other.segment;
+	if(key<other.key)
+		return true;
+	if(other.key<key)
+		return false;
+	return order<other.order;
+}
+
+/**
+\param enabled Whether opaque primitives are recorded.
+\param recordAll Whether translucent and modulated ones are recorded as well.
+*/
+CommandList::CommandList(TextureCache *textureCache, bool enabled, bool recordAll): textureCache(textureCache), enabled(enabled), recordAll(enabled && recordAll), segment(0), lastOrdered(false)
+{
+
+}
+
+/**
+Returns whether a primitive with these flags may be drawn out of order.
+\param flags Polyflags, including custom ones.
+*/
+bool CommandList::isDeferrable(DWORD flags)
+{
+	return !(flags & (PF_Translucent|PF_Modulated|PF_AlphaBlend));
+}
+
+bool CommandList::isEnabled() const
+{
+	return enabled;
+}
+
+/**
+Returns whether a primitive with these flags should be recorded rather than drawn right away.
+\param flags Polyflags, including custom ones.
+*/
+bool CommandList::records(DWORD flags) const
+{
+	return recordAll || (enabled && isDeferrable(flags));
+}
+
+/**
+Returns whether primitives that must keep their order were recorded; anything drawn right away then has to wait for them.
+*/
+bool CommandList::hasOrderedCommands() const
+{
+	return segment>0;
+}
+
+/**
+Start recording a primitive. Consecutive primitives with the same state are merged into one command.
+\param key Render state for the primitive. blendFlags only needs to contain the raw polyflags; irrelevant ones are masked out here.
+\param stride Size of the vertices that will be written; 0 if the command only gets cached fans.
+*/
+void CommandList::beginCommand(const StateKey &key, UINT stride)
+{
+	StateKey k = key;
+	k.blendFlags &= PF_Invisible|PF_Masked|PF_Translucent|PF_Modulated|PF_AlphaBlend|PF_Occlude|Shader_GouraudPolygon::BATCH_FLAGS;
+	if(!commands.empty() && commands.back().stride==stride && commands.back().key==k)
+		return;
+
+	bool ordered = !isDeferrable(k.blendFlags);
+	if(ordered || lastOrdered) //Opaque commands after an ordered one go in the next segment
+		segment++;
+	lastOrdered = ordered;
+
+	Command c = {k,segment,fans.size(),0,vertices.size(),stride,commands.size()};
+	commands.push_back(c);
+
+	for(int i=0;i<TextureCache::DUMMY_NUM_TEXTURE_PASSES;i++)
+	{
+		if(k.textures[i])
+		{
+			std::pair<std::unordered_map<DWORD64,unsigned int>::iterator,bool> ref = referencedTextures.insert(std::make_pair(k.textures[i],k.versions[i]));
+			if(!ref.second && k.versions[i]<ref.first->second)
+				ref.first->second = k.versions[i];
+		}
+	}
+}
+
+/**
+Record a triangle fan for the current command. Call getVertex() num times afterwards to fill it.
+*/
+void CommandList::indexTriangleFan(int num)
+{
+	Fan f = {num,-1};
+	fans.push_back(f);
+	commands.back().numFans++;
+}
+
+/**
+Record a triangle fan of vertices cached in the WorldGeometryBuffer for the current command; no vertices are written.
+\param firstVertex Index of the fan's first vertex in the cache.
+*/
+void CommandList::indexCachedFan(int num, UINT firstVertex)
+{
+	Fan f = {num,(int)firstVertex};
+	fans.push_back(f);
+	commands.back().numFans++;
+}
+
+/**
+Get storage for the next vertex of the current command.
+\note Pointer is only valid until the next call.
+*/
+void *CommandList::getVertex()
+{
+	size_t offset = vertices.size();
+	vertices.resize(offset+commands.back().stride);
+	return &vertices[offset];
+}
+
+bool CommandList::hasContents() const
+{
+	return !commands.empty();
+}
+
+/**
+Returns true if a recorded command uses a texture; it should then be flushed before the texture is changed or deleted.
+*/
+bool CommandList::referencesTexture(DWORD64 id) const
+{
+	return referencedTextures.find(id)!=referencedTextures.end();
+}
+
+/**
+Returns true if a recorded command uses a version of a realtime texture older than the given one; see TextureCache::getOldestKeptVersion().
+*/
+bool CommandList::referencesTextureBefore(DWORD64 id, unsigned int version) const
+{
+	std::unordered_map<DWORD64,unsigned int>::const_iterator i = referencedTextures.find(id);
+	return i!=referencedTextures.end() && i->second<version;
+}
+
+/**
+Bind shader, textures and blend state for a command. Also used by the renderer interface to set state for primitives it draws right away.
+*/
+void CommandList::bindState(const StateKey &key) const
+{
+	D3D::switchToShader(key.shader);
+	Shader_Unreal *shader = static_cast<Shader_Unreal*>(D3D::getShader(key.shader));
+
+	textureCache->setTexture(shader,TextureCache::PASS_DIFFUSE,key.textures[TextureCache::PASS_DIFFUSE],key.extraIndex[TextureCache::PASS_DIFFUSE],key.versions[TextureCache::PASS_DIFFUSE]);
+	shader->setFlags(key.blendFlags);
+
+	if(key.shader==D3D::SHADER_COMPLEXSURFACE)
+	{
+		Shader_ComplexSurface *cs = static_cast<Shader_ComplexSurface*>(shader);
+		for(int i=TextureCache::PASS_DIFFUSE+1;i<TextureCache::DUMMY_NUM_TEXTURE_PASSES;i++)
+		{
+			if(key.textures[i])
+			{
+				textureCache->setTexture(cs,(TextureCache::TexturePass)i,key.textures[i],key.extraIndex[i],key.versions[i]);
+				cs->switchPass((TextureCache::TexturePass)i,1);
+			}
+			else
+			{
+				cs->switchPass((TextureCache::TexturePass)i,0);
+			}
+		}
+	}
+}
+
+/**
+Write the geometry of commands to the buffers, mapping each buffer once, and split it into packets to draw.
+Commands recorded apart but equal after sorting share a packet, so they still go out as a single draw call.
+Stops early if the world index buffer is full and can't grow; draw the packets and call again for the rest.
+\param nextCommand First command to upload; set to the one to continue with, or the number of commands if all are uploaded.
+\param nextFan First fan of that command to upload; set to the one to continue with.
+*/
+void CommandList::upload(size_t &nextCommand, size_t &nextFan)
+{
+	//Draw what's buffered and unbind, as buffers may be recreated to fit
+	D3D::render();
+	D3D::switchToShader(-1);
+
+	FanEncoder::Mode mode = FanEncoder::getMode();
+	size_t numVertices[D3D::DUMMY_NUM_SHADERS] = {0};
+	size_t numIndices[D3D::DUMMY_NUM_SHADERS] = {0};
+	bool used[D3D::DUMMY_NUM_SHADERS] = {false};
+	size_t firstCommand = nextCommand, firstFan = nextFan;
+	for(size_t c=firstCommand;c<commands.size();c++)
+	{
+		const Command &command = commands[c];
+		used[command.key.shader] |= command.numFans>0;
+		for(size_t f=c==firstCommand ? firstFan : command.firstFan;f<command.firstFan+command.numFans;f++)
+		{
+			if(fans[f].firstVertex<0)
+				numVertices[command.key.shader] += fans[f].num;
+			numIndices[command.key.shader] += FanEncoder::countIndices(mode,fans[f].num);
+		}
+	}
+	for(int i=0;i<D3D::DUMMY_NUM_SHADERS;i++)
+	{
+		if(!used[i])
+			continue;
+		if(i==D3D::SHADER_COMPLEXSURFACE)
+			static_cast<WorldGeometryBuffer*>(D3D::getShader(i)->getGeometryBuffer())->beginBatch(numIndices[i]);
+		else
+			static_cast<DynamicGeometryBuffer*>(D3D::getShader(i)->getGeometryBuffer())->beginBatch(numVertices[i],numIndices[i]);
+	}
+
+	packets.clear();
+	Packet p = {0,GeometryBuffer::DrawRange()};
+	nextCommand = commands.size();
+	for(size_t c=firstCommand;c<commands.size() && nextCommand==commands.size();c++)
+	{
+		const Command &command = commands[c];
+		GeometryBuffer *buf = D3D::getShader(command.key.shader)->getGeometryBuffer();
+		const BYTE *src = vertices.data()+command.firstVertex;
+		if(p.range.numIndices>0 && !(commands[p.command].key==command.key))
+		{
+			packets.push_back(p);
+			p.range = GeometryBuffer::DrawRange();
+		}
+		if(p.range.numIndices==0)
+			p.command = c;
+		size_t resumeFan = c==firstCommand ? firstFan : command.firstFan;
+		for(size_t f=command.firstFan;f<resumeFan;f++) //Uploaded by the last call
+		{
+			if(fans[f].firstVertex<0)
+				src += fans[f].num*command.stride;
+		}
+		for(size_t f=resumeFan;f<command.firstFan+command.numFans;f++)
+		{
+			if(fans[f].firstVertex>=0)
+			{
+				WorldGeometryBuffer *worldBuf = static_cast<WorldGeometryBuffer*>(buf);
+				WorldGeometryBuffer::BatchResult result;
+				while((result=worldBuf->batchTriangleFan(fans[f].firstVertex,fans[f].num,p.range))==WorldGeometryBuffer::BATCH_NEW_RANGE) //Fan is in another index window; start a new packet
+				{
+					packets.push_back(p);
+					p.range = GeometryBuffer::DrawRange();
+				}
+				if(result==WorldGeometryBuffer::BATCH_FULL) //Continue from this fan once what's uploaded is drawn
+				{
+					nextCommand = c;
+					nextFan = f;
+					break;
+				}
+				continue;
+			}
+			DynamicGeometryBuffer *dynamicBuf = static_cast<DynamicGeometryBuffer*>(buf);
+			while(!dynamicBuf->batchTriangleFan(fans[f].num,p.range))
+			{
+				packets.push_back(p);
+				p.range = GeometryBuffer::DrawRange();
+			}
+			memcpy(dynamicBuf->getVertices(fans[f].num),src,fans[f].num*command.stride); //Each shader's buffer has the exact stride of its vertices
+			src += fans[f].num*command.stride;
+		}
+	}
+	if(p.range.numIndices>0)
+		packets.push_back(p);
+
+	for(int i=0;i<D3D::DUMMY_NUM_SHADERS;i++)
+	{
+		if(!used[i])
+			continue;
+		if(i==D3D::SHADER_COMPLEXSURFACE)
+			static_cast<WorldGeometryBuffer*>(D3D::getShader(i)->getGeometryBuffer())->endBatch();
+		else
+			static_cast<DynamicGeometryBuffer*>(D3D::getShader(i)->getGeometryBuffer())->endBatch();
+	}
+}
+
+/**
+Sort recorded commands by state and submit them. Commands with equal state keep the game's order, as Command::order breaks ties in the sort.
+*/
+void CommandList::flush()
+{
+	if(commands.empty())
+		return;
+
+	std::sort(commands.begin(),commands.end());
+	size_t nextCommand = 0, nextFan = commands[0].firstFan;
+	while(nextCommand<commands.size())
+	{
+		upload(nextCommand,nextFan);
+
+		for(std::vector<Packet>::const_iterator p=packets.begin();p!=packets.end();p++)
+		{
+			const StateKey &key = commands[p->command].key;
+			bindState(key);
+			GeometryBuffer *buf = D3D::getShader(key.shader)->getGeometryBuffer();
+			if(key.shader==D3D::SHADER_COMPLEXSURFACE)
+				static_cast<WorldGeometryBuffer*>(buf)->queueRange(p->range);
+			else
+				static_cast<DynamicGeometryBuffer*>(buf)->queueRange(p->range);
+			D3D::render();
+		}
+	}
+
+	clear();
+}
+
+/**
+Throw away recorded commands without drawing them.
+*/
+void CommandList::clear()
+{
+	commands.clear();
+	fans.clear();
+	vertices.clear();
+	packets.clear();
+	referencedTextures.clear();
+	segment = 0;
+	lastOrdered = false;
+}
@@ -0,0 +1,91 @@
+/**
+\file commandlist.h
+*/
+
+#pragma once
+
+class CommandList;
+
+#include <vector>
+#include <unordered_map>
+#include "texturecache.h"
+#include "geometrybuffer.h"
+
+class CommandList
+{
+public:
+	/**
+	Render state a recorded primitive depends on. Commands with equal keys are drawn with a single draw call.
+	\note Members are in sort order: shader, then blend/depth class, then the texture tuple.
+	*/
+	struct StateKey
+	{
+		int shader; /**< D3D::ShaderName */
+		DWORD blendFlags; /**< Polyflags that select the blend and depth state (see Shader::setFlags()), and ones shaders take per batch */
+		DWORD64 textures[TextureCache::DUMMY_NUM_TEXTURE_PASSES]; /**< CacheID bound to each pass; 0 if the pass is disabled */
+		int extraIndex[TextureCache::DUMMY_NUM_TEXTURE_PASSES]; /**< External texture slot used for each pass, -1 for none */
+		unsigned int versions[TextureCache::DUMMY_NUM_TEXTURE_PASSES]; /**< TextureMetaData::version of each pass's texture, so realtime updates don't change recorded commands */
+
+		StateKey(int shader);
+		bool operator==(const StateKey &other) const;
+		bool operator<(const StateKey &other) const;
+	};
+
+private:
+	/** A run of triangle fans that share a state key */
+	struct Command
+	{
+		StateKey key;
+		size_t segment; /**< Commands are only sorted within a segment; each ordered (blended) command gets its own */
+		size_t firstFan; /**< Index of first fan in CommandList::fans */
+		size_t numFans;
+		size_t firstVertex; /**< Byte offset of first vertex in CommandList::vertices */
+		UINT stride; /**< Vertex size */
+		size_t order; /**< Recording order, keeps sort stable */
+
+		bool operator<(const Command &other) const;
+	};
+
+	/** A recorded triangle fan */
+	struct Fan
+	{
+		int num; /**< Vertex count */
+		int firstVertex; /**< First vertex in the WorldGeometryBuffer for cached fans, -1 if the vertices are in CommandList::vertices */
+	};
+
+	/** A range of a command's fans, uploaded and ready to draw */
+	struct Packet
+	{
+		size_t command;
+		GeometryBuffer::DrawRange range;
+	};
+
+	std::vector<Command> commands;
+	std::vector<Fan> fans;
+	std::vector<BYTE> vertices; /**< Vertex data for all commands, back to back */
+	std::vector<Packet> packets;
+	std::unordered_map<DWORD64,unsigned int> referencedTextures; /**< CacheIDs used by recorded commands and the oldest version used, so texture updates can flush first */
+	TextureCache *textureCache;
+	bool enabled;
+	bool recordAll;
+	size_t segment; /**< Segment of the next opaque command; nonzero if ordered commands were recorded */
+	bool lastOrdered;
+	void upload(size_t &nextCommand, size_t &nextFan);
+
+public:
+	CommandList(TextureCache *textureCache, bool enabled, bool recordAll);
+	static bool isDeferrable(DWORD flags);
+	bool isEnabled() const;
+	bool records(DWORD flags) const;
+	bool hasOrderedCommands() const;
+	void bindState(const StateKey &key) const;
+	void beginCommand(const StateKey &key, UINT stride);
+	void indexTriangleFan(int num);
+	void indexCachedFan(int num, UINT firstVertex);
+	void *getVertex();
+	bool hasContents() const;
+	bool referencesTexture(DWORD64 id) const;
+	bool referencesTextureBefore(DWORD64 id, unsigned int version) const;
+	void flush();
+	void clear();
+};
@@ -12,6 +12,7 @@ Shader for world geometry
 #define NUM_TEXTURE_PASSES 7
 
 #define NUM_TEXTURE_COORDS 5
+#define SURFACE_RECORD_SIZE 8 //float4s in a ComplexSurfaceRecord
 
 #define PASS_LIGHT 0
 #define PASS_DETAIL 1
@@ -23,8 +24,7 @@ Shader for world geometry
 struct VS_INPUT
 {	
 	float3 pos : POSITION;
-	float2 tex[NUM_TEXTURE_COORDS]: TEXCOORD0;	
-	uint flags: BLENDINDICES;
+	uint surface: BLENDINDICES; //Index of the surface's record
 };
 
 struct GS_INPUT
@@ -63,6 +63,15 @@ cbuffer TexturePasses
 
 Texture2D textures[NUM_TEXTURE_PASSES-1];
 
+/**
+Per surface records, see ComplexSurfaceRecord in VertexFormats.h:
+0: MapCoords X axis, U dot
+1: MapCoords Y axis, V dot
+2-6: pan U, pan V, mult U, mult V for each texture coordinate set
+7: polyflags
+*/
+Buffer<float4> surfaces;
+
 BlendState bstate_Translucent_ComplexSurface //To be able to simulate multi-pass light modulation
 {
 	BlendEnable[0] = TRUE;
@@ -85,11 +94,17 @@ GS_INPUT VS( VS_INPUT input )
 	output.origPos = float4(input.pos,1);
 	output.pos = projected;			
 	
+	//Texture coordinates from the surface's map coordinates, as the other renderers do on the CPU
+	int base = input.surface*SURFACE_RECORD_SIZE;
+	float4 xAxis = surfaces.Load(base);
+	float4 yAxis = surfaces.Load(base+1);
+	float2 mapCoord = float2(dot(xAxis.xyz,input.pos)-xAxis.w,dot(yAxis.xyz,input.pos)-yAxis.w);
 	for(int i=0;i<NUM_TEXTURE_COORDS;i++)
 	{
-		output.tex[i] = input.tex[i];
+		float4 panMult = surfaces.Load(base+2+i);
+		output.tex[i] = (mapCoord-panMult.xy)*panMult.zw;
 	}
-	output.flags = input.flags;
+	output.flags = asuint(surfaces.Load(base+7).x);
 	
 	//d3d vs unreal coords
 	output.pos.y =  -output.pos.y;
@@ -191,8 +206,8 @@ PS_OUTPUT2 PS( PS_INPUT input)
 		
 	//Handle texture passes
 	//Diffuse
-	float4 diffuse = texDiffuse.SampleBias(sam,input.tex[0],LODBIAS);
-	float4 diffusePoint = texDiffuse.SampleBias(samPoint,input.texCentroid,LODBIAS); //Centroid sampling for better behaviour with AA
+	float4 diffuse = sampleDiffuse(sam,input.tex[0],input.flags,false);
+	float4 diffusePoint = sampleDiffuse(samPoint,input.texCentroid,input.flags,true); //Centroid sampling for better behaviour with AA
 	output.color*=diffuseTexture(diffuse,diffusePoint,input.flags);
 	#if(CLASSIC_LIGHTING!=1)
 	//Brighten fullbright objects
@@ -6,6 +6,10 @@ Does not use Unreal data apart from a couple of PolyFlags. Does not require the
 Quite a lot of code, but splitting this up does not really seem worth it.
 
 An effort is made to reduce the amount of needed draw() calls. As such, state is only changed when absolutely necessary.
+
+With the NullDevice option, the device is a D3D10 null-driver device rendering to an offscreen back buffer, so the CPU side of the renderer can be profiled,
+with the per-frame counters in Stats, on a machine without a usable GPU. This is not a separate backend: it still runs on Windows with the D3D10 runtime and
+builds against the DirectX SDK, like the rest of the driver, which also links against the game's Windows-only Core and Engine.
 */
 #ifdef _KHGDEBUG
 #define _DEBUGDX //debug device
@@ -27,6 +31,7 @@ An effort is made to reduce the amount of needed draw() calls. As such, state is
 #include "shader_hdr.h"
 #include "shader_finalpass.h"
 #include "shader_dummy.h"
+#include "fanencoder.h"
 
 /**
 D3D Objects
@@ -38,6 +43,7 @@ static struct
 	ID3D10Device* device;
 	IDXGISwapChain* swapChain;
 	ID3D10RenderTargetView* backBufferRTV;
+	ID3D10Texture2D* offscreenBackBuffer; /**< Stands in for the swap chain's buffer when using the null device */
 } D3DObjects;
 
 /**
@@ -56,6 +62,9 @@ static D3D::Options options;
 static HWND hWnd;
 static int resX, resY;
 
+D3D::Stats D3D::stats;
+static D3D::Stats lastFrameStats;
+
 /**
 Create Direct3D device, swapchain, etc. Purely boilerplate stuff.
 
@@ -72,6 +81,8 @@ int D3D::init(HWND _hWnd,D3D::Options &createOptions)
 	CLAMP(options.aniso,0,16);
 	CLAMP(options.VSync,0,1);
 	CLAMP(options.LODBias,-10,10);
+	CLAMP(options.fanEncoding,0,FanEncoder::DUMMY_NUM_MODES-1);
+	FanEncoder::setMode((FanEncoder::Mode)options.fanEncoding); //Before the shaders and their buffers are created
 	UD3D10RenderDevice::debugs("Initializing Direct3D.");
 	
 	IDXGIAdapter* selectedAdapter = nullptr; 
@@ -82,6 +93,12 @@ int D3D::init(HWND _hWnd,D3D::Options &createOptions)
 		flags = D3D10_CREATE_DEVICE_DEBUG; //debug runtime (prints debug messages)
 	#endif
 
+	if(options.nullDevice)
+	{
+		UD3D10RenderDevice::debugs("Using null device; nothing will be drawn.");
+		driverType = D3D10_DRIVER_TYPE_NULL;
+	}
+
 	hr=D3D10CreateDevice(selectedAdapter,driverType,NULL,flags,D3D10_SDK_VERSION, &D3DObjects.device);
 	if(FAILED(hr))
 	{
@@ -92,6 +109,12 @@ int D3D::init(HWND _hWnd,D3D::Options &createOptions)
 	if(!D3D::findAALevel()) //Clamp MSAA option to max supported level.
 		return 0;
 
+	//Null device has no swap chain; D3D::resize() creates an offscreen back buffer instead
+	if(options.nullDevice)
+	{
+		return initShaders();
+	}
+
 	//Create device and swap chain
 	DXGI_SWAP_CHAIN_DESC sd;
 	ZeroMemory( &sd, sizeof( sd ) );
@@ -167,6 +190,7 @@ bool D3D::initShaders()
 	OPTION_TO_STRING(bumpMapping);
 	OPTION_TO_STRING(alphaToCoverage);
 	OPTION_TO_STRING(classicLighting);
+	OPTION_TO_STRING(GPUPalettes);
 	
 	D3D10_SHADER_MACRO macros[] = {
 	OPTIONSTRING_TO_SHADERVAR(aniso,"NUM_ANISO"),
@@ -176,6 +200,7 @@ bool D3D::initShaders()
 	OPTIONSTRING_TO_SHADERVAR(alphaToCoverage,"ALPHA_TO_COVERAGE_ENABLED"),
 	OPTIONSTRING_TO_SHADERVAR(bumpMapping,"BUMPMAPPING_ENABLED"),
 	OPTIONSTRING_TO_SHADERVAR(classicLighting,"CLASSIC_LIGHTING"),
+	OPTIONSTRING_TO_SHADERVAR(GPUPalettes,"GPU_PALETTES"),
 	NULL};	
 
 	
@@ -222,9 +247,8 @@ int D3D::createRenderTargetViews()
 	HRESULT hr;
 
 	//Get backbuffer
-	ID3D10Texture2D* pBuffer;
-	hr = D3DObjects.swapChain->GetBuffer( 0, __uuidof(ID3D10Texture2D), (LPVOID*)&pBuffer );
-	if(FAILED(hr))
+	ID3D10Texture2D* pBuffer = getBackBuffer();
+	if(pBuffer==nullptr)
 	{
 		UD3D10RenderDevice::debugs("Error getting swap chain buffer.");
 		return 0;
@@ -240,7 +264,22 @@ int D3D::createRenderTargetViews()
 
 	//Swap chain params so shaders know size, etc
 	DXGI_SWAP_CHAIN_DESC scd;
-	D3DObjects.swapChain->GetDesc(&scd);
+	if(D3DObjects.swapChain)
+	{
+		D3DObjects.swapChain->GetDesc(&scd);
+	}
+	else
+	{
+		D3D10_TEXTURE2D_DESC desc;
+		pBuffer->GetDesc(&desc);
+		ZeroMemory(&scd,sizeof(scd));
+		scd.BufferCount = 1;
+		scd.BufferDesc.Width = desc.Width;
+		scd.BufferDesc.Height = desc.Height;
+		scd.BufferDesc.Format = desc.Format;
+		scd.SampleDesc = desc.SampleDesc;
+		scd.Windowed = TRUE;
+	}
 
 	for(int i=0;i<D3D::DUMMY_NUM_SHADERS;i++)
 	{
@@ -259,13 +298,61 @@ int D3D::createRenderTargetViews()
 }
 
 
+/**
+Get the texture that is presented; the swap chain's back buffer, or the offscreen one when using the null device.
+\return Back buffer. Caller must release this.
+*/
+ID3D10Texture2D *D3D::getBackBuffer()
+{
+	ID3D10Texture2D* buffer = nullptr;
+	if(D3DObjects.swapChain)
+	{
+		if(FAILED(D3DObjects.swapChain->GetBuffer( 0, __uuidof(ID3D10Texture2D), (LPVOID*)&buffer )))
+			return nullptr;
+	}
+	else if(D3DObjects.offscreenBackBuffer)
+	{
+		buffer = D3DObjects.offscreenBackBuffer;
+		buffer->AddRef();
+	}
+	return buffer;
+}
+
+/**
+(Re)create the render target used in place of a swap chain back buffer by the null device.
+*/
+int D3D::createOffscreenBackBuffer(int X, int Y)
+{
+	SAFE_RELEASE(D3DObjects.offscreenBackBuffer);
+
+	D3D10_TEXTURE2D_DESC desc;
+	desc.ArraySize = 1;
+	desc.BindFlags = D3D10_BIND_RENDER_TARGET | D3D10_BIND_SHADER_RESOURCE;
+	desc.CPUAccessFlags = 0;
+	desc.Format = BACKBUFFER_FORMAT;
+	desc.Width = X;
+	desc.Height = Y;
+	desc.MipLevels = 1;
+	desc.MiscFlags = 0;
+	desc.SampleDesc.Count = 1;
+	desc.SampleDesc.Quality = 0;
+	desc.Usage = D3D10_USAGE_DEFAULT;
+	if(FAILED(D3DObjects.device->CreateTexture2D(&desc,nullptr,&D3DObjects.offscreenBackBuffer)))
+	{
+		UD3D10RenderDevice::debugs("Error creating offscreen back buffer.");
+		return 0;
+	}
+	return 1;
+}
+
 /**
 Cleanup
 */
 void D3D::uninit()
 {
 	UD3D10RenderDevice::debugs("Uninit.");
-	D3DObjects.swapChain->SetFullscreenState(FALSE,nullptr); //Go windowed so swapchain can be released
+	if(D3DObjects.swapChain)
+		D3DObjects.swapChain->SetFullscreenState(FALSE,nullptr); //Go windowed so swapchain can be released
 	D3DObjects.device->Flush();
 	if(D3DObjects.device)
 		D3DObjects.device->ClearState();
@@ -277,6 +364,7 @@ void D3D::uninit()
 	}
 
 	SAFE_RELEASE(D3DObjects.backBufferRTV);
+	SAFE_RELEASE(D3DObjects.offscreenBackBuffer);
 	SAFE_RELEASE(D3DObjects.swapChain);
 	SAFE_RELEASE(D3DObjects.device);
 	SAFE_RELEASE(D3DObjects.output);
@@ -306,69 +394,80 @@ int D3D::resize(int X, int Y, bool fullScreen)
 
 	switchToShader(-1); //Switch to no pass so stuff will be rebound later.
 
-	//Get swap chain description
-	hr = D3DObjects.swapChain->GetDesc(&sd);
-	if(FAILED(hr))
+	if(options.nullDevice)
 	{
-		UD3D10RenderDevice::debugs("Failed to get swap chain description.");
-		return 0;
+		SAFE_RELEASE(D3DObjects.backBufferRTV);
+		for(int i=0;i<D3D::DUMMY_NUM_SHADERS;i++)
+			shaders[i]->releaseRenderTargetViews();
+		if(!createOffscreenBackBuffer(X,Y))
+			return 0;
 	}
-	sd.BufferDesc.Width = X; //Set these so we can use this for getclosestmatchingmode
-	sd.BufferDesc.Height = Y;
-	sd.Flags &= ~DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
-
-	//Release render target views
-	SAFE_RELEASE(D3DObjects.backBufferRTV);
-	for(int i=0;i<D3D::DUMMY_NUM_SHADERS;i++)
-		shaders[i]->releaseRenderTargetViews();
-
-	//Set fullscreen resolution
-	if(fullScreen)
+	else
 	{
+		//Get swap chain description
+		hr = D3DObjects.swapChain->GetDesc(&sd);
 		if(FAILED(hr))
 		{
-			UD3D10RenderDevice::debugs("Failed to get output adapter.");
-			return 0;
-		}
-		DXGI_MODE_DESC fullscreenMode = sd.BufferDesc;
-		//hr = D3DObjects.output->FindClosestMatchingMode(&sd.BufferDesc,&fullscreenMode,D3DObjects.device);
-		if(FAILED(hr))
-		{
-			UD3D10RenderDevice::debugs("Failed to get matching display mode.");
+			UD3D10RenderDevice::debugs("Failed to get swap chain description.");
 			return 0;
 		}
-		hr = D3DObjects.swapChain->ResizeTarget(&fullscreenMode);
-		if(FAILED(hr))
-		{
-			UD3D10RenderDevice::debugs("Failed to set full-screen resolution.");
-			return 0;
-		}
-		hr = D3DObjects.swapChain->SetFullscreenState(TRUE,nullptr);
-		if(FAILED(hr))
+		sd.BufferDesc.Width = X; //Set these so we can use this for getclosestmatchingmode
+		sd.BufferDesc.Height = Y;
+		sd.Flags &= ~DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
+
+		//Release render target views
+		SAFE_RELEASE(D3DObjects.backBufferRTV);
+		for(int i=0;i<D3D::DUMMY_NUM_SHADERS;i++)
+			shaders[i]->releaseRenderTargetViews();
+
+		//Set fullscreen resolution
+		if(fullScreen)
 		{
-			UD3D10RenderDevice::debugs("Failed to switch to full-screen.");
-			//return 0;
-		}
-		//MS recommends doing this
-		fullscreenMode.RefreshRate.Denominator=0;
-		fullscreenMode.RefreshRate.Numerator=0;
-		hr = D3DObjects.swapChain->ResizeTarget(&fullscreenMode);
+			if(FAILED(hr))
+			{
+				UD3D10RenderDevice::debugs("Failed to get output adapter.");
+				return 0;
+			}
+			DXGI_MODE_DESC fullscreenMode = sd.BufferDesc;
+			//hr = D3DObjects.output->FindClosestMatchingMode(&sd.BufferDesc,&fullscreenMode,D3DObjects.device);
+			if(FAILED(hr))
+			{
+				UD3D10RenderDevice::debugs("Failed to get matching display mode.");
+				return 0;
+			}
+			hr = D3DObjects.swapChain->ResizeTarget(&fullscreenMode);
+			if(FAILED(hr))
+			{
+				UD3D10RenderDevice::debugs("Failed to set full-screen resolution.");
+				return 0;
+			}
+			hr = D3DObjects.swapChain->SetFullscreenState(TRUE,nullptr);
+			if(FAILED(hr))
+			{
+				UD3D10RenderDevice::debugs("Failed to switch to full-screen.");
+				//return 0;
+			}
+			//MS recommends doing this
+			fullscreenMode.RefreshRate.Denominator=0;
+			fullscreenMode.RefreshRate.Numerator=0;
+			hr = D3DObjects.swapChain->ResizeTarget(&fullscreenMode);
+			if(FAILED(hr))
+			{
+				UD3D10RenderDevice::debugs("Failed to set full-screen resolution.");
+				return 0;
+			}
+			sd.BufferDesc = fullscreenMode;
+			sd.Flags |= DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
+		}	
+
+	
+		//This must be done after fullscreen stuff or blitting will be used instead of flipping
+		hr = D3DObjects.swapChain->ResizeBuffers(sd.BufferCount,X,Y,sd.BufferDesc.Format,sd.Flags); //Resize backbuffer
 		if(FAILED(hr))
 		{
-			UD3D10RenderDevice::debugs("Failed to set full-screen resolution.");
+			UD3D10RenderDevice::debugs("Failed to resize back buffer.");
 			return 0;
 		}
-		sd.BufferDesc = fullscreenMode;
-		sd.Flags |= DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
-	}	
-
-	
-	//This must be done after fullscreen stuff or blitting will be used instead of flipping
-	hr = D3DObjects.swapChain->ResizeBuffers(sd.BufferCount,X,Y,sd.BufferDesc.Format,sd.Flags); //Resize backbuffer
-	if(FAILED(hr))
-	{
-		UD3D10RenderDevice::debugs("Failed to resize back buffer.");
-		return 0;
 	}
 	if(!createRenderTargetViews()) //Recreate render target view
 	{
@@ -408,8 +507,12 @@ Set up things for rendering a new frame. For example, update shader time.
 */
 void D3D::newFrame(float time)
 {	
+	lastFrameStats = stats;
+	ZeroMemory(&stats,sizeof(stats));
+
 	for(int i=0;i<D3D::DUMMY_NUM_SHADERS;i++)
 		shaders[i]->getGeometryBuffer()->newFrame();
+	switchToShader(-1); //Buffers may have been recreated; rebind on next use
 	
 	static_cast<Shader_Postprocess*>(shaders[SHADER_FIRSTPASS])->setElapsedTime(time);
 }
@@ -447,6 +550,7 @@ void D3D::switchToShader(int index)
 			currentShader=0;
 		else
 		{
+			stats.stateChanges++;
 			render();
 			currentShader=shaders[index];
 			currentShader->bind();
@@ -499,6 +603,8 @@ void D3D::present()
 
 
 	//Flip
+	if(!D3DObjects.swapChain)
+		return;
 	hr = D3DObjects.swapChain->Present((options.VSync!=0),0);
 	if(FAILED(hr))
 	{
@@ -545,6 +651,15 @@ TCHAR *D3D::getModes()
 {
 	TCHAR *out;
 
+	//Null device has no output; offer a few common modes so the game has something to pick from
+	if(!D3DObjects.output)
+	{
+		const TCHAR *modes = "640x480 800x600 1024x768 1280x720 1920x1080";
+		out = new TCHAR[strlen(modes)+1];
+		strcpy_s(out,strlen(modes)+1,modes);
+		return out;
+	}
+
 	//Get number of modes
 	UINT num = 0;	
 	D3DObjects.output->GetDisplayModeList(BACKBUFFER_FORMAT, 0, &num, nullptr);
@@ -594,8 +709,7 @@ Return screen data by copying the back buffer to a staging resource and copying
 */
 void D3D::getScreenshot(Vec4_byte* buf)
 {
-	ID3D10Texture2D* backBuffer;
-	D3DObjects.swapChain->GetBuffer( 0, __uuidof(ID3D10Texture2D), (LPVOID*)&backBuffer );
+	ID3D10Texture2D* backBuffer = getBackBuffer();
 
 	D3D10_TEXTURE2D_DESC desc;
 	backBuffer->GetDesc(&desc);
@@ -613,7 +727,13 @@ void D3D::getScreenshot(Vec4_byte* buf)
 
 	//Map copy
 	D3D10_MAPPED_TEXTURE2D tempMapped;
-	tstaging->Map(0,D3D10_MAP_READ ,0,&tempMapped);
+	if(FAILED(tstaging->Map(0,D3D10_MAP_READ ,0,&tempMapped))) //Null device can't be read back
+	{
+		ZeroMemory(buf,desc.Width*desc.Height*sizeof(Vec4_byte));
+		SAFE_RELEASE(backBuffer);
+		SAFE_RELEASE(tstaging);
+		return;
+	}
 
 	//Convert BGRA to RGBA, minding the source stride.
 	Vec4_byte* rowSrc =(Vec4_byte*) tempMapped.pData;
@@ -688,3 +808,11 @@ void D3D::flash(Vec4 &color)
 {	
 	static_cast<Shader_FirstPass*>(shaders[D3D::SHADER_FIRSTPASS])->flash(color);
 }
+
+/**
+Counters for the last completed frame.
+*/
+const D3D::Stats &D3D::getLastFrameStats()
+{
+	return lastFrameStats;
+}
\ No newline at end of file
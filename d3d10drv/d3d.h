@@ -12,6 +12,8 @@ class D3D
 {
 private:
 	static int createRenderTargetViews();
+	static int createOffscreenBackBuffer(int X, int Y);
+	static ID3D10Texture2D *getBackBuffer();
 	static int findAALevel();		
 	static bool initShaders();
 	
@@ -36,7 +38,43 @@ public:
 		int alphaToCoverage; /**< Alpha to coverage support */
 		int classicLighting; /**< Lighting that matches old renderers */
 		int simulateMultipassTexturing; /**< Simulate look of multi-pass world texturing */
+		int nullDevice; /**< Use the D3D10 null device and an offscreen back buffer; nothing is drawn, for profiling without a GPU */
+		int GPUPalettes; /**< Keep P8 textures paletted and do the palette lookup in the shaders */
+		int fanEncoding; /**< How polygons are turned into indices, see FanEncoder::Mode */
 	};
+
+	/** Per-frame counters, reported by UD3D10RenderDevice::GetStats() */
+	struct Stats
+	{
+		unsigned int drawCalls;
+		unsigned int indices; /**< Indices drawn */
+		unsigned int stateChanges; /**< Shader, blend/depth state and texture pass switches */
+		unsigned int textureBinds;
+		unsigned int bufferMaps;
+		size_t vertexBytes; /**< Vertex data written to dynamic buffers */
+		size_t indexBytes; /**< Index data written to dynamic buffers */
+		size_t textureBytes; /**< Texture data uploaded on creation and update */
+		unsigned int asyncTextures; /**< Textures converted by workers that replaced their placeholders */
+		unsigned int diskCacheHits; /**< Converted textures loaded from the disk cache */
+		unsigned int diskCacheMisses;
+		unsigned int textureCacheHits; /**< Textures found cached when drawn or precached */
+		unsigned int textureCacheMisses;
+		unsigned int textureEvictions; /**< Textures deleted to stay under the texture budget */
+		unsigned int texturesRevalidated; /**< Textures from before a level change that were used again unchanged */
+		unsigned int textureLookups; /**< Texture cache hash table lookups */
+		unsigned int textureLookupsSaved; /**< Texture lookups answered by the last hit of a pass instead */
+		unsigned int texturesReclaimed; /**< Textures from before a level change deleted because they weren't used again */
+		unsigned int worldFacetHits; /**< BSP facets drawn from vertices cached on the GPU */
+		unsigned int worldFacetMisses; /**< BSP facets whose vertices had to be uploaded */
+		unsigned int indexWindows; /**< Draws split because geometry was out of the current 16 bit index window */
+		unsigned int bufferDiscards; /**< Dynamic buffers discarded because the GPU still used all of their ring */
+		unsigned int realtimeUpdates; /**< Realtime texture updates */
+		unsigned int realtimeFlushes; /**< Buffered or recorded geometry drawn early because a realtime texture update had no free copy left */
+		size_t realtimeBytes; /**< Realtime texture data uploaded, counted against the RealtimeUploadKB cap */
+		size_t realtimeBytesSaved; /**< Realtime texture data not uploaded because its rows hadn't changed */
+		unsigned int realtimeDeferred; /**< Realtime texture updates put off to the next frame by the cap */
+	};
+	static Stats stats; /**< Counters for the frame being drawn */
 	
 	/**@name API initialization/upkeep */
 	//@{
@@ -74,5 +112,6 @@ public:
 	static TCHAR *getModes();
 	static void getScreenshot(Vec4_byte* buf);
 	static void setBrightness(float brightness);
+	static const Stats &getLastFrameStats();
 	//@}
 };
\ No newline at end of file
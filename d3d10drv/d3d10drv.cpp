@@ -21,12 +21,19 @@ Called UD3D10RenderDevice as Unreal leaves out first letter when accessing the c
 #include "resource.h"
 #include "d3d10drv.h"
 #include "texconverter.h"
+#include "commandlist.h"
+#include "trace.h"
+#include "renderthread.h"
 #include "customflags.h"
 #include "misc.h"
 #include "vertexformats.h"
 #include "shader_gouraudpolygon.h"
 #include "shader_tile.h"
+#include "instancegeometrybuffer.h"
 #include "shader_complexsurface.h"
+#include "worldgeometrybuffer.h"
+#include "fanencoder.h"
+#include "bcencoder.h"
 #include "shader_fogsurface.h"
 #include <iostream>
 
@@ -46,6 +53,91 @@ static float zFar;
 static LARGE_INTEGER perfCounterFreq;
 static TextureCache *textureCache;
 static TexConverter *texConverter;
+static WorkerPool *workerPool; /**< Texture conversion and block compression threads; NULL if the game thread does both alone */
+static const int MAX_TEXTURE_WORKERS = 4; /**< Conversion doesn't gain much from more; the driver wants cores too */
+static DiskTextureCache *diskTextureCache; /**< NULL if disabled */
+static CommandList *commandList;
+static TraceRecorder *traceRecorder; /**< Set while recording a trace, see Exec() */
+static bool replayingTrace;
+static RenderThread *renderThread; /**< NULL if the game thread draws itself */
+static float lastBrightness; /**< Brightness at the last Flush(), to tell brightness changes from level changes */
+static const ULevel *lastLevel; /**< Level at the last Flush(), to tell level changes from other flushes */
+static const TextureCache::TextureMetaData *cacheTexture(FTextureInfo& Info, DWORD PolyFlags, TextureCache::TexturePass pass);
+
+/**
+Returns true when called by the render thread, carrying out calls the game thread recorded. Those calls were already traced.
+*/
+static bool onRenderThread()
+{
+	return renderThread && renderThread->isRenderThread();
+}
+
+/**
+Returns the stream a call is to be recorded to for the render thread instead of being carried out, or NULL if it's to be carried out right away.
+*/
+static TraceRecorder *renderStream()
+{
+	return renderThread && !renderThread->isRenderThread() ? renderThread->getRecorder() : nullptr;
+}
+
+/**
+Pack a vertex color as R10G10B10A2, with alpha set to 1. Colors are clamped, as the shader did with the float colors.
+*/
+static inline DWORD packColor10(const FPlane &c)
+{
+	DWORD r = (DWORD)(Clamp(c.X,0.0f,1.0f)*1023.0f+0.5f);
+	DWORD g = (DWORD)(Clamp(c.Y,0.0f,1.0f)*1023.0f+0.5f);
+	DWORD b = (DWORD)(Clamp(c.Z,0.0f,1.0f)*1023.0f+0.5f);
+	return r | (g<<10) | (b<<20) | (3u<<30);
+}
+
+/**
+Pack a color as R8G8B8A8, clamped to [0,1].
+*/
+static inline DWORD packColor8(const FPlane &c)
+{
+	DWORD r = (DWORD)(Clamp(c.X,0.0f,1.0f)*255.0f+0.5f);
+	DWORD g = (DWORD)(Clamp(c.Y,0.0f,1.0f)*255.0f+0.5f);
+	DWORD b = (DWORD)(Clamp(c.Z,0.0f,1.0f)*255.0f+0.5f);
+	DWORD a = (DWORD)(Clamp(c.W,0.0f,1.0f)*255.0f+0.5f);
+	return r | (g<<8) | (b<<16) | (a<<24);
+}
+
+/**
+Fill in a texture coordinate set of a surface record.
+\param coords Texture coordinate set (diffuse, light, detail, fog, macro).
+\param panU Pan to subtract from the map coordinates, including any correction.
+*/
+static void setSurfacePass(ComplexSurfaceRecord &record, int coords, FLOAT panU, FLOAT panV, const TextureCache::TextureMetaData *metadata)
+{
+	record.passes[coords].panU = panU;
+	record.passes[coords].panV = panV;
+	record.passes[coords].multU = metadata->multU;
+	record.passes[coords].multV = metadata->multV;
+}
+
+/**
+Key to find a facet's vertices in the WorldGeometryBuffer. The engine doesn't say which BSP surface is drawn, so the surface is identified by its flags, texture and
+map coordinates, and the geometry by its points.
+\param numVerts Set to the number of vertices in the facet's valid polygons.
+*/
+static unsigned long long facetKey(const FSurfaceInfo &Surface, const FSurfaceFacet &Facet, UINT &numVerts)
+{
+	unsigned long long hash = Misc::hashBytes(&Facet.MapCoords,sizeof(Facet.MapCoords),0);
+	hash = Misc::hashBytes(&Surface.PolyFlags,sizeof(Surface.PolyFlags),hash);
+	hash = Misc::hashBytes(&Surface.Texture->CacheID,sizeof(Surface.Texture->CacheID),hash);
+	numVerts = 0;
+	for(FSavedPoly* Poly=Facet.Polys; Poly; Poly=Poly->Next)
+	{
+		if(Poly->NumPts < 3)
+			continue;
+		hash = Misc::hashBytes(&Poly->NumPts,sizeof(Poly->NumPts),hash);
+		for(INT i=0; i<Poly->NumPts; i++)
+			hash = Misc::hashBytes(&Poly->Pts[i]->Point,sizeof(FVector),hash);
+		numVerts += Poly->NumPts;
+	}
+	return hash;
+}
 static Shader_GouraudPolygon *shader_GouraudPolygon;
 static Shader_Tile *shader_Tile;
 static Shader_ComplexSurface *shader_ComplexSurface;
@@ -125,6 +217,17 @@ void UD3D10RenderDevice::StaticConstructor(UClass* Class)
 	new(Class, "FPSLimit", RF_Public) UIntProperty(CPP_PROPERTY(options.FPSLimit), TEXT("Options"), CPF_Config);
 	new(Class, "SimulateMultiPassTexturing", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.simulateMultipassTexturing), TEXT("Options"), CPF_Config);
 	new(Class, "UnlimitedViewDistance", RF_Public) UBoolProperty(CPP_PROPERTY(options.unlimitedViewDistance), TEXT("Options"), CPF_Config);
+	new(Class, "DeferOpaqueDraws", RF_Public) UBoolProperty(CPP_PROPERTY(options.deferOpaqueDraws), TEXT("Options"), CPF_Config);
+	new(Class, "RecordAllDraws", RF_Public) UBoolProperty(CPP_PROPERTY(options.recordAllDraws), TEXT("Options"), CPF_Config);
+	new(Class, "AsyncTextures", RF_Public) UBoolProperty(CPP_PROPERTY(options.asyncTextures), TEXT("Options"), CPF_Config);
+	new(Class, "DiskTextureCacheMB", RF_Public) UIntProperty(CPP_PROPERTY(options.diskTextureCacheMB), TEXT("Options"), CPF_Config);
+	new(Class, "TextureBudgetMB", RF_Public) UIntProperty(CPP_PROPERTY(options.textureBudgetMB), TEXT("Options"), CPF_Config);
+	new(Class, "RenderThread", RF_Public) UBoolProperty(CPP_PROPERTY(options.renderThread), TEXT("Options"), CPF_Config);
+	new(Class, "CompressTextures", RF_Public) UBoolProperty(CPP_PROPERTY(options.compressTextures), TEXT("Options"), CPF_Config);
+	new(Class, "GenerateMips", RF_Public) UBoolProperty(CPP_PROPERTY(options.generateMips), TEXT("Options"), CPF_Config);
+	new(Class, "RealtimeUploadKB", RF_Public) UIntProperty(CPP_PROPERTY(options.realtimeUploadKB), TEXT("Options"), CPF_Config);
+	new(Class, "GPUPalettes", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.GPUPalettes), TEXT("Options"), CPF_Config);
+	new(Class, "FanEncoding", RF_Public) UIntProperty(CPP_PROPERTY(D3DOptions.fanEncoding), TEXT("Options"), CPF_Config);
 
 	//Turn on parent class options by default. If done here (instead of in Init()), the ingame preferences still work
 	getOption("Coronas", 1, true);
@@ -227,6 +330,18 @@ UBOOL UD3D10RenderDevice::Init(UViewport *InViewport,INT NewX, INT NewY, INT New
 	options.FPSLimit = getOption("FPSLimit",100,false);
 	D3DOptions.simulateMultipassTexturing = getOption("simulateMultipassTexturing",1,true);
 	options.unlimitedViewDistance = getOption("unlimitedViewDistance",0,true);
+	options.deferOpaqueDraws = getOption("DeferOpaqueDraws",1,true);
+	options.recordAllDraws = getOption("RecordAllDraws",1,true);
+	options.asyncTextures = getOption("AsyncTextures",1,true);
+	options.diskTextureCacheMB = getOption("DiskTextureCacheMB",256,false);
+	options.textureBudgetMB = getOption("TextureBudgetMB",512,false);
+	options.renderThread = getOption("RenderThread",0,true);
+	options.compressTextures = getOption("CompressTextures",0,true);
+	options.generateMips = getOption("GenerateMips",0,true);
+	options.realtimeUploadKB = getOption("RealtimeUploadKB",0,false);
+	D3DOptions.nullDevice = getOption("NullDevice",0,true); //Not exposed in the options menu; for profiling the CPU side only
+	D3DOptions.GPUPalettes = getOption("GPUPalettes",0,true);
+	D3DOptions.fanEncoding = getOption("FanEncoding",1,false);
 	if(options.unlimitedViewDistance)
 		zFar = 65536.0f;
 	else
@@ -235,8 +350,25 @@ UBOOL UD3D10RenderDevice::Init(UViewport *InViewport,INT NewX, INT NewY, INT New
 	//Set parent options
 	URenderDevice::Viewport = InViewport;
 
-	//Do some nice compatibility fixing: set processor affinity to single-cpu
-	SetProcessAffinityMask(GetCurrentProcess(),0x1);
+	//Do some nice compatibility fixing: set processor affinity to single-cpu.
+	//With a render thread, texture conversion threads or block compression only the game thread is pinned, so these can have the other cores.
+	//The render thread gets a core of its own, the workers share the rest.
+	DWORD_PTR processMask, systemMask;
+	GetProcessAffinityMask(GetCurrentProcess(),&processMask,&systemMask);
+	DWORD_PTR otherMask = processMask & ~(DWORD_PTR)0x1;
+	DWORD_PTR renderMask = options.renderThread ? otherMask & (~otherMask+1) : 0; //Lowest core besides the game's
+	DWORD_PTR workerMask = otherMask & ~renderMask;
+	if(!workerMask)
+		workerMask = otherMask; //Only two cores; share with the render thread
+	int numWorkers = options.asyncTextures ? WorkerPool::countThreads(workerMask,MAX_TEXTURE_WORKERS) : 0;
+	//Textures converted right away are block compressed by the game thread, helped by the workers; without AsyncTextures the pool is there just for that
+	int compressThreads = 0;
+	if(options.compressTextures)
+		compressThreads = 1+WorkerPool::countThreads(workerMask,MAX_TEXTURE_WORKERS);
+	if(numWorkers>0 || renderMask || compressThreads>1)
+		SetThreadAffinityMask(GetCurrentThread(),0x1);
+	else
+		SetProcessAffinityMask(GetCurrentProcess(),0x1);
 
 	//Initialize Direct3D
 	
@@ -252,20 +384,47 @@ UBOOL UD3D10RenderDevice::Init(UViewport *InViewport,INT NewX, INT NewY, INT New
 		return 0;
 	}
 
-	textureCache= new (std::nothrow) TextureCache(D3D::getDevice());
+	textureCache= new (std::nothrow) TextureCache(D3D::getDevice(),D3DOptions.GPUPalettes!=0,(size_t)max(options.textureBudgetMB,0)*1024*1024);
 	if(!textureCache)
 	{
 		GError.Log("Error allocating texture cache.");
 		return 0;
 	}
 
-	texConverter = new (std::nothrow) TexConverter(textureCache);
+	if(numWorkers>0 || compressThreads>1)
+	{
+		workerPool = new (std::nothrow) WorkerPool(max(numWorkers,compressThreads-1),workerMask);
+		if(!workerPool)
+		{
+			GError.Log("Error allocating texture conversion threads.");
+			return 0;
+		}
+	}
+
+	if(options.diskTextureCacheMB>0)
+	{
+		diskTextureCache = new (std::nothrow) DiskTextureCache("d3d10drv\\texturecache",(size_t)options.diskTextureCacheMB*1024*1024);
+		if(!diskTextureCache)
+		{
+			GError.Log("Error allocating disk texture cache.");
+			return 0;
+		}
+	}
+
+	texConverter = new (std::nothrow) TexConverter(textureCache,numWorkers>0 ? workerPool : nullptr,workerPool,diskTextureCache,compressThreads,options.generateMips!=0,(size_t)max(options.realtimeUploadKB,0)*1024);
 	if(!texConverter)
 	{
 		GError.Log("Error allocating texture converter.");
 		return 0;
 	}
 
+	commandList = new (std::nothrow) CommandList(textureCache,options.deferOpaqueDraws!=0,options.recordAllDraws!=0);
+	if(!commandList)
+	{
+		GError.Log("Error allocating command list.");
+		return 0;
+	}
+
 	shader_GouraudPolygon = static_cast<Shader_GouraudPolygon*>(D3D::getShader(D3D::SHADER_GOURAUDPOLYGON));
 	shader_Tile = static_cast<Shader_Tile*>(D3D::getShader(D3D::SHADER_TILE));
 	shader_ComplexSurface = static_cast<Shader_ComplexSurface*>(D3D::getShader(D3D::SHADER_COMPLEXSURFACE));
@@ -275,10 +434,21 @@ UBOOL UD3D10RenderDevice::Init(UViewport *InViewport,INT NewX, INT NewY, INT New
 	float brightness;
 	GetConfigFloat("WinDrv.WindowsClient", "Brightness", brightness);
 	D3D::setBrightness(brightness);
+	lastBrightness = brightness;
 
 	//URenderDevice::PrecacheOnFlip = 1; //Turned on to immediately recache on init (prevents lack of textures after fullscreen switch)
 
 	QueryPerformanceFrequency(&perfCounterFreq); //Init performance counter frequency.
+
+	if(renderMask)
+	{
+		renderThread = new (std::nothrow) RenderThread(this,renderMask);
+		if(!renderThread)
+		{
+			GError.Log("Error allocating render thread.");
+			return 0;
+		}
+	}
 	
 	return 1;
 }
@@ -293,6 +463,8 @@ Resize buffers and viewport.
 */
 UBOOL UD3D10RenderDevice::SetRes(INT NewX, INT NewY, INT NewColorBytes, UBOOL Fullscreen)
 {
+	if(renderThread)
+		renderThread->sync(); //Can't resize while it's drawing
 	//Without BLIT_Direct3D major flickering occurs when switching from fullscreen to windowed.
 	UBOOL Result = URenderDevice::Viewport->ResizeViewport(BLIT_HardwarePaint|BLIT_Direct3D, NewX, NewY, NewColorBytes);
 	auto device = D3D::getDevice();
@@ -330,7 +502,17 @@ Cleanup.
 void UD3D10RenderDevice::Exit()
 {
 	UD3D10RenderDevice::debugs("Direct3D 10 renderer exiting.");
+	delete renderThread; //Finishes what was submitted
+	renderThread = nullptr;
+	delete workerPool; //Waits for running conversions, which use the device and disk cache
+	workerPool = nullptr;
+	delete diskTextureCache;
+	diskTextureCache = nullptr;
+	commandList->clear();
 	textureCache->flush();
+	delete traceRecorder;
+	traceRecorder = nullptr;
+	delete commandList;
 	delete textureCache;
 	delete texConverter;
 	D3D::uninit();
@@ -339,10 +521,139 @@ void UD3D10RenderDevice::Exit()
 }
 
 /**
-Empty texture cache.
+Time index generation for each FanEncoder mode on polygon sizes drawn from a distribution, for the D3D10FanBench command.
+Indices are written to memory, not to a mapped buffer, so this measures the CPU side only; table mode's cost is in its draw calls, which are reported instead.
+\param name Name of the distribution for the log.
+\param weights Relative frequency of each polygon size, starting at triangles.
+*/
+static void benchmarkFanEncodings(FOutputDevice &Ar, const TCHAR *name, const int *weights, int numWeights, int polys)
+{
+	//Polygon sizes, from a fixed seed so runs are comparable
+	std::vector<int> sizes(polys);
+	int totalWeight = 0;
+	for(int i=0;i<numWeights;i++)
+		totalWeight += weights[i];
+	unsigned int seed = 12345;
+	for(int p=0;p<polys;p++)
+	{
+		seed = seed*1664525+1013904223;
+		int w = (seed>>8)%totalWeight;
+		int size = 3;
+		for(int i=0;i<numWeights && w>=weights[i];i++,size++)
+			w -= weights[i];
+		sizes[p] = size;
+	}
+
+	std::vector<WORD> indices(65536);
+	for(int m=0;m<FanEncoder::DUMMY_NUM_MODES;m++)
+	{
+		FanEncoder::Mode mode = (FanEncoder::Mode)m;
+		size_t written = 0, pos = 0;
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		for(int p=0;p<polys;p++)
+		{
+			if(pos+FanEncoder::countIndices(mode,sizes[p])>indices.size()) //Wrap like a discarded buffer
+				pos = 0;
+			int n = FanEncoder::write(mode,&indices[pos],(WORD)(pos/2),sizes[p]);
+			pos += n;
+			written += n;
+		}
+		QueryPerformanceCounter(&end);
+		float ns = 1e9f*(end.QuadPart-start.QuadPart)/(float)perfCounterFreq.QuadPart/polys;
+		static const TCHAR *modeNames[] = {TEXT("list"),TEXT("strip"),TEXT("table")};
+		Ar.Logf(TEXT("%s %s: %.1f ns/poly, %.2f index bytes/poly, %.2f draws/poly."),name,modeNames[m],ns,(float)(written*sizeof(WORD))/polys,mode==FanEncoder::MODE_TABLE ? 1.0f : 0.0f);
+	}
+}
+
+/**
+Time block compression of a generated texture and measure the error, for the D3D10BCBench command.
+Colors are gradients with noise, like most art; the masked kind has holes of transparent black as P8 conversion makes them, the alpha kind a horizontal alpha ramp.
+\param kind 0 for opaque, 1 for masked, 2 for alpha.
+\param helpers Workers for the multithreaded run.
+\param threads Threads for the multithreaded run, the calling one included.
+*/
+static void benchmarkBlockCompression(FOutputDevice &Ar, int kind, int size, int loops, WorkerPool *helpers, int threads)
+{
+	static const TCHAR *kindNames[] = {TEXT("Opaque"),TEXT("Masked"),TEXT("Alpha")};
+	DXGI_FORMAT format = kind==2 ? DXGI_FORMAT_BC3_UNORM : DXGI_FORMAT_BC1_UNORM;
+
+	//Pixels from a fixed seed so runs are comparable
+	std::vector<DWORD> pixels(size*size);
+	unsigned int seed = 12345;
+	for(int y=0;y<size;y++)
+	{
+		for(int x=0;x<size;x++)
+		{
+			seed = seed*1664525+1013904223;
+			int noise = (seed>>24)%24;
+			int r = min(255,x*256/size+noise), g = min(255,y*256/size+noise), b = min(255,(x+y)*128/size+noise), a = 255;
+			int dx = x%32-16, dy = y%32-16;
+			if(kind==1 && dx*dx+dy*dy<64)
+				r = g = b = a = 0;
+			if(kind==2)
+				a = x*255/max(size-1,1);
+			pixels[y*size+x] = r | (g<<8) | (b<<16) | ((DWORD)a<<24);
+		}
+	}
+
+	D3D10_SUBRESOURCE_DATA source = {&pixels[0],(UINT)size*4,0};
+	std::vector<BYTE> blocks(BCEncoder::getPitch(format,size)*((size+3)/4));
+	D3D10_SUBRESOURCE_DATA dest = {&blocks[0],BCEncoder::getPitch(format,size),0};
+	float mpixels[2];
+	int threadCounts[2] = {1,threads};
+	for(int t=0;t<2;t++)
+	{
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		for(int i=0;i<loops;i++)
+			BCEncoder::encodeMips(format,size,size,1,&source,&dest,t>0 ? helpers : nullptr,threadCounts[t]);
+		QueryPerformanceCounter(&end);
+		float seconds = (end.QuadPart-start.QuadPart)/(float)perfCounterFreq.QuadPart;
+		mpixels[t] = seconds>0.0f ? (float)size*size*loops/seconds/1000000.0f : 0.0f;
+	}
+
+	std::vector<DWORD> decoded(size*size);
+	BCEncoder::decode(format,&blocks[0],dest.SysMemPitch,size,size,&decoded[0]);
+	double colorError = 0.0, alphaError = 0.0;
+	int maskErrors = 0; //Pixels on the other side of the alpha test threshold than they should be
+	for(int i=0;i<size*size;i++)
+	{
+		for(int c=0;c<3;c++)
+		{
+			int d = (int)((pixels[i]>>(8*c))&0xFF)-(int)((decoded[i]>>(8*c))&0xFF);
+			colorError += d*d;
+		}
+		int d = (int)(pixels[i]>>24)-(int)(decoded[i]>>24);
+		alphaError += d*d;
+		if((pixels[i]>>24>=128)!=(decoded[i]>>24>=128))
+			maskErrors++;
+	}
+	Ar.Logf(TEXT("%s %s: %.1f Mpixels/s on 1 thread, %.1f on %i; RGB RMSE %.2f, alpha RMSE %.2f, %i mask errors."),kindNames[kind],format==DXGI_FORMAT_BC1_UNORM ? TEXT("BC1") : TEXT("BC3"),
+		mpixels[0],mpixels[1],threads,appSqrt(colorError/(3.0*size*size)),appSqrt(alphaError/((double)size*size)),maskErrors);
+}
+
+/**
+Empty all texture caches right away, unlike Flush(). Used where a clean start is needed, such as around replaying a trace.
+*/
+static void flushAllTextures()
+{
+	if(renderThread)
+		renderThread->sync();
+	commandList->flush(); //Recorded geometry refers to textures about to be deleted
+	textureCache->flush();
+	texConverter->cancelPending();
+}
+
+/**
+Invalidate the texture cache.
 \param AllowPrecache Enabled if the game allows us to precache; respond by setting URenderDevice::PrecacheOnFlip = 1 if wanted. This does make load times longer.
 
-\note Brightness is applied here; flush is called on each brightness change.
+\note Brightness is applied here; flush is called on each brightness change. Brightness is applied by the final pass shader, so that's all a brightness change
+updates; textures and world geometry don't depend on it.
+\note Level changes (the viewport's level changed) start a new texture cache generation instead of deleting everything, see TextureCache::newGeneration().
+Textures that are used again in the new level survive without being converted again. Cached world geometry is thrown away. Other flushes, including the
+game's FLUSH with AllowPrecache from the brightness menu and console, keep both caches; changed textures are caught by the usual checks when drawn.
 */
 
 void UD3D10RenderDevice::Flush()
@@ -352,11 +663,45 @@ void UD3D10RenderDevice::Flush()
 
 void UD3D10RenderDevice::Flush(UBOOL AllowPrecache)
 {
-	textureCache->flush();
-	D3D::setBrightness(Viewport->GetOuterUClient()->Brightness);
-	//If caching is allowed, tell the game to make caching calls (PrecacheTexture() function)
+	//The render thread can't read the game's objects while the game changes them, so it gets their state at the flush through the stream
+	float brightness;
+	const ULevel *level;
+	if(onRenderThread())
+	{
+		brightness = renderThread->getFlushBrightness();
+		level = renderThread->getFlushLevel();
+	}
+	else
+	{
+		brightness = Viewport->GetOuterUClient()->Brightness;
+		level = Viewport->Actor ? Viewport->Actor->XLevel : nullptr;
+	}
 
-	if (AllowPrecache && options.precache)
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordFlush(brightness,level,AllowPrecache);
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordFlush(brightness,level,AllowPrecache);
+		if (AllowPrecache && options.precache)
+			PrecacheOnFlip = 1;
+		return;
+	}
+	commandList->flush(); //Recorded geometry may refer to textures that turn out to have changed
+	if(brightness!=lastBrightness)
+	{
+		D3D::setBrightness(brightness);
+		lastBrightness = brightness;
+	}
+	if(level!=lastLevel)
+	{
+		lastLevel = level;
+		textureCache->newGeneration();
+		D3D::render();
+		static_cast<WorldGeometryBuffer*>(shader_ComplexSurface->getGeometryBuffer())->reset(); //Cached world geometry lives as long as the level
+	}
+	//If caching is allowed, tell the game to make caching calls (PrecacheTexture() function); the game thread did so when recording
+
+	if (AllowPrecache && options.precache && !onRenderThread())
 		PrecacheOnFlip = 1;
 }
 
@@ -376,8 +721,14 @@ EndFlash() ends this, but other renderers actually save the parameters and start
 */
 void UD3D10RenderDevice::Lock(FPlane FlashScale, FPlane FlashFog, FPlane ScreenClear, DWORD RenderLockFlags, BYTE* InHitData, INT* InHitSize )
 {
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordLock(FlashScale,FlashFog,ScreenClear,RenderLockFlags);
+
+	//Frame time on this thread; the game thread is paced with it, the render thread's goes to the postprocessing
+	bool gameThread = !onRenderThread();
 	float deltaTime;
-	static LARGE_INTEGER oldTime;
+	static LARGE_INTEGER oldTimes[2];
+	LARGE_INTEGER &oldTime = oldTimes[gameThread ? 0 : 1];
 	LARGE_INTEGER time;
 	if(oldTime.QuadPart==0)
 		QueryPerformanceCounter(&oldTime); //Initial time
@@ -386,8 +737,8 @@ void UD3D10RenderDevice::Lock(FPlane FlashScale, FPlane FlashFog, FPlane ScreenC
 	QueryPerformanceCounter(&time);
 	deltaTime  =  (time.QuadPart-oldTime.QuadPart) / (float)perfCounterFreq.QuadPart;
 	
-	//FPS limiter
-	if(options.FPSLimit > 0)
+	//FPS limiter; traces are replayed as fast as possible
+	if(options.FPSLimit > 0 && !replayingTrace && gameThread)
 	{		
 		while(deltaTime<(float)1/options.FPSLimit) //Busy wait for max accuracy
 		{
@@ -399,7 +750,7 @@ void UD3D10RenderDevice::Lock(FPlane FlashScale, FPlane FlashFog, FPlane ScreenC
 	
 
 	//If needed, set new field of view; the game resets this on level switches etc. Can't be done in config as Unreal doesn't support this.
-	if(options.autoFOV && Viewport->Actor->DesiredFOV!=customFOV)
+	if(options.autoFOV && !replayingTrace && gameThread && Viewport->Actor->DesiredFOV!=customFOV)
 	{		
 		TCHAR buf[8]="fov ";
 		_itoa_s(customFOV,&buf[4],4,10);
@@ -408,7 +759,15 @@ void UD3D10RenderDevice::Lock(FPlane FlashScale, FPlane FlashFog, FPlane ScreenC
 		URenderDevice::Viewport->Exec(buf);
 	}
 
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordLock(FlashScale,FlashFog,ScreenClear,RenderLockFlags);
+		return;
+	}
+
 	D3D::newFrame(deltaTime);
+	textureCache->newFrame();
+	texConverter->publishFinished(); //Frame boundary, so no frame mixes a placeholder and the real texture
 
 	//Set up flash if needed
 	Vec4 flashFog = Vec4(FlashFog.X,FlashFog.Y,FlashFog.Z,0.0f);
@@ -432,9 +791,29 @@ Finish rendering.
 */
 void UD3D10RenderDevice::Unlock(UBOOL Blit)
 {
-	if(Blit)
+	if(TraceRecorder *stream = renderStream()) //The frame is complete; the render thread can have it
 	{
-		D3D::present();
+		stream->recordUnlock(Blit);
+		renderThread->submit();
+	}
+	else
+	{
+		commandList->flush();
+		if(Blit)
+		{
+			D3D::present();
+		}
+	}
+
+	if(traceRecorder && !onRenderThread())
+	{
+		traceRecorder->recordUnlock(Blit);
+		if(traceRecorder->isDone())
+		{
+			debugf(TEXT("D3D10: Trace recording finished."));
+			delete traceRecorder;
+			traceRecorder = nullptr;
+		}
 	}
 }
 
@@ -455,84 +834,76 @@ Complex surfaces are used for map geometry. They consists of facets which in tur
 \note DetailTexture and FogMap are mutually exclusive; D3D10 renderer just uses seperate binds for them anyway.
 \note D3D10 renderer handles DetailTexture range in shader.
 \note Check if submitted polygons are valid (3 or more points).
+\note Vertices only hold positions; texture coordinates are generated in the vertex shader from a per-surface ComplexSurfaceRecord.
+\note Vertices are cached on the GPU per facet, see WorldGeometryBuffer; facets drawn before only cost indices.
 */
 void UD3D10RenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Surface, FSurfaceFacet& Facet )
 {
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordComplexSurface(Frame,Surface,Facet);
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordComplexSurface(Frame,Surface,Facet);
+		return;
+	}
 
 	DWORD flags;
-	D3D::switchToShader(D3D::SHADER_COMPLEXSURFACE);
 
-	//Cache and set textures
+	//Cache textures and collect the state needed to draw the surface
 	const TextureCache::TextureMetaData *diffuse=nullptr, *lightMap=nullptr, *detail=nullptr, *fogMap=nullptr, *macro=nullptr;
+	CommandList::StateKey key(D3D::SHADER_COMPLEXSURFACE);
 
-	PrecacheTexture(*Surface.Texture,Surface.PolyFlags);	
-
-	if(!(diffuse = textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_DIFFUSE,Surface.Texture->CacheID)))
+	if(!(diffuse = cacheTexture(*Surface.Texture,Surface.PolyFlags,TextureCache::PASS_DIFFUSE)))
 		return;
+	key.textures[TextureCache::PASS_DIFFUSE] = Surface.Texture->CacheID;
+	key.versions[TextureCache::PASS_DIFFUSE] = diffuse->version;
 
 	flags = Surface.PolyFlags;
 	flags |= diffuse->customPolyFlags;
-	
-	shader_ComplexSurface->setFlags(flags);
+	key.blendFlags = flags;
 	
 	if(Surface.LightMap)
 	{
-		PrecacheTexture(*Surface.LightMap,0);
-		if(!(lightMap = textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_LIGHT,Surface.LightMap->CacheID)))
+		if(!(lightMap = cacheTexture(*Surface.LightMap,0,TextureCache::PASS_LIGHT)))
 			return;
-		shader_ComplexSurface->switchPass(TextureCache::PASS_LIGHT,1);
-	}
-	else
-	{
-		shader_ComplexSurface->switchPass(TextureCache::PASS_LIGHT,0);
+		key.textures[TextureCache::PASS_LIGHT] = Surface.LightMap->CacheID;
+		key.versions[TextureCache::PASS_LIGHT] = lightMap->version;
 	}
 
-	if(diffuse && diffuse->externalTextures[TextureCache::EXTRA_TEX_DETAIL])
+	if(diffuse->externalTextures[TextureCache::EXTRA_TEX_DETAIL])
 	{
-		if(!(detail = textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_DETAIL,Surface.Texture->CacheID,TextureCache::EXTRA_TEX_DETAIL)))
-			return;
-		shader_ComplexSurface->switchPass(TextureCache::PASS_DETAIL,1);
+		detail = diffuse;
+		key.textures[TextureCache::PASS_DETAIL] = Surface.Texture->CacheID;
+		key.extraIndex[TextureCache::PASS_DETAIL] = TextureCache::EXTRA_TEX_DETAIL;
 	}
 	else if(Surface.DetailTexture)
 	{
-		PrecacheTexture(*Surface.DetailTexture,0);
-		if(!(detail = textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_DETAIL,Surface.DetailTexture->CacheID)))
+		if(!(detail = cacheTexture(*Surface.DetailTexture,0,TextureCache::PASS_DETAIL)))
 			return;
-		shader_ComplexSurface->switchPass(TextureCache::PASS_DETAIL,1);
-	}
-	else
-	{
-		shader_ComplexSurface->switchPass(TextureCache::PASS_DETAIL,0);
+		key.textures[TextureCache::PASS_DETAIL] = Surface.DetailTexture->CacheID;
+		key.versions[TextureCache::PASS_DETAIL] = detail->version;
 	}
 
 	if(Surface.FogMap)
 	{
-		PrecacheTexture(*Surface.FogMap,0);
-		if(!(fogMap = textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_FOG,Surface.FogMap->CacheID)))
+		if(!(fogMap = cacheTexture(*Surface.FogMap,0,TextureCache::PASS_FOG)))
 			return;
-		shader_ComplexSurface->switchPass(TextureCache::PASS_FOG,1);
-	}
-	else
-	{
-		shader_ComplexSurface->switchPass(TextureCache::PASS_FOG,0);
+		key.textures[TextureCache::PASS_FOG] = Surface.FogMap->CacheID;
+		key.versions[TextureCache::PASS_FOG] = fogMap->version;
 	}
+
 	if(Surface.MacroTexture)
 	{
-		PrecacheTexture(*Surface.MacroTexture,0);
-		if(!(macro = textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_MACRO,Surface.MacroTexture->CacheID)))
+		if(!(macro = cacheTexture(*Surface.MacroTexture,0,TextureCache::PASS_MACRO)))
 			return;
-		shader_ComplexSurface->switchPass(TextureCache::PASS_MACRO,1);
-	}
-	else
-	{
-		shader_ComplexSurface->switchPass(TextureCache::PASS_MACRO,0);
+		key.textures[TextureCache::PASS_MACRO] = Surface.MacroTexture->CacheID;
+		key.versions[TextureCache::PASS_MACRO] = macro->version;
 	}
 
-	if(diffuse && diffuse->externalTextures[TextureCache::EXTRA_TEX_BUMP])
+	if(diffuse->externalTextures[TextureCache::EXTRA_TEX_BUMP])
 	{
-		if(!textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_BUMP,Surface.Texture->CacheID,TextureCache::EXTRA_TEX_BUMP))
-			return;
-		shader_ComplexSurface->switchPass(TextureCache::PASS_BUMP,1);
+		key.textures[TextureCache::PASS_BUMP] = Surface.Texture->CacheID;
+		key.extraIndex[TextureCache::PASS_BUMP] = TextureCache::EXTRA_TEX_BUMP;
 	}/*
 	else if(Surface.Texture->Texture->BumpMap)
 	{	
@@ -543,83 +914,104 @@ void UD3D10RenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Sur
 		#else
 			Surface.Texture->Texture->BumpMap->Lock(texInfo,0,0,this);	
 		#endif
-		PrecacheTexture(texInfo,Surface.PolyFlags);	
-		if(!textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_BUMP,texInfo.CacheID))
+		if(!cacheTexture(texInfo,Surface.PolyFlags,TextureCache::PASS_BUMP))
 			return;
 		Surface.Texture->Texture->BumpMap->Unlock(texInfo);
-		shader_ComplexSurface->switchPass(TextureCache::PASS_BUMP,1);
+		key.textures[TextureCache::PASS_BUMP] = texInfo.CacheID;
 	}*/
 
-	else
+	if(diffuse->externalTextures[TextureCache::EXTRA_TEX_HEIGHT])
 	{
-		shader_ComplexSurface->switchPass(TextureCache::PASS_BUMP,0);
+		key.textures[TextureCache::PASS_HEIGHT] = Surface.Texture->CacheID;
+		key.extraIndex[TextureCache::PASS_HEIGHT] = TextureCache::EXTRA_TEX_HEIGHT;
 	}
 
-	if(diffuse && diffuse->externalTextures[TextureCache::EXTRA_TEX_HEIGHT])
+	//Texture coordinate generation parameters; the vertex shader derives the coordinates from these and the positions. Code from OpenGL renderer.
+	ComplexSurfaceRecord record;
+	ZeroMemory(&record,sizeof(record));
+	*(FVector*)record.XAxis = Facet.MapCoords.XAxis;
+	*(FVector*)record.YAxis = Facet.MapCoords.YAxis;
+	record.UDot = Facet.MapCoords.XAxis | Facet.MapCoords.Origin;
+	record.VDot = Facet.MapCoords.YAxis | Facet.MapCoords.Origin;
+	record.flags = flags;
+	setSurfacePass(record,0,Surface.Texture->Pan.X,Surface.Texture->Pan.Y,diffuse);
+	if(Surface.LightMap) //Lightmaps require pan correction of -.5
+		setSurfacePass(record,1,Surface.LightMap->Pan.X-0.5f*Surface.LightMap->UScale,Surface.LightMap->Pan.Y-0.5f*Surface.LightMap->VScale,lightMap);
+	if(Surface.DetailTexture)
+		setSurfacePass(record,2,Surface.DetailTexture->Pan.X,Surface.DetailTexture->Pan.Y,detail);
+	else if(detail) //External detail texture, which goes with the diffuse texture
+		setSurfacePass(record,2,Surface.Texture->Pan.X,Surface.Texture->Pan.Y,detail);
+	if(Surface.FogMap) //Fogmaps require pan correction of -.5
+		setSurfacePass(record,3,Surface.FogMap->Pan.X-0.5f*Surface.FogMap->UScale,Surface.FogMap->Pan.Y-0.5f*Surface.FogMap->VScale,fogMap);
+	if(Surface.MacroTexture)
+		setSurfacePass(record,4,Surface.MacroTexture->Pan.X,Surface.MacroTexture->Pan.Y,macro);
+
+	//Upload the facet's vertices the first time it's drawn; after that only indices are written
+	WorldGeometryBuffer *world = static_cast<WorldGeometryBuffer*>(shader_ComplexSurface->getGeometryBuffer());
+	UINT numVerts;
+	unsigned long long facet = facetKey(Surface,Facet,numVerts);
+	if(numVerts==0)
+		return;
+	WorldGeometryBuffer::Facet *cached = world->findFacet(facet);
+	if(!cached)
 	{
-		if(!textureCache->setTexture(shader_ComplexSurface,TextureCache::PASS_HEIGHT,Surface.Texture->CacheID,TextureCache::EXTRA_TEX_HEIGHT))
-			return;
-		shader_ComplexSurface->switchPass(TextureCache::PASS_HEIGHT,1);
+		if(!(cached = world->addFacet(facet,numVerts))) //Cache full; everything drawn from it must be drawn before starting over
+		{
+			commandList->flush();
+			D3D::render();
+			world->reset();
+			if(!(cached = world->addFacet(facet,numVerts)))
+				return;
+		}
+		Vertex_ComplexSurface *v = world->getVertices(cached);
+		for(FSavedPoly* Poly=Facet.Polys; Poly; Poly=Poly->Next)
+		{
+			if(Poly->NumPts < 3) //Skip invalid polygons
+				continue;
+			for(INT i=0; i<Poly->NumPts; i++, v++)
+			{
+				v->Pos = *(Vec3*)&Poly->Pts[i]->Point.X;
+				v->surface = cached->surface;
+			}
+		}
+	}
+
+	//Panning changes the record between frames; if it changes within one, geometry drawn with the old record has to go first
+	bool used = world->useFacet(cached);
+	if(!shader_ComplexSurface->isSurface(cached->surface,record))
+	{
+		if(used)
+		{
+			commandList->flush();
+			D3D::render();
+		}
+		shader_ComplexSurface->setSurface(cached->surface,record);
+	}
+
+	//Opaque surfaces are recorded to be drawn sorted by state later on; others are recorded in order too, or drawn right away after any recorded geometry.
+	bool deferred = commandList->records(flags);
+	if(deferred)
+	{
+		commandList->beginCommand(key,0);
 	}
 	else
 	{
-		shader_ComplexSurface->switchPass(TextureCache::PASS_HEIGHT,0);
+		commandList->flush();
+		commandList->bindState(key);
 	}
 
-	//Code from OpenGL renderer to calculate texture coordinates
-	FLOAT UDot = Facet.MapCoords.XAxis | Facet.MapCoords.Origin;
-	FLOAT VDot = Facet.MapCoords.YAxis | Facet.MapCoords.Origin;
-	
 	//Draw each polygon
+	UINT firstVertex = cached->firstVertex;
 	for(FSavedPoly* Poly=Facet.Polys; Poly; Poly=Poly->Next )
 	{
 		if(Poly->NumPts < 3) //Skip invalid polygons
 			continue;
 
-		DynamicGeometryBuffer *buf = static_cast<DynamicGeometryBuffer*>(shader_ComplexSurface->getGeometryBuffer());
-		buf->indexTriangleFan(Poly->NumPts); //Reserve space and generate indices for fan		
-		for( INT i=0; i<Poly->NumPts; i++ )
-		{
-			Vertex_ComplexSurface *v = (Vertex_ComplexSurface*) buf->getVertex();
-			
-			//Code from OpenGL renderer to calculate texture coordinates
-			FLOAT U = Facet.MapCoords.XAxis | Poly->Pts[i]->Point;
-			FLOAT V = Facet.MapCoords.YAxis | Poly->Pts[i]->Point;
-			FLOAT UCoord = U-UDot;
-			FLOAT VCoord = V-VDot;
-
-			//Diffuse texture coordinates
-			v->TexCoord[0].x = (UCoord-Surface.Texture->Pan.X)*diffuse->multU;
-			v->TexCoord[0].y = (VCoord-Surface.Texture->Pan.Y)*diffuse->multV;
-
-			if(Surface.LightMap)
-			{
-				//Lightmaps require pan correction of -.5
-				v->TexCoord[1].x = (UCoord-(Surface.LightMap->Pan.X-0.5f*Surface.LightMap->UScale) )*lightMap->multU; 
-				v->TexCoord[1].y = (VCoord-(Surface.LightMap->Pan.Y-0.5f*Surface.LightMap->VScale) )*lightMap->multV;
-			}
-			if(Surface.DetailTexture)
-			{
-				v->TexCoord[2].x = (UCoord-Surface.DetailTexture->Pan.X)*detail->multU; 
-				v->TexCoord[2].y = (VCoord-Surface.DetailTexture->Pan.Y)*detail->multV;
-			}
-			if(Surface.FogMap)
-			{
-				//Fogmaps require pan correction of -.5
-				v->TexCoord[3].x = (UCoord-(Surface.FogMap->Pan.X-0.5f*Surface.FogMap->UScale) )*fogMap->multU; 
-				v->TexCoord[3].y = (VCoord-(Surface.FogMap->Pan.Y-0.5f*Surface.FogMap->VScale) )*fogMap->multV;			
-			}
-			if(Surface.MacroTexture)
-			{
-				v->TexCoord[4].x = (UCoord-Surface.MacroTexture->Pan.X)*macro->multU; 
-				v->TexCoord[4].y = (VCoord-Surface.MacroTexture->Pan.Y)*macro->multV;			
-			}
-			
-			v->flags = flags;
-			v->Pos = *(Vec3*)&Poly->Pts[i]->Point.X; //Position
-
-		}
-
+		if(deferred)
+			commandList->indexCachedFan(Poly->NumPts,firstVertex);
+		else if(world->indexTriangleFan(firstVertex,Poly->NumPts)!=WorldGeometryBuffer::BATCH_ADDED)
+			break; //Index buffer unusable; logged by the buffer
+		firstVertex += Poly->NumPts;
 	}
 }
 
@@ -638,35 +1030,53 @@ They are sent with a call of this function per triangle fan, worldview transform
 */
 void UD3D10RenderDevice::DrawGouraudPolygon( FSceneNode* Frame, FTextureInfo& Info, FTransTexture** Pts, int NumPts, DWORD PolyFlags, FSpanBuffer* Span )
 {
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordGouraudPolygon(Frame,Info,Pts,NumPts,PolyFlags);
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordGouraudPolygon(Frame,Info,Pts,NumPts,PolyFlags);
+		return;
+	}
 
 	if(NumPts<3) //Invalid triangle
 		return;
 	
-	D3D::switchToShader(D3D::SHADER_GOURAUDPOLYGON);	
-	
-	//Set texture
-	PrecacheTexture(Info,PolyFlags);
+	//Cache texture
 	const TextureCache::TextureMetaData *diffuse = nullptr;
-	if(!(diffuse=textureCache->setTexture(shader_GouraudPolygon,TextureCache::PASS_DIFFUSE,Info.CacheID)))
+	if(!(diffuse=cacheTexture(Info,PolyFlags,TextureCache::PASS_DIFFUSE)))
 		return;
 	
 	DWORD flags = PolyFlags | diffuse->customPolyFlags;
-	shader_GouraudPolygon->setFlags(flags);
+	CommandList::StateKey key(D3D::SHADER_GOURAUDPOLYGON);
+	key.textures[TextureCache::PASS_DIFFUSE] = Info.CacheID;
+	key.versions[TextureCache::PASS_DIFFUSE] = diffuse->version;
+	key.blendFlags = flags;
+
+	//Record opaque fans for sorted drawing; others are recorded in order or drawn right away
+	bool deferred = commandList->records(flags);
+	DynamicGeometryBuffer *buf = nullptr;
+	if(deferred)
+	{
+		commandList->beginCommand(key,sizeof(Vertex_GouraudPolygon));
+		commandList->indexTriangleFan(NumPts);
+	}
+	else
+	{
+		commandList->flush();
+		commandList->bindState(key);
+		buf = static_cast<DynamicGeometryBuffer*>(shader_GouraudPolygon->getGeometryBuffer());
+		buf->indexTriangleFan(NumPts); //Reserve space and generate indices for fan
+	}
 
 	//Buffer triangle fans
-	DynamicGeometryBuffer *buf = static_cast<DynamicGeometryBuffer*>(shader_GouraudPolygon->getGeometryBuffer());
-	buf->indexTriangleFan(NumPts); //Reserve space and generate indices for fan
 	for(INT i=0; i<NumPts; i++) //Set fan verts
 	{
-		Vertex_GouraudPolygon *v = (Vertex_GouraudPolygon*) buf->getVertex();				
+		Vertex_GouraudPolygon *v = (Vertex_GouraudPolygon*) (deferred ? commandList->getVertex() : buf->getVertex());
 		v->Pos = *(Vec3*)&Pts[i]->Point.X;
 		v->TexCoord.x = (Pts[i]->U)*diffuse->multU;
 		v->TexCoord.y = (Pts[i]->V)*diffuse->multV;
-		v->Color = *(Vec4*)&Pts[i]->Light.X;
-		v->Fog = *(Vec4*)&Pts[i]->Fog.X;
-		v->flags = flags;
-		v->Color.w = 1.0f;
-
+		v->Color = packColor10(Pts[i]->Light);
+		v->Fog = packColor8(Pts[i]->Fog);
 	}
 
 }
@@ -690,23 +1100,33 @@ Used for 2D UI elements, smoke.
 \param PolyFlags Contains the correct flags for this tile. See polyflags.h
 
 \note Need to set scene node here otherwise Deus Ex dialogue letterboxes will look wrong; they aren't properly sent to SetSceneNode() it seems.
-\note Drawn by expanding a single vertex to a quad in the geometry shader.
+\note Drawn as an instance of a quad, see InstanceGeometryBuffer.
 */
 void UD3D10RenderDevice::DrawTile( FSceneNode* Frame, FTextureInfo& Info, FLOAT X, FLOAT Y, FLOAT XL, FLOAT YL, FLOAT U, FLOAT V, FLOAT UL, FLOAT VL, class FSpanBuffer* Span, FLOAT Z, FPlane Color, FPlane Fog, DWORD PolyFlags )
 {
-	D3D::switchToShader(D3D::SHADER_TILE);
-	SetSceneNode(Frame); //Set scene node fix.
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordTile(Frame,Info,X,Y,XL,YL,U,V,UL,VL,Z,Color,Fog,PolyFlags);
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordTile(Frame,Info,X,Y,XL,YL,U,V,UL,VL,Z,Color,Fog,PolyFlags);
+		return;
+	}
+
+	applySceneNode(Frame); //Set scene node fix.
 
-	PrecacheTexture(Info,PolyFlags);
 	const TextureCache::TextureMetaData *diffuse = nullptr;
-	if(!(diffuse=textureCache->setTexture(shader_Tile,TextureCache::PASS_DIFFUSE,Info.CacheID)))
+	if(!(diffuse=cacheTexture(Info,PolyFlags,TextureCache::PASS_DIFFUSE)))
 		return;
 	
 	DWORD flags = PolyFlags | diffuse->customPolyFlags;
+	if(!CommandList::isDeferrable(flags) || commandList->hasOrderedCommands()) //Tiles aren't recorded, but blended ones must still go after recorded geometry, and any after recorded blended geometry
+		commandList->flush();
+
+	D3D::switchToShader(D3D::SHADER_TILE);
+	textureCache->setTexture(shader_Tile,TextureCache::PASS_DIFFUSE,Info.CacheID);
 	shader_Tile->setFlags(flags);
-	DynamicGeometryBuffer *buf = static_cast<DynamicGeometryBuffer*>(shader_Tile->getGeometryBuffer());
-	buf->indexSingleVertex(); //Reserve space and generate indices for fan
-	Vertex_Tile* v = (Vertex_Tile*) buf->getVertex();
+	InstanceGeometryBuffer *buf = static_cast<InstanceGeometryBuffer*>(shader_Tile->getGeometryBuffer());
+	Vertex_Tile* v = (Vertex_Tile*) buf->getInstance(); //One instance of the tile quad
 	
 	v->XYWH.x = X;
 	v->XYWH.y = Y;
@@ -744,6 +1164,14 @@ Clear the depth buffer. Used to draw the skybox behind the rest of the geometry,
 */
 void UD3D10RenderDevice::ClearZ( FSceneNode* Frame )
 {
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordClearZ(Frame);
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordClearZ(Frame);
+		return;
+	}
+	commandList->flush();
 	D3D::render();
 	shader_GouraudPolygon->clearDepth(); //can be any shader
 }
@@ -763,11 +1191,30 @@ void UD3D10RenderDevice::PopHit( INT Count, UBOOL bForce )
 }
 
 /**
-Something to do with FPS counters etc, not needed. 
+Write the counters of the last frame, cut off if they don't fit.
+\param length Size of result in characters, the terminator included.
 */
-void UD3D10RenderDevice::GetStats( TCHAR* Result )
+static void formatStats(TCHAR *result, size_t length)
 {
+	if(renderThread)
+		renderThread->sync(); //Counters belong to the render thread
+	const D3D::Stats &s = D3D::getLastFrameStats();
+	_snprintf_s(result,length,_TRUNCATE,TEXT("draws=%u indices=%u state=%u texbinds=%u maps=%u vbKB=%u ibKB=%u texKB=%u asynctex=%u diskhits=%u diskmisses=%u texhits=%u texmisses=%u evictions=%u revalidated=%u reclaimed=%u lookups=%u lookupssaved=%u worldhits=%u worldmisses=%u windows=%u discards=%u rtupdates=%u rtflushes=%u rtKB=%u rtsavedKB=%u rtdeferred=%u residentMB=%u"),
+		s.drawCalls,s.indices,s.stateChanges,s.textureBinds,s.bufferMaps,
+		(unsigned int)(s.vertexBytes/1024),(unsigned int)(s.indexBytes/1024),(unsigned int)(s.textureBytes/1024),s.asyncTextures,
+		s.diskCacheHits,s.diskCacheMisses,s.textureCacheHits,s.textureCacheMisses,s.textureEvictions,s.texturesRevalidated,s.texturesReclaimed,s.textureLookups,s.textureLookupsSaved,
+		s.worldFacetHits,s.worldFacetMisses,s.indexWindows,s.bufferDiscards,s.realtimeUpdates,s.realtimeFlushes,
+		(unsigned int)(s.realtimeBytes/1024),(unsigned int)(s.realtimeBytesSaved/1024),s.realtimeDeferred,
+		(unsigned int)(textureCache->getTotalBytes()/(1024*1024)));
+}
 
+/**
+Report counters for the last frame; shown by the game's 'stat render' command.
+The engine doesn't pass the size of Result; other drivers write well under 256 characters, so no more than that is written. D3D10Stats logs them all.
+*/
+void UD3D10RenderDevice::GetStats( TCHAR* Result )
+{
+	formatStats(Result,256);
 }
 
 /**
@@ -777,6 +1224,10 @@ Used for screenshots and savegame previews.
 void UD3D10RenderDevice::ReadPixels( FColor* Pixels )
 {
 	UD3D10RenderDevice::debugs("Dumping screenshot...");
+	if(renderThread)
+		renderThread->sync(); //The frame has to be drawn before it can be read
+	commandList->flush();
+	D3D::render();
 	D3D::getScreenshot((Vec4_byte*)Pixels);
 	UD3D10RenderDevice::debugs("Done");
 }
@@ -786,16 +1237,25 @@ Various command from the game. Can be used to intercept input. First let the par
 
 \param Cmd The command
 	- GetRes Should return a list of resolutions in string form "HxW HxW" etc.
+	- D3D10Stats Logs the counters of the last frame.
+	- D3D10Trace [FRAMES=n] [FILE=name] Records the next n frames of renderer calls to a trace file.
+	- D3D10Replay [FILE=name] [LOOPS=n] Draws a recorded trace n times as fast as possible and logs the time taken.
+	- D3D10BCBench [SIZE=n] [LOOPS=n] [THREADS=n] Times block compression of generated opaque, masked and alpha textures and logs the error.
+	- D3D10ConvertBench [PIXELS=n] [SIZE=n] Times the P8, RGB16 and RGB8 conversions and mip generation for a SIZE x SIZE texture against their scalar versions and checks they agree.
+	- D3D10DiskCache [CLEAR] Logs the size of the converted texture cache on disk; CLEAR empties it, e.g. to time a cold replay against a warm one.
 \param Ar A class to which to log responses using Ar.Log().
 
 \note Deus Ex ignores resolutions it does not like.
 */
 UBOOL UD3D10RenderDevice::Exec(const TCHAR* Cmd, FOutputDevice& Ar)
 {
+	//Only commands that touch the device or the caches wait for the render thread; the rest, and those for the game, go through without stalling
 	//First try parent
 	TCHAR* ptr;
 	if(ParseCommand(&Cmd,"GetRes"))
 	{
+		if(renderThread)
+			renderThread->sync();
 		UD3D10RenderDevice::debugs("Getting modelist...");
 		TCHAR * resolutions=D3D::getModes();
 		Ar.Log(resolutions);
@@ -803,6 +1263,136 @@ UBOOL UD3D10RenderDevice::Exec(const TCHAR* Cmd, FOutputDevice& Ar)
 		UD3D10RenderDevice::debugs("Done.");
 		return 1;
 	}	
+	else if(ParseCommand(&Cmd,"D3D10Stats"))
+	{
+		TCHAR stats[1024];
+		formatStats(stats,ARRAY_COUNT(stats)); //Syncs itself
+		Ar.Log(stats);
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,"D3D10Trace"))
+	{
+		INT frames = 100;
+		TCHAR file[256] = "d3d10drv.trace";
+		Parse(Cmd,"FRAMES=",frames);
+		Parse(Cmd,"FILE=",file,ARRAY_COUNT(file));
+		delete traceRecorder;
+		traceRecorder = new (std::nothrow) TraceRecorder(file,frames);
+		if(!traceRecorder || !traceRecorder->isOpen())
+		{
+			Ar.Logf(TEXT("Can't write trace to %s."),file);
+			delete traceRecorder;
+			traceRecorder = nullptr;
+			return 1;
+		}
+		Ar.Logf(TEXT("Recording %i frames to %s."),frames,file);
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,"D3D10Replay"))
+	{
+		INT loops = 1;
+		TCHAR file[256] = "d3d10drv.trace";
+		Parse(Cmd,"FILE=",file,ARRAY_COUNT(file));
+		Parse(Cmd,"LOOPS=",loops);
+		if(traceRecorder)
+		{
+			Ar.Log(TEXT("Can't replay while recording."));
+			return 1;
+		}
+		TraceReplayer *replayer = new (std::nothrow) TraceReplayer(this);
+		if(!replayer || !replayer->load(file))
+		{
+			Ar.Logf(TEXT("Can't read trace %s."),file);
+			delete replayer;
+			return 1;
+		}
+
+		//Start and end with an empty texture cache so runs are comparable and the game gets its own textures back afterwards
+		flushAllTextures(); //Syncs itself
+		replayingTrace = true;
+		int frames = 0;
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		for(int i=0;i<loops;i++)
+		{
+			int n = replayer->replay();
+			if(n<0)
+				break;
+			frames += n;
+		}
+		if(renderThread)
+			renderThread->sync(); //Time until the last frame is drawn
+		QueryPerformanceCounter(&end);
+		replayingTrace = false;
+		flushAllTextures();
+		delete replayer;
+
+		float seconds = (end.QuadPart-start.QuadPart) / (float)perfCounterFreq.QuadPart;
+		Ar.Logf(TEXT("Replayed %i frames in %.3f s: %.3f ms/frame."),frames,seconds,frames ? 1000.0f*seconds/frames : 0.0f);
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,"D3D10FanBench"))
+	{
+		INT polys = 1000000;
+		Parse(Cmd,"POLYS=",polys);
+		if(polys<=0)
+			return 1;
+		static const int bspWeights[] = {20,50,10,8,4,4,0,2,0,1,0,0,0,1}; //Triangles to 16-gons; BSP polygons are mostly quads
+		static const int meshWeights[] = {1}; //Meshes are sent a triangle at a time
+		static const int clippedWeights[] = {1,1,1,1,1,1}; //Clipped decals and the like
+		benchmarkFanEncodings(Ar,TEXT("BSP"),bspWeights,ARRAY_COUNT(bspWeights),polys);
+		benchmarkFanEncodings(Ar,TEXT("Mesh"),meshWeights,ARRAY_COUNT(meshWeights),polys);
+		benchmarkFanEncodings(Ar,TEXT("Clipped"),clippedWeights,ARRAY_COUNT(clippedWeights),polys);
+		Ar.Logf(TEXT("Current FanEncoding is %i."),(int)FanEncoder::getMode());
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,"D3D10BCBench"))
+	{
+		INT size = 1024;
+		INT loops = 10;
+		DWORD_PTR processMask, systemMask;
+		GetProcessAffinityMask(GetCurrentProcess(),&processMask,&systemMask);
+		INT threads = WorkerPool::countThreads(processMask,MAX_TEXTURE_WORKERS+1);
+		Parse(Cmd,"SIZE=",size);
+		Parse(Cmd,"LOOPS=",loops);
+		Parse(Cmd,"THREADS=",threads);
+		if(size<4 || loops<=0 || threads<=0)
+			return 1;
+		//A pool of its own, as the texture workers may not exist or be fewer; kept off the game thread's core like those
+		DWORD_PTR helperMask = processMask & ~(DWORD_PTR)0x1;
+		WorkerPool helpers(threads-1,helperMask ? helperMask : processMask);
+		for(int kind=0;kind<3;kind++)
+			benchmarkBlockCompression(Ar,kind,size,loops,&helpers,threads);
+		Ar.Logf(TEXT("CompressTextures is %s."),options.compressTextures ? TEXT("on") : TEXT("off"));
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,"D3D10ConvertBench"))
+	{
+		INT pixels = 4194303; //2048x2048 minus one, so the scalar tails run too
+		INT size = 1024;
+		Parse(Cmd,"PIXELS=",pixels);
+		Parse(Cmd,"SIZE=",size);
+		if(pixels<=0 || size<=0)
+			return 1;
+		TexConverter::benchmarkExpansion(Ar,pixels);
+		TexConverter::benchmarkMipGeneration(Ar,size);
+		Ar.Logf(TEXT("GenerateMips is %s."),options.generateMips ? TEXT("on") : TEXT("off"));
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,"D3D10DiskCache"))
+	{
+		if(!diskTextureCache)
+		{
+			Ar.Log(TEXT("Disk texture cache is disabled."));
+			return 1;
+		}
+		if(renderThread)
+			renderThread->sync(); //The render thread may be reading from or writing to it
+		if(ParseCommand(&Cmd,"CLEAR"))
+			diskTextureCache->clear();
+		Ar.Logf(TEXT("Disk texture cache: %u KB."),(unsigned int)(diskTextureCache->getTotalBytes()/1024));
+		return 1;
+	}
 	else if((ptr=(TCHAR*)strstr(Cmd,"Brightness"))) //Brightness is sent as "brightness [val]".
 	{
 		UD3D10RenderDevice::debugs("Setting brightness.");
@@ -810,6 +1400,8 @@ UBOOL UD3D10RenderDevice::Exec(const TCHAR* Cmd, FOutputDevice& Ar)
 		{
 			float b;
 			b=atof(ptr); //Get brightness value;
+			if(renderThread)
+				renderThread->sync();
 			D3D::setBrightness(b);
 		}
 	}
@@ -824,10 +1416,35 @@ This optional function can be used to set the frustum and viewport parameters pe
 \note Standard Z parameters: near 1, far 32760.
 */
 void UD3D10RenderDevice::SetSceneNode(FSceneNode* Frame )
+{
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordSetSceneNode(Frame);
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordSetSceneNode(Frame);
+		return;
+	}
+	applySceneNode(Frame);
+}
+
+/**
+Set viewport and projection for a scene node. Also used by DrawTile(), which shouldn't show up as a SetSceneNode() call in traces.
+*/
+void UD3D10RenderDevice::applySceneNode(FSceneNode* Frame)
 {
 	//Calculate projection parameters
 	float aspect = Frame->FY/Frame->FX;
-	float RProjZ = appTan(Viewport->Actor->FovAngle * PI/360.0 );
+	float RProjZ = appTan((onRenderThread() ? renderThread->getFovAngle() : Viewport->Actor->FovAngle) * PI/360.0 );
+
+	//Recorded geometry must be drawn with the projection and viewport it was sent for
+	static int oldX, oldY, oldXB, oldYB;
+	static float oldAspect, oldRProjZ;
+	if(Frame->X!=oldX || Frame->Y!=oldY || Frame->XB!=oldXB || Frame->YB!=oldYB || aspect!=oldAspect || RProjZ!=oldRProjZ)
+	{
+		commandList->flush();
+		oldX = Frame->X; oldY = Frame->Y; oldXB = Frame->XB; oldYB = Frame->YB;
+		oldAspect = aspect; oldRProjZ = RProjZ;
+	}
 
  	D3D::setViewPort(Frame->X,Frame->Y,Frame->XB,Frame->YB); //Viewport is set here as it changes during gameplay. For example in DX conversations
 	shader_GouraudPolygon->setViewportSize(Frame->X,Frame->Y);	//Shared by all Unreal shaders
@@ -839,32 +1456,106 @@ Store a texture in the renderer-kept texture cache. Only called by the game if U
 \param Info Texture (meta)data. Includes a CacheID with which to index.
 \param PolyFlags Contains the correct flags for this texture. See polyflags.h
 
+\note See cacheTexture().
+*/
+void UD3D10RenderDevice::PrecacheTexture( FTextureInfo& Info, DWORD PolyFlags )
+{
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordPrecacheTexture(Info,PolyFlags);
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordPrecacheTexture(Info,PolyFlags);
+		return;
+	}
+
+	cacheTexture(Info,PolyFlags,TextureCache::PASS_DIFFUSE);
+}
+
+/**
+Cache a texture, or bring an already cached one up to date. Used by PrecacheTexture() and the draw calls.
+\param pass Pass the texture is drawn with. A P8 texture may only be cached paletted (GPUPalettes option) for the diffuse pass, which is the one that does the palette lookup.
+\return Metadata of the texture, which is marked as used this frame; NULL if it couldn't be cached.
+
 \note Already cached textures are skipped, unless it's a dynamic texture, in which case it is updated.
 \note Extra care is taken to recache textures that aren't saved as masked, but now have flags indicating they should be (masking is not always properly set).
 	as this couldn't be anticipated in advance, the texture needs to be deleted and recreated.
+\note Textures cached before a level change are checked against their fingerprint first and recreated if it changed; see TextureCache::newGeneration().
+\note Paletted textures used by a non-diffuse pass are recreated expanded and stay that way. Paletted textures whose palette changed only get their palette updated.
 */
-void UD3D10RenderDevice::PrecacheTexture( FTextureInfo& Info, DWORD PolyFlags )
+static const TextureCache::TextureMetaData *cacheTexture(FTextureInfo& Info, DWORD PolyFlags, TextureCache::TexturePass pass)
 {
-	if(textureCache->textureIsCached(Info.CacheID))
+	bool allowPaletted = pass==TextureCache::PASS_DIFFUSE;
+	TextureCache::TextureHandle texture = textureCache->findTexture(Info.CacheID,pass);
+	if(texture && textureCache->isStale(texture)) //Cached before the last level change; the id may now be a different texture
 	{
-		if((Info.TextureFlags & TF_RealtimeChanged ) == TF_RealtimeChanged) //Update already cached realtime textures
+		bool paletted = texture->metadata.paletteRow>=0;
+		if(paletted && commandList->referencesTexture(Info.CacheID))
+			commandList->flush();
+		if(texture->metadata.fingerprint==TexConverter::fingerprint(Info,!paletted) && (!paletted || texConverter->updatePalette(Info))) //Palettes of paletted textures are uploaded again, their PaletteCacheID may be reused too
 		{
-			texConverter->update(Info,PolyFlags);
-			return;
+			textureCache->revalidate(texture);
+			D3D::stats.texturesRevalidated++;
+		}
+		else
+		{
+			if(commandList->referencesTexture(Info.CacheID))
+				commandList->flush();
+			textureCache->deleteTexture(Info.CacheID);
+			texture = nullptr;
+		}
+	}
+
+	if(texture)
+	{
+		D3D::stats.textureCacheHits++;
+		const TextureCache::TextureMetaData &metadata = texture->metadata;
+		bool realtimeChanged = (Info.TextureFlags & TF_RealtimeChanged ) == TF_RealtimeChanged || texture->updateDeferred;
+		bool maskChanged = (PolyFlags & PF_Masked)&&!metadata.masked;
+		bool needsExpanding = metadata.paletteRow>=0 && !allowPaletted;
+		bool paletteChanged = metadata.paletteRow>=0 && metadata.paletteCacheID!=Info.PaletteCacheID;
+		bool changed = maskChanged||needsExpanding||paletteChanged;
+		if((changed && commandList->referencesTexture(Info.CacheID)) || (realtimeChanged && !changed && commandList->referencesTextureBefore(Info.CacheID,TextureCache::getOldestKeptVersion(texture)))) //Recorded geometry must be drawn with the texture as it was; realtime updates keep the last few versions
+		{
+			commandList->flush();
+			if(realtimeChanged)
+				D3D::stats.realtimeFlushes++;
+		}
+
+		if(needsExpanding) //Static texture, so must be deleted and recreated.
+		{
+			textureCache->deleteTexture(Info.CacheID);
 		}
-		else if((PolyFlags & PF_Masked)&&!textureCache->getTextureMetaData(Info.CacheID).masked) //Mask bit changed. Static texture, so must be deleted and recreated.
+		else if(realtimeChanged) //Update already cached realtime textures
+		{
+			if(texConverter->update(Info,PolyFlags,texture))
+				return textureCache->useTexture(texture);
+			textureCache->deleteTexture(Info.CacheID);
+		}
+		else if(maskChanged) //Mask bit changed. Static texture, so must be deleted and recreated.
 		{			
 			textureCache->deleteTexture(Info.CacheID);	
 		}
+		else if(paletteChanged)
+		{
+			if(texConverter->updatePalette(Info))
+				return textureCache->useTexture(texture);
+			textureCache->deleteTexture(Info.CacheID);
+		}
 		else //Texture is already cached and doesn't need to be modified
 		{
-			return;
+			return textureCache->useTexture(texture);
 		}		
 	}
+	else
+	{
+		D3D::stats.textureCacheMisses++;
+	}
 
 	//Cache texture
-	texConverter->convertAndCache(Info, PolyFlags); //Fills TextureInfo with metadata and a D3D format texture		
-
+	texConverter->convertAndCache(Info, PolyFlags, allowPaletted); //Fills TextureInfo with metadata and a D3D format texture		
+	if(!(texture = textureCache->findTexture(Info.CacheID,pass))) //Conversion went wrong
+		return nullptr;
+	return textureCache->useTexture(texture);
 }
 
 /**
@@ -875,6 +1566,14 @@ Seems this is called before HUD elements are drawn so the flash doesn't overlay
 void  UD3D10RenderDevice::EndFlash()
 {
 	/** Postprocess scene and then draw HUD to buffer used in last pass so it doesn't get postprocessed */
+	if(traceRecorder && !onRenderThread())
+		traceRecorder->recordEndFlash();
+	if(TraceRecorder *stream = renderStream())
+	{
+		stream->recordEndFlash();
+		return;
+	}
+	commandList->flush();
 	if(!drawingHUD)
 	{
 		D3D::postprocess();
@@ -25,11 +25,22 @@ private:
 		int autoFOV; /**< Turn on auto field of view setting */
 		int FPSLimit; /**< 60FPS frame limiter */
 		int unlimitedViewDistance; /**< Set frustum to max map size */
+		int deferOpaqueDraws; /**< Record opaque geometry and draw it sorted by state, see CommandList */
+		int recordAllDraws; /**< Record blended geometry as well, in order, so the command list is only flushed on dependencies */
+		int asyncTextures; /**< Convert static textures on worker threads, drawing placeholders meanwhile */
+		int diskTextureCacheMB; /**< Size cap of the converted texture cache on disk; 0 disables it */
+		int textureBudgetMB; /**< Video memory for textures before least recently used ones are evicted; 0 for no limit */
+		int renderThread; /**< Draw on a thread of its own, from a stream the game thread records, see RenderThread */
+		int compressTextures; /**< Block compress static textures to BC1/BC3, see BCEncoder */
+		int generateMips; /**< Build the missing mips of textures that come with only the top one, see TexConverter::buildMips(). Off by default: realtime textures then take UpdateSubresource instead of Map. Only then are just their changed rows uploaded */
+		int realtimeUploadKB; /**< Realtime texture updates per frame before further ones wait for the next frame; 0 for no limit */
 	} options;
 
 	//Idk
 	UBOOL PrecacheOnFlip;
 
+	void applySceneNode(FSceneNode* Frame);
+
 
 public:
 	/**@name Helpers */
@@ -0,0 +1,271 @@
+/**
+\class DiskTextureCache
+Converted textures kept on disk between runs, so textures that need converting (see TexConverter) only have to be converted once.
+
+Each texture is a file in the cache directory named after a hash of its source data (CacheIDs are derived from object indices, so aren't stable between runs).
+Files hold the GPU-ready mips, which are memory mapped and handed to the texture creation as they are.
+Least recently used files are deleted when the total size goes over the cap. Files with another version are deleted when found.
+All functions can be called from worker threads.
+*/
+
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include "disktexturecache.h"
+#include "texturecache.h"
+
+static const DWORD CACHE_MAGIC = 'TCHK';
+static const DWORD CACHE_VERSION = 1; /**< Bump when converted data changes */
+
+/** Start of each cache file; followed by MipLevels MipHeaders and the mip data */
+struct FileHeader
+{
+	DWORD magic;
+	DWORD version;
+	ULONGLONG hash;
+	DXGI_FORMAT format;
+	UINT width;
+	UINT height;
+	UINT mipLevels;
+};
+
+struct MipHeader
+{
+	UINT pitch;
+	UINT size;
+};
+
+static ULONGLONG now()
+{
+	FILETIME time;
+	GetSystemTimeAsFileTime(&time);
+	return ((ULONGLONG)time.dwHighDateTime<<32) | time.dwLowDateTime;
+}
+
+/**
+\param directory Where cache files go, created if needed.
+\param maxBytes Size cap of all files.
+*/
+DiskTextureCache::DiskTextureCache(const char *directory, size_t maxBytes): directory(directory), maxBytes(maxBytes), totalBytes(0)
+{
+	CreateDirectory(directory,nullptr);
+
+	//Index existing files; leftovers from interrupted stores are deleted
+	WIN32_FIND_DATA find;
+	HANDLE h = FindFirstFile(fileName(0,"*").c_str(),&find);
+	if(h==INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		std::string path = this->directory+"\\"+find.cFileName;
+		ULONGLONG hash;
+		const char *extension = strrchr(find.cFileName,'.');
+		if(!extension || strcmp(extension,".tex") || sscanf_s(find.cFileName,"%16llx",&hash)!=1)
+		{
+			if(extension && !strcmp(extension,".tmp"))
+				DeleteFile(path.c_str());
+			continue;
+		}
+		Entry e;
+		e.size = find.nFileSizeLow;
+		e.lastUse = ((ULONGLONG)find.ftLastWriteTime.dwHighDateTime<<32) | find.ftLastWriteTime.dwLowDateTime;
+		entries[hash] = e;
+		totalBytes += e.size;
+	} while(FindNextFile(h,&find));
+	FindClose(h);
+
+	evict();
+}
+
+/**
+\param hash Content hash, or 0 with a wildcard extension for a search pattern.
+*/
+std::string DiskTextureCache::fileName(ULONGLONG hash, const char *extension) const
+{
+	char name[32];
+	if(hash)
+		sprintf_s(name,"%016llx.%s",hash,extension);
+	else
+		sprintf_s(name,"*.%s",extension);
+	return directory+"\\"+name;
+}
+
+/**
+Delete least recently used files until the cache is well under its cap, so this doesn't run on every store.
+\note Call with the mutex held.
+*/
+void DiskTextureCache::evict()
+{
+	if(totalBytes<=maxBytes)
+		return;
+
+	std::vector<std::pair<ULONGLONG,ULONGLONG>> byAge; //Last use, hash
+	for(std::unordered_map<ULONGLONG,Entry>::const_iterator i=entries.begin();i!=entries.end();i++)
+	{
+		byAge.push_back(std::make_pair(i->second.lastUse,i->first));
+	}
+	std::sort(byAge.begin(),byAge.end());
+
+	for(std::vector<std::pair<ULONGLONG,ULONGLONG>>::const_iterator i=byAge.begin();i!=byAge.end() && totalBytes>maxBytes/4*3;i++)
+	{
+		if(!DeleteFile(fileName(i->second,"tex").c_str())) //In use by a load
+			continue;
+		totalBytes -= entries[i->second].size;
+		entries.erase(i->second);
+	}
+}
+
+/**
+Map a cached texture.
+\param desc Description of the texture that will be created; the file must match it.
+\param mapped Filled in on success; pass to release() once the texture is created.
+\return true if the texture was found.
+*/
+bool DiskTextureCache::load(ULONGLONG hash, const D3D10_TEXTURE2D_DESC &desc, MappedTexture &mapped)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::unordered_map<ULONGLONG,Entry>::iterator i = entries.find(hash);
+		if(i==entries.end())
+			return false;
+		i->second.lastUse = now();
+	}
+
+	std::string path = fileName(hash,"tex");
+	mapped.file = CreateFile(path.c_str(),GENERIC_READ|FILE_WRITE_ATTRIBUTES,FILE_SHARE_READ,nullptr,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+	mapped.mapping = nullptr;
+	mapped.view = nullptr;
+	if(mapped.file==INVALID_HANDLE_VALUE)
+		return false;
+
+	//Touch, so use order survives restarts
+	ULONGLONG time = now();
+	FILETIME writeTime = {(DWORD)time,(DWORD)(time>>32)};
+	SetFileTime(mapped.file,nullptr,nullptr,&writeTime);
+
+	DWORD size = GetFileSize(mapped.file,nullptr);
+	if(size>=sizeof(FileHeader))
+	{
+		mapped.mapping = CreateFileMapping(mapped.file,nullptr,PAGE_READONLY,0,0,nullptr);
+		if(mapped.mapping)
+			mapped.view = MapViewOfFile(mapped.mapping,FILE_MAP_READ,0,0,0);
+	}
+
+	//Validate and point the mips into the view
+	bool valid = false;
+	if(mapped.view)
+	{
+		const FileHeader *header = (const FileHeader*)mapped.view;
+		const MipHeader *mips = (const MipHeader*)(header+1);
+		size_t offset = sizeof(FileHeader)+header->mipLevels*sizeof(MipHeader);
+		valid = header->magic==CACHE_MAGIC && header->version==CACHE_VERSION && header->hash==hash && header->format==desc.Format
+			&& header->width==desc.Width && header->height==desc.Height && header->mipLevels==desc.MipLevels && offset<=size;
+		for(UINT i=0;valid && i<header->mipLevels;i++)
+		{
+			valid = mips[i].size==mips[i].pitch*TextureCache::getMipRows(desc,i) && offset+mips[i].size<=size;
+			mapped.data[i].pSysMem = (const BYTE*)mapped.view+offset;
+			mapped.data[i].SysMemPitch = mips[i].pitch;
+			mapped.data[i].SysMemSlicePitch = 0;
+			offset += mips[i].size;
+		}
+	}
+
+	if(!valid)
+	{
+		release(mapped);
+		std::lock_guard<std::mutex> lock(mutex);
+		if(DeleteFile(path.c_str())) //Other version or damaged
+		{
+			totalBytes -= entries[hash].size;
+			entries.erase(hash);
+		}
+		return false;
+	}
+	return true;
+}
+
+/**
+Unmap a texture mapped by load().
+*/
+void DiskTextureCache::release(MappedTexture &mapped)
+{
+	if(mapped.view)
+		UnmapViewOfFile(mapped.view);
+	if(mapped.mapping)
+		CloseHandle(mapped.mapping);
+	if(mapped.file!=INVALID_HANDLE_VALUE)
+		CloseHandle(mapped.file);
+	mapped.view = nullptr;
+	mapped.mapping = nullptr;
+	mapped.file = INVALID_HANDLE_VALUE;
+}
+
+/**
+Write a converted texture to the cache.
+\param data Mip data the texture was created with.
+*/
+void DiskTextureCache::store(ULONGLONG hash, const D3D10_TEXTURE2D_DESC &desc, const D3D10_SUBRESOURCE_DATA *data)
+{
+	FileHeader header = {CACHE_MAGIC,CACHE_VERSION,hash,desc.Format,desc.Width,desc.Height,desc.MipLevels};
+	MipHeader mips[D3D10_REQ_MIP_LEVELS];
+	size_t size = sizeof(header)+desc.MipLevels*sizeof(MipHeader);
+	for(UINT i=0;i<desc.MipLevels;i++)
+	{
+		mips[i].pitch = data[i].SysMemPitch;
+		mips[i].size = data[i].SysMemPitch*TextureCache::getMipRows(desc,i);
+		size += mips[i].size;
+	}
+	if(size>maxBytes/4) //Would evict too much
+		return;
+
+	//Written under a temporary name first, so a texture being stored by two threads or an interrupted store can't leave a broken file
+	char tmp[32];
+	sprintf_s(tmp,"%08x.tmp",GetCurrentThreadId());
+	std::string tmpPath = fileName(hash,tmp);
+	HANDLE file = CreateFile(tmpPath.c_str(),GENERIC_WRITE,0,nullptr,CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,nullptr);
+	if(file==INVALID_HANDLE_VALUE)
+		return;
+	DWORD written;
+	bool ok = WriteFile(file,&header,sizeof(header),&written,nullptr) && WriteFile(file,mips,desc.MipLevels*sizeof(MipHeader),&written,nullptr);
+	for(UINT i=0;ok && i<desc.MipLevels;i++)
+	{
+		ok = WriteFile(file,data[i].pSysMem,mips[i].size,&written,nullptr)!=0;
+	}
+	CloseHandle(file);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if(!ok || !MoveFileEx(tmpPath.c_str(),fileName(hash,"tex").c_str(),MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFile(tmpPath.c_str());
+		return;
+	}
+	Entry &e = entries[hash];
+	totalBytes += size-e.size; //Entry is zeroed if new
+	e.size = size;
+	e.lastUse = now();
+	evict();
+}
+
+/**
+Delete all cache files that aren't in use.
+*/
+void DiskTextureCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for(std::unordered_map<ULONGLONG,Entry>::iterator i=entries.begin();i!=entries.end();)
+	{
+		if(DeleteFile(fileName(i->first,"tex").c_str()))
+		{
+			totalBytes -= i->second.size;
+			i = entries.erase(i);
+		}
+		else
+			i++;
+	}
+}
+
+size_t DiskTextureCache::getTotalBytes()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return totalBytes;
+}
@@ -0,0 +1,51 @@
+/**
+\file disktexturecache.h
+*/
+
+#pragma once
+
+class DiskTextureCache;
+
+#include <windows.h>
+#include <d3d10.h>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+class DiskTextureCache
+{
+public:
+	/** Texture data mapped from a cache file; the subresource data points into the mapped view until release() */
+	struct MappedTexture
+	{
+		HANDLE file;
+		HANDLE mapping;
+		const void *view;
+		D3D10_SUBRESOURCE_DATA data[D3D10_REQ_MIP_LEVELS];
+	};
+
+private:
+	/** Cache file as known to the index */
+	struct Entry
+	{
+		size_t size;
+		ULONGLONG lastUse; /**< FILETIME of last store or load, for eviction */
+	};
+
+	std::string directory;
+	size_t maxBytes;
+	size_t totalBytes;
+	std::unordered_map<ULONGLONG,Entry> entries; /**< Cache files by content hash */
+	std::mutex mutex; /**< Guards the index; used by worker threads */
+
+	std::string fileName(ULONGLONG hash, const char *extension) const;
+	void evict();
+
+public:
+	DiskTextureCache(const char *directory, size_t maxBytes);
+	bool load(ULONGLONG hash, const D3D10_TEXTURE2D_DESC &desc, MappedTexture &mapped);
+	void release(MappedTexture &mapped);
+	void store(ULONGLONG hash, const D3D10_TEXTURE2D_DESC &desc, const D3D10_SUBRESOURCE_DATA *data);
+	void clear();
+	size_t getTotalBytes();
+};
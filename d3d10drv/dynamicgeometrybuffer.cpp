@@ -1,38 +1,97 @@
+/**
+\class DynamicGeometryBuffer
+Geometry written by the CPU each frame.
+
+The buffers are used as rings (see RingAllocator) that are appended to with D3D10_MAP_WRITE_NO_OVERWRITE across frames; geometry only goes back to the start of
+a buffer once the GPU has drawn what was there, which means not having to rename the buffers with a discard every frame. They're only discarded if the GPU is
+so far behind that no space is free. The ring sizes start at what the shader asks for and follow the peak use per frame, the buffers being recreated between frames.
+
+Indices are 16 bit and relative to a base vertex, which is passed to DrawIndexed(). If a fan would reach past FanEncoder::WINDOW_SIZE vertices from the base,
+what's buffered is drawn and a new window starts at the fan's first vertex; the same happens when the vertex ring wraps. A window only runs out once a ring has grown past 64K vertices.
+How fans become indices depends on the FanEncoder mode.
+
+Besides fans being indexed and drawn one state at a time, a whole CommandList can be written as a batch with a single map, after which its ranges are drawn.
+*/
+
 #include "dynamicgeometrybuffer.h"
 #include "d3d10drv.h"
 
+static const size_t MAX_GROWTH = 16; /**< Rings grow to at most this many times the size the shader asked for */
+
 DynamicGeometryBuffer::DynamicGeometryBuffer(ID3D10Device* device) : 
 GeometryBuffer(device),
+clear(true),
+numVerts(0),
 mappedIBuffer(nullptr),
-mappedVBuffer(nullptr)
+mappedVBuffer(nullptr),
+baseVertex(0),
+vertexRing(nullptr),
+indexRing(nullptr)
 {
-	
+	indexFormat = DXGI_FORMAT_R16_UINT;
 }
 
+DynamicGeometryBuffer::~DynamicGeometryBuffer()
+{
+	delete vertexRing;
+	delete indexRing;
+}
+
+/**
+\param size Initial number of vertices and indices.
+*/
 bool DynamicGeometryBuffer::create(size_t size, size_t vertexSize)
 {
-	this->size = size;
+	this->vertexSize = vertexSize;
+	vertexRing = new (std::nothrow) RingAllocator(device,size,size*MAX_GROWTH);
+	if(FanEncoder::getMode()!=FanEncoder::MODE_TABLE)
+		indexRing = new (std::nothrow) RingAllocator(device,size,size*MAX_GROWTH);
+	if(!vertexRing || (!indexRing && FanEncoder::getMode()!=FanEncoder::MODE_TABLE))
+		return false;
+	return createBuffers(size,size);
+}
+
+/**
+(Re)create the buffers; any previous contents are lost.
+*/
+bool DynamicGeometryBuffer::createBuffers(size_t vertices, size_t indices)
+{
+	unmap();
+	SAFE_RELEASE(vertexBuffer);
+	SAFE_RELEASE(indexBuffer);
+	clear = true;
+	numVerts = 0;
+	numIndices = 0;
+	numUndrawnIndices = 0;
+	baseVertex = 0;
+	tableFans.clear();
 
 	D3D10_BUFFER_DESC vertexBufferDesc;
     vertexBufferDesc.Usage            = D3D10_USAGE_DYNAMIC;
-    vertexBufferDesc.ByteWidth        = vertexSize*size;
+    vertexBufferDesc.ByteWidth        = vertexSize*vertices;
     vertexBufferDesc.BindFlags        = D3D10_BIND_VERTEX_BUFFER;
     vertexBufferDesc.CPUAccessFlags   = D3D10_CPU_ACCESS_WRITE;
     vertexBufferDesc.MiscFlags        = 0;
 
 	D3D10_BUFFER_DESC indexBufferDesc;
     indexBufferDesc.Usage            = D3D10_USAGE_DYNAMIC;
-    indexBufferDesc.ByteWidth        = sizeof(int)*size;
+    indexBufferDesc.ByteWidth        = sizeof(WORD)*indices;
     indexBufferDesc.BindFlags        = D3D10_BIND_INDEX_BUFFER;
     indexBufferDesc.CPUAccessFlags   = D3D10_CPU_ACCESS_WRITE;
     indexBufferDesc.MiscFlags        = 0;
 
+	if(FanEncoder::getMode()==FanEncoder::MODE_TABLE)
+	{
+		D3D10_SUBRESOURCE_DATA table;
+		FanEncoder::describeTable(indexBufferDesc,table);
+		return GeometryBuffer::create(0,vertexSize,&vertexBufferDesc,&indexBufferDesc,nullptr,&table);
+	}
 	return GeometryBuffer::create(0,vertexSize,&vertexBufferDesc,&indexBufferDesc,nullptr,nullptr);
 }
 
 void DynamicGeometryBuffer::map()
 {
-	HRESULT hr, hr2;
+	HRESULT hr, hr2 = S_OK;
 	if(mappedIBuffer!=nullptr||mappedVBuffer!=nullptr)
 	{
 		//UD3D10RenderDevice::debugs("map() without unmap");
@@ -42,12 +101,8 @@ void DynamicGeometryBuffer::map()
 	D3D10_MAP m;
 	if(clear)
 	{
-		numVerts=0;
-		numIndices=0;
-		numUndrawnIndices=0;
 		m = D3D10_MAP_WRITE_DISCARD;
 		clear=false;
-
 	}
 	else
 	{
@@ -55,8 +110,10 @@ void DynamicGeometryBuffer::map()
 	}
 	
 
+	D3D::stats.bufferMaps++;
 	hr = vertexBuffer->Map(m,0,(void**)&mappedVBuffer);
-	hr2 = indexBuffer->Map(m,0,(void**)&mappedIBuffer);
+	if(FanEncoder::getMode()!=FanEncoder::MODE_TABLE)
+		hr2 = indexBuffer->Map(m,0,(void**)&mappedIBuffer);
 	if(FAILED(hr) || FAILED(hr2))
 	{
 		UD3D10RenderDevice::debugs("Failed to map index and/or vertex buffer.");
@@ -65,78 +122,231 @@ void DynamicGeometryBuffer::map()
 
 bool DynamicGeometryBuffer::unmap()
 {
-	if(mappedVBuffer==nullptr || mappedIBuffer == nullptr) //No buffer mapped, do nothing
+	if(mappedVBuffer==nullptr) //No buffer mapped, do nothing
 	{
 		return 0;
 	}
 	vertexBuffer->Unmap();
 	mappedVBuffer=nullptr;
-	indexBuffer->Unmap();
-	mappedIBuffer=nullptr;
+	if(mappedIBuffer!=nullptr)
+	{
+		indexBuffer->Unmap();
+		mappedIBuffer=nullptr;
+	}
 
 	return 1;
 }
 
-void DynamicGeometryBuffer::indexTriangleFan(int num)
-{		
-	//Make sure there's index and vertex buffer room for a triangle fan; if not, the current buffer content is drawn and discarded
-	//Index buffer is checked only, as there's equal or more indices than vertices. There.s 3*(n-1) indices for n vertices.
-	int newIndices = (num-2)*3;
-	
-	if(numIndices+newIndices>size)
+/**
+Allocate ring space for a primitive, drawing what's buffered first if the new space doesn't directly follow it.
+\note The buffer's shader must be the current one.
+*/
+void DynamicGeometryBuffer::allocate(int num, int numIndices, size_t &firstVertex, size_t &firstIndex)
+{
+	firstIndex = this->numIndices;
+	RingAllocator::Result rv = vertexRing->allocate(num,firstVertex);
+	RingAllocator::Result ri = indexRing ? indexRing->allocate(numIndices,firstIndex) : RingAllocator::RESULT_APPENDED;
+
+	if(rv==RingAllocator::RESULT_FULL || ri==RingAllocator::RESULT_FULL) //GPU is still using all space; draw and discard
 	{
 		D3D::render();
-		clear=true;
-		map();	
+		D3D::stats.bufferDiscards++;
+		unmap();
+		clear = true;
+		baseVertex = 0;
+
+		size_t vertices = vertexRing->getCapacity();
+		size_t indices = indexRing ? indexRing->getCapacity() : 0;
+		while(vertices<(size_t)num) //Primitive larger than a whole buffer; grow right away
+			vertices *= 2;
+		while(indexRing && indices<(size_t)numIndices)
+			indices *= 2;
+		if(vertices!=vertexRing->getCapacity() || (indexRing && indices!=indexRing->getCapacity()))
+		{
+			if(!createBuffers(vertices,indices ? indices : vertices))
+				UD3D10RenderDevice::debugs("DynamicGeometryBuffer: Failed to grow buffers.");
+			bind();
+		}
+		vertexRing->reset(vertices);
+		vertexRing->allocate(num,firstVertex);
+		firstIndex = 0;
+		if(indexRing)
+		{
+			indexRing->reset(indices);
+			indexRing->allocate(numIndices,firstIndex);
+		}
 	}
-	if(mappedIBuffer==nullptr)
+	else if(ri==RingAllocator::RESULT_WRAPPED) //Undrawn indices must stay consecutive
+	{
+		D3D::render();
+	}
+}
+
+void DynamicGeometryBuffer::indexTriangleFan(int num)
+{		
+	//Reserve index and vertex buffer room for a triangle fan
+	FanEncoder::Mode mode = FanEncoder::getMode();
+	int newIndices = FanEncoder::countIndices(mode,num);
+	size_t firstVertex, firstIndex;
+	allocate(num,newIndices,firstVertex,firstIndex);
+	numVerts = firstVertex;
+	numIndices = firstIndex;
+	if(mappedVBuffer==nullptr)
 		map();
 
-	//Generate fan indices	
-	for(int i=1;i<num-1;i++)
+	if(mode==FanEncoder::MODE_TABLE) //Table fans are drawn with their own base vertex
 	{
-		mappedIBuffer[numIndices++] = numVerts; //Center point
-		mappedIBuffer[numIndices++] = numVerts+i;
-		mappedIBuffer[numIndices++] = numVerts+i+1;		
+		FanEncoder::Fan f = {numVerts,num};
+		tableFans.push_back(f);
+		numUndrawnIndices += FanEncoder::countDrawnIndices(num);
+		return;
 	}
 
+	if(numVerts<baseVertex || numVerts+num-baseVertex>FanEncoder::WINDOW_SIZE) //Vertices wrapped or out of 16 bit range; draw what uses the current window and start a new one
+	{
+		D3D::render();
+		if(numVerts>=baseVertex)
+			D3D::stats.indexWindows++;
+		baseVertex = numVerts;
+		map();
+	}
+
+	//Generate fan indices	
+	FanEncoder::write(mode,&mappedIBuffer[numIndices],(WORD)(numVerts-baseVertex),num);
+	numIndices += newIndices;
 	numUndrawnIndices += newIndices;
+	D3D::stats.indexBytes += newIndices*sizeof(WORD);
+}
+
+void *DynamicGeometryBuffer::getVertex()
+{	
+	D3D::stats.vertexBytes += stride;
+	return (void*) ((char*) (mappedVBuffer)+stride*numVerts++);
 }
 
-void DynamicGeometryBuffer::indexSingleVertex()
+/**
+Reserve a number of consecutive vertices at once.
+\return Pointer to the first vertex.
+*/
+void *DynamicGeometryBuffer::getVertices(int num)
 {
-	int newIndices = 1;
-	
-	if(numIndices+newIndices>size)
+	void *v = (void*) ((char*) (mappedVBuffer)+stride*numVerts);
+	numVerts+=num;
+	D3D::stats.vertexBytes += stride*num;
+	return v;
+}
+
+/**
+Reserve space for a batch of fans and map the buffers for all of it. Index the fans with batchTriangleFan() and fill them through getVertices().
+\note Nothing may be buffered and no shader may be current, as the buffers may be recreated.
+*/
+void DynamicGeometryBuffer::beginBatch(size_t vertices, size_t indices)
+{
+	size_t firstVertex, firstIndex;
+	allocate((int)vertices,(int)indices,firstVertex,firstIndex);
+	numVerts = firstVertex;
+	numIndices = firstIndex;
+	batchFans.clear();
+	map();
+}
+
+/**
+Generate indices for the next fan of a batch.
+\param range Range the fan is added to; an empty one starts at the fan.
+\return false if the fan doesn't fit the range's 16 bit window; the range has to be ended and the fan added to a new one.
+*/
+bool DynamicGeometryBuffer::batchTriangleFan(int num, DrawRange &range)
+{
+	FanEncoder::Mode mode = FanEncoder::getMode();
+	if(range.numIndices==0)
 	{
-		draw();
-		clear=true;
-		map();	
+		range.firstIndex = numIndices;
+		range.baseVertex = numVerts;
+		range.firstFan = batchFans.size();
+		range.numFans = 0;
 	}
-	if(mappedIBuffer==nullptr)
-		map();
 
-	mappedIBuffer[numIndices++] = numVerts;
+	if(mode==FanEncoder::MODE_TABLE)
+	{
+		FanEncoder::Fan f = {numVerts,num};
+		batchFans.push_back(f);
+		range.numFans++;
+		range.numIndices += FanEncoder::countDrawnIndices(num);
+		return true;
+	}
 
-	numUndrawnIndices += newIndices;
+	if(numVerts+num-range.baseVertex>FanEncoder::WINDOW_SIZE)
+	{
+		D3D::stats.indexWindows++;
+		return false;
+	}
+	int newIndices = FanEncoder::write(mode,&mappedIBuffer[numIndices],(WORD)(numVerts-range.baseVertex),num);
+	numIndices += newIndices;
+	range.numIndices += newIndices;
+	D3D::stats.indexBytes += newIndices*sizeof(WORD);
+	return true;
 }
 
-void *DynamicGeometryBuffer::getVertex()
-{	
-	return (void*) ((char*) (mappedVBuffer)+stride*numVerts++);
+void DynamicGeometryBuffer::endBatch()
+{
+	unmap();
+}
+
+/**
+Make the next draw() draw a range of the last batch.
+*/
+void DynamicGeometryBuffer::queueRange(const DrawRange &range)
+{
+	numIndices = range.firstIndex+(FanEncoder::getMode()==FanEncoder::MODE_TABLE ? 0 : range.numIndices);
+	numUndrawnIndices = range.numIndices;
+	baseVertex = range.baseVertex;
+	if(FanEncoder::getMode()==FanEncoder::MODE_TABLE)
+		tableFans.assign(batchFans.begin()+range.firstFan,batchFans.begin()+range.firstFan+range.numFans);
 }
 
 void DynamicGeometryBuffer::draw()
 {	
-	if(mappedVBuffer==nullptr || mappedIBuffer == nullptr || numUndrawnIndices==0)
+	if(numUndrawnIndices==0)
 		return;
 	unmap();
-	device->DrawIndexed(numUndrawnIndices,numIndices-numUndrawnIndices,0);
+	if(FanEncoder::getMode()==FanEncoder::MODE_TABLE)
+	{
+		FanEncoder::drawTable(device,tableFans);
+		numUndrawnIndices=0;
+		return;
+	}
+	D3D::stats.drawCalls++;
+	D3D::stats.indices += numUndrawnIndices;
+	device->DrawIndexed(numUndrawnIndices,numIndices-numUndrawnIndices,baseVertex);
 	numUndrawnIndices=0;
 }
 
+/**
+Fence the frame's geometry and resize the buffers if the rings want to.
+*/
 void DynamicGeometryBuffer::newFrame()
 {
-	clear=true;
+	unmap();
+	vertexRing->endFrame();
+	if(indexRing)
+		indexRing->endFrame();
+
+	size_t vertices = vertexRing->getCapacity();
+	size_t indices = indexRing ? indexRing->getCapacity() : 0;
+	bool resize = vertexRing->adapt(vertices);
+	if(indexRing)
+		resize |= indexRing->adapt(indices);
+	if(!resize)
+		return;
+	if(!createBuffers(vertices,indices ? indices : vertices))
+	{
+		UD3D10RenderDevice::debugs("DynamicGeometryBuffer: Failed to resize; keeping the old size.");
+		vertices = vertexRing->getCapacity();
+		indices = indexRing ? indexRing->getCapacity() : 0;
+		createBuffers(vertices,indices ? indices : vertices);
+	}
+	vertexRing->reset(vertices);
+	if(indexRing)
+		indexRing->reset(indices);
 }
 
@@ -1,21 +1,32 @@
 #pragma once
 
+#include <vector>
 #include "geometrybuffer.h"
+#include "fanencoder.h"
+#include "ringallocator.h"
 
 
 class DynamicGeometryBuffer: public GeometryBuffer
 {
 private:
-	bool clear;
-	unsigned int numVerts; //Number of buffered verts	
+	bool clear; //Next map discards the buffers
+	unsigned int numVerts; //Next vertex to write
 	void *mappedVBuffer; //Memmapped version of vertex buffer
-	int *mappedIBuffer; //Memmapped version of index buffer
-	size_t size; //Maximum size of buffer
+	WORD *mappedIBuffer; //Memmapped version of index buffer; not used in table mode, where the index buffer is the fixed fan table
+	unsigned int baseVertex; //First vertex of the window the indices are relative to
+	std::vector<FanEncoder::Fan> tableFans; //Fans to draw in table mode
+	std::vector<FanEncoder::Fan> batchFans; //Fans of the current batch in table mode
+	RingAllocator *vertexRing; //Space in the vertex buffer over the frames the GPU may still be drawing
+	RingAllocator *indexRing; //Same for the index buffer; nullptr in table mode
+	UINT vertexSize;
 	void map();
 	bool unmap();	
+	bool createBuffers(size_t vertices, size_t indices);
+	void allocate(int num, int numIndices, size_t &firstVertex, size_t &firstIndex);
 
 public:
 	DynamicGeometryBuffer(ID3D10Device* device);
+	~DynamicGeometryBuffer();
 
 	//From GeometryBuffer
 	bool create(size_t size, size_t vertexSize);
@@ -23,6 +34,11 @@ public:
 	void newFrame() override;
 
 	void indexTriangleFan(int num);
-	void indexSingleVertex();
 	void* getVertex();	
-};
\ No newline at end of file
+	void* getVertices(int num);
+
+	void beginBatch(size_t vertices, size_t indices);
+	bool batchTriangleFan(int num, DrawRange &range);
+	void endBatch();
+	void queueRange(const DrawRange &range);
+};
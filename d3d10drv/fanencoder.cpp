@@ -0,0 +1,139 @@
+/**
+\class FanEncoder
+Index generation for the triangle fans the engine sends (BSP polygons, mesh triangles, decals).
+
+The mode is chosen with the FanEncoding option; all Unreal fan geometry uses the same one, as it decides the shaders' primitive topology:
+- Lists are what the renderer always did: 3*(n-2) indices per polygon.
+- Strips visit the polygon's vertices zigzagging from both ends (0, 1, n-1, 2, n-2, ...) followed by a cut. That's n+1 indices; fewer than a list from quads up,
+  one more for triangles. The triangulation differs from a fan, which doesn't matter for the convex, planar polygons Unreal sends.
+- Table mode writes no indices at all. A fan of n vertices is the first 3*(n-2) indices of the largest fan, so one immutable index buffer serves all of them,
+  drawn with the fan's first vertex as base vertex. The catch is a draw call per polygon.
+
+The D3D10FanBench command compares the three on typical polygon sizes.
+*/
+
+#include "fanencoder.h"
+#include "d3d10drv.h"
+
+FanEncoder::Mode FanEncoder::mode = FanEncoder::MODE_LIST;
+
+/**
+Set the mode; must be done before the shaders and geometry buffers are created.
+*/
+void FanEncoder::setMode(Mode mode)
+{
+	FanEncoder::mode = mode;
+}
+
+FanEncoder::Mode FanEncoder::getMode()
+{
+	return mode;
+}
+
+/**
+Primitive topology for shaders drawing fans in the current mode.
+*/
+D3D10_PRIMITIVE_TOPOLOGY FanEncoder::getTopology()
+{
+	return mode==MODE_STRIP ? D3D10_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP : D3D10_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+}
+
+/**
+Number of indices written for a fan.
+\param num Vertices in the fan.
+*/
+int FanEncoder::countIndices(Mode mode, int num)
+{
+	switch(mode)
+	{
+	case MODE_STRIP:
+		return num+1;
+	case MODE_TABLE:
+		return 0;
+	default:
+		return (num-2)*3;
+	}
+}
+
+/**
+Number of indices a fan is drawn with in the current mode; in table mode, that's the part of the fixed index buffer it uses.
+*/
+int FanEncoder::countDrawnIndices(int num)
+{
+	if(mode!=MODE_TABLE)
+		return countIndices(mode,num);
+	if(num>MAX_TABLE_FAN)
+		num = MAX_TABLE_FAN;
+	return (num-2)*3;
+}
+
+/**
+Write the indices for a fan.
+\param first Index of the fan's first vertex.
+\return Number of indices written, see countIndices().
+*/
+int FanEncoder::write(Mode mode, WORD *dest, WORD first, int num)
+{
+	WORD *start = dest;
+	switch(mode)
+	{
+	case MODE_LIST:
+		for(int i=1;i<num-1;i++)
+		{
+			*dest++ = first; //Center point
+			*dest++ = first+i;
+			*dest++ = first+i+1;
+		}
+		break;
+	case MODE_STRIP:
+		{
+			int lo = 1, hi = num-1;
+			*dest++ = first;
+			for(int i=1;i<num;i++)
+				*dest++ = first+((i&1) ? lo++ : hi--);
+			*dest++ = STRIP_CUT;
+		}
+		break;
+	default:
+		break;
+	}
+	return (int)(dest-start);
+}
+
+/**
+Describe the fixed index buffer used in table mode: a triangle list fan over MAX_TABLE_FAN vertices.
+\param data Filled in to point to the indices, which stay valid for the lifetime of the program.
+*/
+void FanEncoder::describeTable(D3D10_BUFFER_DESC &desc, D3D10_SUBRESOURCE_DATA &data)
+{
+	static std::vector<WORD> table;
+	if(table.empty())
+	{
+		table.resize((MAX_TABLE_FAN-2)*3);
+		write(MODE_LIST,&table[0],0,MAX_TABLE_FAN);
+	}
+
+	desc.Usage            = D3D10_USAGE_IMMUTABLE;
+	desc.ByteWidth        = table.size()*sizeof(WORD);
+	desc.BindFlags        = D3D10_BIND_INDEX_BUFFER;
+	desc.CPUAccessFlags   = 0;
+	desc.MiscFlags        = 0;
+	data.pSysMem = &table[0];
+	data.SysMemPitch = 0;
+	data.SysMemSlicePitch = 0;
+}
+
+/**
+Draw fans in table mode, with the fixed index buffer bound; the list is emptied.
+*/
+void FanEncoder::drawTable(ID3D10Device *device, std::vector<Fan> &fans)
+{
+	for(std::vector<Fan>::const_iterator f=fans.begin();f!=fans.end();f++)
+	{
+		int count = countDrawnIndices(f->num);
+		D3D::stats.drawCalls++;
+		D3D::stats.indices += count;
+		device->DrawIndexed(count,0,f->firstVertex);
+	}
+	fans.clear();
+}
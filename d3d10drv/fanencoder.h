@@ -0,0 +1,47 @@
+/**
+\file fanencoder.h
+*/
+
+#pragma once
+
+class FanEncoder;
+
+#include <vector>
+#include <d3d10.h>
+
+class FanEncoder
+{
+public:
+	/** How triangle fans are turned into indices; the FanEncoding option */
+	enum Mode
+	{
+		MODE_LIST, /**< Triangle list, 3*(n-2) indices written per fan */
+		MODE_STRIP, /**< Triangle strip zigzagging across the polygon, n indices and a cut written per fan */
+		MODE_TABLE, /**< Nothing written; each fan is a draw from a fixed fan index buffer with the fan's first vertex as base */
+		DUMMY_NUM_MODES
+	};
+
+	static const WORD STRIP_CUT = 0xFFFF; /**< Strip cut index for 16 bit indices; vertex 65535 of a window can't be used in strip mode */
+	static const UINT WINDOW_SIZE = 65535; /**< Vertices reachable from a base vertex in all modes */
+	static const int MAX_TABLE_FAN = 4096; /**< Largest fan in the fixed index buffer; larger ones lose their last triangles in table mode */
+
+	/** Fan waiting to be drawn in table mode */
+	struct Fan
+	{
+		UINT firstVertex; /**< Base vertex for the draw */
+		int num;
+	};
+
+private:
+	static Mode mode;
+
+public:
+	static void setMode(Mode mode);
+	static Mode getMode();
+	static D3D10_PRIMITIVE_TOPOLOGY getTopology();
+	static int countIndices(Mode mode, int num);
+	static int countDrawnIndices(int num);
+	static int write(Mode mode, WORD *dest, WORD first, int num);
+	static void describeTable(D3D10_BUFFER_DESC &desc, D3D10_SUBRESOURCE_DATA &data);
+	static void drawTable(ID3D10Device *device, std::vector<Fan> &fans);
+};
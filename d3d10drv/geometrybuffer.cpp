@@ -4,6 +4,9 @@
 GeometryBuffer::GeometryBuffer(ID3D10Device *device)
 {
 	this->device = device;
+	this->indexFormat = DXGI_FORMAT_R32_UINT;
+	this->vertexBuffer = nullptr;
+	this->indexBuffer = nullptr;
 }
 
 GeometryBuffer::~GeometryBuffer()
@@ -43,7 +46,7 @@ void GeometryBuffer::bind()
 	UINT offset=0;	
 
 	device->IASetVertexBuffers( 0, 1, &vertexBuffer, &stride, &offset );
-	device->IASetIndexBuffer(indexBuffer,DXGI_FORMAT_R32_UINT,0);
+	device->IASetIndexBuffer(indexBuffer,indexFormat,0);
 }
 
 bool GeometryBuffer::hasContents() const
@@ -53,6 +56,8 @@ bool GeometryBuffer::hasContents() const
 
 void GeometryBuffer::draw()
 {
+	D3D::stats.drawCalls++;
+	D3D::stats.indices += numIndices;
 	device->DrawIndexed(numIndices,0,0);
 }
 
@@ -5,7 +5,16 @@
 
 class GeometryBuffer
 {
-	
+public:
+	/** Indices uploaded as part of a batch, to be drawn later; see CommandList::flush() */
+	struct DrawRange
+	{
+		UINT firstIndex;
+		UINT numIndices; /**< Indices that will be drawn; in table mode, these aren't in the buffer */
+		UINT baseVertex;
+		size_t firstFan; /**< Table mode only: fans in the buffer's batch */
+		size_t numFans;
+	};
 
 protected:
 	unsigned int numIndices; //Number of buffered indices
@@ -14,6 +23,7 @@ protected:
 	ID3D10Buffer* indexBuffer;
 	ID3D10Device* device;
 	UINT stride;
+	DXGI_FORMAT indexFormat; //R32_UINT unless a subclass writes 16 bit indices
 
 public:
 	GeometryBuffer(ID3D10Device* device);
@@ -11,7 +11,6 @@ struct VS_INPUT
 	float4 color: COLOR0;
 	float4 fog: COLOR1;
 	float2 tex: TEXCOORD0;
-	uint flags: BLENDINDICES; //flags are set per poly instead of as global state so no commits are necessary when changing them
 };
 
 
@@ -30,6 +29,11 @@ cbuffer Fog //Rune object fog
 	float4 fogColor;
 }
 
+cbuffer Flags
+{
+	uint polyFlags; //Set per batch, see Shader_GouraudPolygon::setFlags()
+}
+
 
 //--------------------------------------------------------------------------------------
 // Vertex Shader
@@ -45,16 +49,16 @@ PS_INPUT VS( VS_INPUT input )
 	output.pos = projected;
 	
 	
-	output.color = unrealColor(input.color,input.flags);
+	output.color = unrealColor(input.color,polyFlags);
 	
 	
-	output.fog = unrealVertexFog(input.fog, input.flags);
+	output.fog = unrealVertexFog(input.fog, polyFlags);
 	
 	/*
 	Misc
 	*/
 	output.tex = input.tex;
-	output.flags = input.flags;
+	output.flags = polyFlags;
 	
 	//d3d vs unreal coords
 	output.pos.y =  -output.pos.y;
@@ -74,8 +78,8 @@ PS_OUTPUT PS( PS_INPUT input)
 	float4 fog = input.fog;
 	output.color= input.color;
 		
-	float4 diffuse = texDiffuse.SampleBias(sam,input.tex,LODBIAS);
-	float4 diffusePoint = texDiffuse.SampleBias(samPoint,input.tex,LODBIAS);
+	float4 diffuse = sampleDiffuse(sam,input.tex,input.flags,false);
+	float4 diffusePoint = sampleDiffuse(samPoint,input.tex,input.flags,true);
 	output.color*=diffuseTexture(diffuse,diffusePoint,input.flags);
 	
 	output.color+=fog;
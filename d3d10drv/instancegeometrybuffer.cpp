@@ -0,0 +1,149 @@
+/**
+\class InstanceGeometryBuffer
+Geometry for primitives that are all the same quad, such as tiles.
+
+Slot 0 holds an immutable triangle strip with the quad's corners at (0,0), (0,1), (1,0) and (1,1); slot 1 holds one instance per quad.
+The vertex shader places the corners from the instance data, so there are no per quad indices to write and no geometry shader is needed.
+The instance buffer is filled like the dynamic geometry buffer: discarded at the start of a frame or when full, appended to without overwriting otherwise.
+*/
+
+#include "instancegeometrybuffer.h"
+#include "d3d10drv.h"
+
+static const int QUAD_VERTICES = 4;
+
+InstanceGeometryBuffer::InstanceGeometryBuffer(ID3D10Device* device) : 
+GeometryBuffer(device),
+clear(true),
+instanceBuffer(nullptr),
+mappedInstances(nullptr),
+size(0)
+{
+	vertexBuffer = nullptr;
+	indexBuffer = nullptr;
+}
+
+InstanceGeometryBuffer::~InstanceGeometryBuffer()
+{
+	SAFE_RELEASE(instanceBuffer);
+}
+
+/**
+\param size Number of instances the buffer holds before it has to be drawn and discarded.
+\param instanceSize Size of the per instance data.
+*/
+bool InstanceGeometryBuffer::create(size_t size, size_t instanceSize)
+{
+	HRESULT hr;
+	this->size = size;
+	this->stride = instanceSize;
+	numIndices = numUndrawnIndices = 0;
+
+	const float corners[QUAD_VERTICES][2] = {{0,0},{0,1},{1,0},{1,1}};
+	D3D10_BUFFER_DESC vertexBufferDesc;
+	vertexBufferDesc.Usage            = D3D10_USAGE_IMMUTABLE;
+	vertexBufferDesc.ByteWidth        = sizeof(corners);
+	vertexBufferDesc.BindFlags        = D3D10_BIND_VERTEX_BUFFER;
+	vertexBufferDesc.CPUAccessFlags   = 0;
+	vertexBufferDesc.MiscFlags        = 0;
+	D3D10_SUBRESOURCE_DATA initialData = {corners,0,0};
+	hr = device->CreateBuffer(&vertexBufferDesc,&initialData,&vertexBuffer);
+	if(FAILED(hr))
+	{
+		UD3D10RenderDevice::debugs("InstanceGeometryBuffer: Failed to create vertex buffer.");
+		return false;
+	}
+
+	D3D10_BUFFER_DESC instanceBufferDesc;
+	instanceBufferDesc.Usage            = D3D10_USAGE_DYNAMIC;
+	instanceBufferDesc.ByteWidth        = instanceSize*size;
+	instanceBufferDesc.BindFlags        = D3D10_BIND_VERTEX_BUFFER;
+	instanceBufferDesc.CPUAccessFlags   = D3D10_CPU_ACCESS_WRITE;
+	instanceBufferDesc.MiscFlags        = 0;
+	hr = device->CreateBuffer(&instanceBufferDesc,nullptr,&instanceBuffer);
+	if(FAILED(hr))
+	{
+		UD3D10RenderDevice::debugs("InstanceGeometryBuffer: Failed to create instance buffer.");
+		return false;
+	}
+
+	return true;
+}
+
+void InstanceGeometryBuffer::bind()
+{
+	ID3D10Buffer *buffers[2] = {vertexBuffer,instanceBuffer};
+	UINT strides[2] = {sizeof(float)*2,stride};
+	UINT offsets[2] = {0,0};
+	device->IASetVertexBuffers(0,2,buffers,strides,offsets);
+}
+
+void InstanceGeometryBuffer::map()
+{
+	if(mappedInstances!=nullptr)
+		return;
+
+	D3D10_MAP m;
+	if(clear)
+	{
+		numIndices=0;
+		numUndrawnIndices=0;
+		m = D3D10_MAP_WRITE_DISCARD;
+		clear=false;
+	}
+	else
+	{
+		m = D3D10_MAP_WRITE_NO_OVERWRITE;
+	}
+
+	D3D::stats.bufferMaps++;
+	if(FAILED(instanceBuffer->Map(m,0,&mappedInstances)))
+	{
+		UD3D10RenderDevice::debugs("Failed to map instance buffer.");
+		mappedInstances = nullptr;
+	}
+}
+
+bool InstanceGeometryBuffer::unmap()
+{
+	if(mappedInstances==nullptr)
+		return 0;
+	instanceBuffer->Unmap();
+	mappedInstances=nullptr;
+	return 1;
+}
+
+/**
+Reserve space for the next instance; if the buffer is full, its contents are drawn and discarded first.
+\return Pointer to the instance data to fill in.
+*/
+void *InstanceGeometryBuffer::getInstance()
+{
+	if(numIndices+1>size)
+	{
+		D3D::render();
+		clear=true;
+	}
+	if(mappedInstances==nullptr)
+		map();
+
+	numUndrawnIndices++;
+	D3D::stats.vertexBytes += stride;
+	return (void*) ((char*) (mappedInstances)+stride*numIndices++);
+}
+
+void InstanceGeometryBuffer::draw()
+{
+	if(mappedInstances==nullptr || numUndrawnIndices==0)
+		return;
+	unmap();
+	D3D::stats.drawCalls++;
+	D3D::stats.indices += numUndrawnIndices*QUAD_VERTICES;
+	device->DrawInstanced(QUAD_VERTICES,numUndrawnIndices,0,numIndices-numUndrawnIndices);
+	numUndrawnIndices=0;
+}
+
+void InstanceGeometryBuffer::newFrame()
+{
+	clear=true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "geometrybuffer.h"
+
+
+/**
+Draws quads as instances of a fixed 4 vertex triangle strip; per quad data goes in a dynamic instance buffer.
+*/
+class InstanceGeometryBuffer: public GeometryBuffer
+{
+private:
+	bool clear;
+	ID3D10Buffer *instanceBuffer;
+	void *mappedInstances; //Memmapped version of instance buffer
+	size_t size; //Maximum number of instances
+	void map();
+	bool unmap();
+
+public:
+	InstanceGeometryBuffer(ID3D10Device* device);
+	~InstanceGeometryBuffer();
+
+	bool create(size_t size, size_t instanceSize);
+
+	//From GeometryBuffer
+	void bind() override;
+	void draw() override;
+	void newFrame() override;
+
+	void* getInstance();
+};
@@ -4,6 +4,8 @@ Miscellaneous helper functions that don't depend on an API
 */
 
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include "misc.h"
 
 static const float PI = 3.1415926535897932f;
@@ -17,4 +19,31 @@ int Misc::getFov(int defaultFOV, int resX, int resY)
 	float aspect = (float)resX/(float)resY;
 	float fov = (float) (atan(tan(defaultFOV*PI/360.0)*(aspect/(4.0/3.0)))*360.0)/PI;
 	return (int) (fov + 0.5f);	
+}
+
+/**
+64 bit hash, mostly 8 bytes at a time.
+\param hash Seed; pass a previous result to hash several blocks as one.
+*/
+unsigned long long Misc::hashBytes(const void *data, size_t size, unsigned long long hash)
+{
+	const unsigned long long k1 = 0x9E3779B185EBCA87ull;
+	const unsigned long long k2 = 0xC2B2AE3D27D4EB4Full;
+	const unsigned char *p = (const unsigned char*)data;
+	for(;size>=8;size-=8,p+=8)
+	{
+		unsigned long long v;
+		memcpy(&v,p,8);
+		hash ^= _rotl64(v*k2,31)*k1;
+		hash = _rotl64(hash,27)*k1+k2;
+	}
+	for(;size>0;size--,p++)
+	{
+		hash ^= *p*k1;
+		hash = _rotl64(hash,11)*k2;
+	}
+	hash ^= hash>>33;
+	hash *= k2;
+	hash ^= hash>>29;
+	return hash;
 }
\ No newline at end of file
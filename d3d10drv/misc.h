@@ -2,7 +2,10 @@
 \file misc.h
 */
 
+#include <cstddef>
+
 namespace Misc
 {
 	int getFov(int defaultFOV, int resX, int resY);
+	unsigned long long hashBytes(const void *data, size_t size, unsigned long long hash);
 }
\ No newline at end of file
@@ -6,7 +6,8 @@ Seperate header for this as just including unobj.h leads to errors; better to ha
 \note Texture caching/conversion functions should be passed explicit polyflags. This is because the flags in TextureInfo structures aren't correct; the ones passed to
 PrecacheTexture() and DrawXXXX() calls are.
 
-\note For the Direct3D 10 renderer, flags are sent with each vertex. This way, if possible, flags can be handled by the shaders without incurring any state changes and/or draw calls.
+\note For the Direct3D 10 renderer, flags are sent with each tile vertex, each complex surface record and each batch of gouraud polygons (as meshes have many vertices to a batch).
+This way, if possible, flags can be handled by the shaders without incurring any state changes and/or draw calls.
 As such, flag handling is spread over the renderer and shader. Flags that change blend or depth state are not handled in the shader.
 
 Furthermore, flags are also used in texture conversion.
@@ -0,0 +1,131 @@
+/**
+\class RenderThread
+Thread that does all drawing, so the game thread only has to record what it wants drawn.
+
+The game thread's calls to the render device are recorded in the trace format (see TraceRecorder), texture payloads included, so nothing the game
+passes has to stay valid after a call returns. At the end of a frame the recorded stream is handed over and the render thread replays it through the device,
+which then does the actual work. The stream is double buffered: the game records the next frame while the render thread draws the previous one, and
+only waits if it gets a whole frame ahead.
+
+Anything else that uses the device from the game thread, such as ReadPixels(), resizing and console commands, first calls sync() so the render thread is idle.
+*/
+
+#include "renderthread.h"
+
+/**
+\param device Device whose calls are replayed on the render thread.
+\param affinityMask Cores the render thread may run on.
+*/
+RenderThread::RenderThread(URenderDevice *device, DWORD_PTR affinityMask): replayer(device), busy(false), stopping(false)
+{
+	thread = std::thread(&RenderThread::threadMain,this,affinityMask);
+	threadId = thread.get_id();
+}
+
+/**
+Draws what's recorded, then stops the thread.
+*/
+RenderThread::~RenderThread()
+{
+	sync();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	thread.join();
+}
+
+void RenderThread::threadMain(DWORD_PTR affinityMask)
+{
+	SetThreadAffinityMask(GetCurrentThread(),affinityMask);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while(true)
+	{
+		while(!stopping && !busy)
+			wake.wait(lock);
+		if(!busy)
+			return;
+
+		lock.unlock();
+		if(replayer.replayStream(submitted)<0)
+			UD3D10RenderDevice::debugs("Render thread: corrupt command stream.");
+		lock.lock();
+		busy = false;
+		idle.notify_all();
+	}
+}
+
+/**
+Returns true when called by the render thread; calls from there are to be carried out rather than recorded.
+*/
+bool RenderThread::isRenderThread() const
+{
+	return std::this_thread::get_id()==threadId;
+}
+
+/**
+Recorder for the game thread's calls.
+*/
+TraceRecorder *RenderThread::getRecorder()
+{
+	return &recorder;
+}
+
+/**
+Field of view of the scene node being replayed; the game's actor holds the one of the frame being recorded.
+\note Render thread only.
+*/
+FLOAT RenderThread::getFovAngle() const
+{
+	return replayer.getFovAngle();
+}
+
+/**
+Brightness the game had at the flush being replayed.
+\note Render thread only.
+*/
+FLOAT RenderThread::getFlushBrightness() const
+{
+	return replayer.getFlushBrightness();
+}
+
+/**
+Level the game showed at the flush being replayed; only for telling levels apart.
+\note Render thread only.
+*/
+const ULevel *RenderThread::getFlushLevel() const
+{
+	return replayer.getFlushLevel();
+}
+
+/**
+Hand what was recorded to the render thread, after it has finished the previous frame.
+\note Game thread only.
+*/
+void RenderThread::submit()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(busy)
+		idle.wait(lock);
+	recorder.takeStream(submitted);
+	if(submitted.empty())
+		return;
+	busy = true;
+	wake.notify_one();
+}
+
+/**
+Submit what was recorded and wait until it's drawn, so the game thread can use the device itself.
+\note Game thread only.
+*/
+void RenderThread::sync()
+{
+	if(isRenderThread())
+		return; //Already drawing; waiting on itself would never return
+	submit();
+	std::unique_lock<std::mutex> lock(mutex);
+	while(busy)
+		idle.wait(lock);
+}
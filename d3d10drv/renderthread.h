@@ -0,0 +1,42 @@
+/**
+\file renderthread.h
+*/
+
+#pragma once
+
+class RenderThread;
+
+#include <windows.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "trace.h"
+
+class RenderThread
+{
+private:
+	TraceRecorder recorder; /**< Used by the game thread */
+	TraceReplayer replayer; /**< Used by the render thread */
+	std::vector<BYTE> submitted; /**< Frame the render thread is drawing */
+	std::thread thread;
+	std::thread::id threadId;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	bool busy; /**< The submitted frame hasn't been drawn yet */
+	bool stopping;
+
+	void threadMain(DWORD_PTR affinityMask);
+
+public:
+	RenderThread(URenderDevice *device, DWORD_PTR affinityMask);
+	~RenderThread();
+	bool isRenderThread() const;
+	TraceRecorder *getRecorder();
+	FLOAT getFovAngle() const;
+	FLOAT getFlushBrightness() const;
+	const ULevel *getFlushLevel() const;
+	void submit();
+	void sync();
+};
@@ -0,0 +1,174 @@
+/**
+\class RingAllocator
+Allocates space in a dynamic buffer as a ring that spans frames, so the buffer only has to be discarded when the GPU falls behind.
+
+Allocations are appended with D3D10_MAP_WRITE_NO_OVERWRITE; the position at the end of each frame is marked with an event query. Once the query
+is signaled, everything before that position is free again. When the end of the buffer is reached, allocation wraps to the start if the GPU is done with
+that space; if it isn't, the caller discards the buffer (a driver rename, as every frame used to do) and starts over.
+
+The capacity adapts to the peak use per frame: it grows as soon as a frame takes more than a third of the ring, so about three frames fit in flight,
+and shrinks back when the peak over a longer period stays far below that. The caller recreates its buffer when adapt() says so.
+*/
+
+#include "ringallocator.h"
+#include "d3d10drv.h"
+
+static const size_t FRAMES_IN_FLIGHT = 3;
+static const int ADAPT_FRAMES = 600; /**< Frames over which the peak use is taken before shrinking */
+
+/**
+\param capacity Initial capacity in elements, also the smallest it will shrink to.
+\param maxCapacity Largest capacity it will grow to.
+*/
+RingAllocator::RingAllocator(ID3D10Device *device, size_t capacity, size_t maxCapacity): device(device), frameUsed(0), unfenced(0), minCapacity(capacity), maxCapacity(maxCapacity), peak(0), periodFrames(0)
+{
+	reset(capacity);
+}
+
+RingAllocator::~RingAllocator()
+{
+	reset(capacity);
+	for(std::vector<ID3D10Query*>::iterator i=freeQueries.begin();i!=freeQueries.end();i++)
+		SAFE_RELEASE(*i);
+}
+
+/**
+Forget all allocations; for a new or discarded buffer. What the frame used so far still counts for adapt().
+*/
+void RingAllocator::reset(size_t capacity)
+{
+	this->capacity = capacity;
+	head = tail = used = 0;
+	unfenced = 0;
+	while(!fences.empty())
+	{
+		freeQueries.push_back(fences.front().query);
+		fences.pop_front();
+	}
+}
+
+size_t RingAllocator::getCapacity() const
+{
+	return capacity;
+}
+
+/**
+Free the space of frames the GPU has finished.
+*/
+void RingAllocator::retire()
+{
+	while(!fences.empty() && fences.front().query->GetData(nullptr,0,D3D10_ASYNC_GETDATA_DONOTFLUSH)==S_OK)
+	{
+		tail = fences.front().head;
+		used -= fences.front().used;
+		freeQueries.push_back(fences.front().query);
+		fences.pop_front();
+	}
+}
+
+/**
+Allocate consecutive elements.
+\param offset Set to the first element unless RESULT_FULL is returned.
+*/
+RingAllocator::Result RingAllocator::allocate(size_t num, size_t &offset)
+{
+	if(num>capacity)
+	{
+		frameUsed += num; //So the next adapt() makes room
+		return RESULT_FULL;
+	}
+
+	if(capacity-used<num)
+		retire();
+	if(capacity-used<num)
+		return RESULT_FULL;
+	if(used==0) //Nothing in flight; start at the beginning to keep the space in one piece
+		head = tail = 0;
+
+	size_t skipped = 0;
+	Result r = RESULT_APPENDED;
+	if(head>=tail && head+num>capacity) //Doesn't fit before the end
+	{
+		skipped = capacity-head;
+		if(used>0 && tail<num)
+			retire();
+		if(used>0 && (tail<num || capacity-used<num+skipped))
+			return RESULT_FULL;
+		head = 0;
+		r = RESULT_WRAPPED;
+	}
+	else if(head<tail && head+num>tail) //Would run into space the GPU may still be reading
+	{
+		retire();
+		if(used>0 && head+num>tail)
+			return RESULT_FULL;
+	}
+
+	offset = head;
+	head += num;
+	used += num+skipped;
+	frameUsed += num+skipped;
+	unfenced += num+skipped;
+	return r;
+}
+
+/**
+Mark the end of the frame's allocations.
+*/
+void RingAllocator::endFrame()
+{
+	if(unfenced>0)
+	{
+		ID3D10Query *query = nullptr;
+		if(!freeQueries.empty())
+		{
+			query = freeQueries.back();
+			freeQueries.pop_back();
+		}
+		else
+		{
+			D3D10_QUERY_DESC desc = {D3D10_QUERY_EVENT,0};
+			if(FAILED(device->CreateQuery(&desc,&query)))
+				query = nullptr;
+		}
+		if(query) //Without a fence, space is only reclaimed when the ring fills up and the buffer is discarded
+		{
+			query->End();
+			Fence f = {query,head,unfenced};
+			fences.push_back(f);
+			unfenced = 0;
+		}
+	}
+	if(frameUsed>peak)
+		peak = frameUsed;
+	periodFrames++;
+}
+
+/**
+Check whether the ring should be resized; call after endFrame().
+\param newCapacity Set to the capacity to recreate the buffer and reset() with, if true is returned.
+*/
+bool RingAllocator::adapt(size_t &newCapacity)
+{
+	size_t wanted = capacity;
+	if(frameUsed*FRAMES_IN_FLIGHT>capacity)
+	{
+		while(wanted<frameUsed*FRAMES_IN_FLIGHT)
+			wanted *= 2;
+	}
+	else if(periodFrames>=ADAPT_FRAMES)
+	{
+		while(wanted/2>=minCapacity && wanted/2>=peak*FRAMES_IN_FLIGHT*2)
+			wanted /= 2;
+		peak = 0;
+		periodFrames = 0;
+	}
+	frameUsed = 0;
+
+	if(wanted>maxCapacity)
+		wanted = maxCapacity;
+	if(wanted==capacity)
+		return false;
+	newCapacity = wanted;
+	return true;
+}
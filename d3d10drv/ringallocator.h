@@ -0,0 +1,55 @@
+/**
+\file ringallocator.h
+*/
+
+#pragma once
+
+class RingAllocator;
+
+#include <deque>
+#include <vector>
+#include <d3d10.h>
+
+class RingAllocator
+{
+public:
+	enum Result
+	{
+		RESULT_APPENDED, /**< Right after the previous allocation */
+		RESULT_WRAPPED, /**< At the start of the buffer; anything still pending from before has to be drawn first */
+		RESULT_FULL /**< The GPU hasn't finished with enough space; discard the buffer and reset() */
+	};
+
+private:
+	/** End of a frame's allocations, signaled when the GPU has drawn them */
+	struct Fence
+	{
+		ID3D10Query *query;
+		size_t head; /**< Position after the frame's last allocation */
+		size_t used; /**< Elements taken since the previous fence, including space skipped when wrapping */
+	};
+
+	ID3D10Device *device;
+	std::deque<Fence> fences;
+	std::vector<ID3D10Query*> freeQueries;
+	size_t capacity;
+	size_t head; /**< Next position to allocate at */
+	size_t tail; /**< Oldest position the GPU may still be reading */
+	size_t used; /**< Elements between tail and head, including the current frame */
+	size_t frameUsed; /**< Elements taken by the current frame */
+	size_t unfenced; /**< Elements taken since the last fence or reset */
+	size_t minCapacity;
+	size_t maxCapacity;
+	size_t peak; /**< Largest frameUsed in the current adaptation period */
+	int periodFrames;
+	void retire();
+
+public:
+	RingAllocator(ID3D10Device *device, size_t capacity, size_t maxCapacity);
+	~RingAllocator();
+	Result allocate(size_t num, size_t &offset);
+	void endFrame();
+	void reset(size_t capacity);
+	size_t getCapacity() const;
+	bool adapt(size_t &newCapacity);
+};
@@ -36,12 +36,27 @@ Only real textures, not lightmaps, fogmaps etc. can be overridden. Every overrid
 apply these, which only makes sense for diffuse textures.
 
 Finally, each override texture can have custom polyflags in a file, these are loaded and ORed by the renderer with the flags provided to draw calls. Especially useful to force alpha blending instead of masking.
+
+Block compression:
+With the CompressTextures option, static P8, RGB16, RGB8 and RGBA8 textures are converted to R8G8B8A8 as usual and then encoded to BC1 or BC3 (see BCEncoder) before the texture is created.
+Textures converted right away are encoded by the calling thread with the help of the workers; ones converted by the workers are encoded by their worker.
+
+Mip generation:
+Realtime, procedural and some third party textures come with a single mip; sampling them minified aliases and reads far more texture memory than needed.
+With the GenerateMips option, R8G8B8A8 textures (paletted ones after expansion) get the rest of their chain box filtered from the last mip the game supplied.
+Dynamic textures get their generated mips at creation; updates only write the top mip and have the GPU regenerate the rest.
+That makes them default usage textures updated with UpdateSubresource rather than mapped, which the original code avoided for flickering on nvidia,
+so the option is off by default.
 */
 #include <stdio.h>
 #include <new>
 #include <D3dx10.h>
+#include <intrin.h>
+#include <immintrin.h>
 #include "TexConverter.h"
+#include "bcencoder.h"
 #include "polyflags.h"
+#include "misc.h"
 #include <fstream>
 
 /**
@@ -49,14 +64,24 @@ Mappings from Unreal to our texture info
 */
 TexConverter::TextureFormat TexConverter::formats[] = 
 {
-	{true,0,0,false,DXGI_FORMAT_R8G8B8A8_UNORM,&TexConverter::fromPaletted},		/**< TEXF_P8 = 0x00 */
-	{true,0,0,true,DXGI_FORMAT_R8G8B8A8_UNORM,nullptr},								/**< TEXF_RGBA7	= 0x01 */
-	{false,0,0,true,DXGI_FORMAT_R8G8B8A8_UNORM,nullptr},								/**< TEXF_RGB16	= 0x02 */
-	{true,4,8,true,DXGI_FORMAT_BC1_UNORM,nullptr},									/**< TEXF_DXT1 = 0x03 */
-	{false,0,0,true,DXGI_FORMAT_UNKNOWN,nullptr},									/**< TEXF_RGB8 = 0x04 */
-	{true,0,0,true,DXGI_FORMAT_R8G8B8A8_UNORM,nullptr},								/**< TEXF_RGBA8	= 0x05 */
+	{true,0,0,4,false,DXGI_FORMAT_R8G8B8A8_UNORM,&TexConverter::fromPaletted},		/**< TEXF_P8 = 0x00 */
+	{true,0,0,4,true,DXGI_FORMAT_R8G8B8A8_UNORM,nullptr},								/**< TEXF_RGBA7	= 0x01 */
+	{true,0,0,4,false,DXGI_FORMAT_R8G8B8A8_UNORM,&TexConverter::fromRGB16},			/**< TEXF_RGB16	= 0x02 */
+	{true,4,8,0,true,DXGI_FORMAT_BC1_UNORM,nullptr},									/**< TEXF_DXT1 = 0x03 */
+	{true,0,0,4,false,DXGI_FORMAT_R8G8B8A8_UNORM,&TexConverter::fromRGB8},			/**< TEXF_RGB8 = 0x04 */
+	{true,0,0,4,true,DXGI_FORMAT_R8G8B8A8_UNORM,nullptr},								/**< TEXF_RGBA8	= 0x05 */
 };
 
+/**
+P8 textures when the GPUPalettes option is on: indices are assigned as is, the palette goes into the texture cache's palette texture and the shader does the lookup.
+*/
+const TexConverter::TextureFormat TexConverter::formatPalettedGPU = {true,0,0,1,true,DXGI_FORMAT_R8_UINT,nullptr};
+
+/**
+RGB16 textures where the device supports B5G6R5 (it's optional before D3D11.1), which has the same bit layout.
+*/
+const TexConverter::TextureFormat TexConverter::formatRGB16Direct = {true,0,0,2,true,DXGI_FORMAT_B5G6R5_UNORM,nullptr};
+
 /**
 Build metadata from Unreal info
 */
@@ -67,6 +92,9 @@ TextureCache::TextureMetaData TexConverter::buildMetaData(const FTextureInfo &In
 	metadata.multV = 1.0 / (Info.VScale * Info.VClamp);
 	metadata.masked = (PolyFlags & PF_Masked)!=0;
 	metadata.customPolyFlags = customPolyFlags;
+	metadata.paletteRow = -1;
+	metadata.paletteCacheID = 0;
+	metadata.fingerprint = 0;
 	for(int i=0;i<TextureCache::DUMMY_NUM_EXTERNAL_TEXTURES;i++)
 	{
 		metadata.externalTextures[i]=nullptr;
@@ -74,9 +102,105 @@ TextureCache::TextureMetaData TexConverter::buildMetaData(const FTextureInfo &In
 	return metadata;
 }
 
-TexConverter::TexConverter(TextureCache *textureCache)
+/**
+Texture converted on a worker thread. The game's data is copied on submission, as it can't be relied on to stay around.
+\note Only formats that need conversion (P8, and RGB16 and RGB8) are converted on workers.
+*/
+class TexConverter::ConversionJob : public WorkerPool::Job
+{
+public:
+	const TextureCache *textureCache;
+	DiskTextureCache *diskCache;
+	DWORD64 id;
+	unsigned int ticket; /**< Compared to TexConverter::pendingTextures so outdated results are dropped */
+	FTextureInfo info; /**< Copy of the game's info, pointing at the copies below */
+	FMipmap mips[MAX_MIPS];
+	std::vector<BYTE> mipData[MAX_MIPS];
+	FColor palette[256];
+	DWORD PolyFlags;
+	const TextureFormat *format;
+	TextureCache::TextureMetaData metadata;
+	D3D10_TEXTURE2D_DESC desc;
+	ID3D10Texture2D *texture; /**< Result; NULL if creating it failed */
+	size_t uploadBytes; /**< For D3D::stats, counted once published */
+	bool diskHit; /**< Whether the texture came from the disk cache */
+
+	ConversionJob(const TextureCache *textureCache, DiskTextureCache *diskCache, const FTextureInfo &Info, DWORD PolyFlags, const TextureFormat &format, const TextureCache::TextureMetaData &metadata, const D3D10_TEXTURE2D_DESC &desc, unsigned int ticket):
+		textureCache(textureCache), diskCache(diskCache), id(Info.CacheID), ticket(ticket), info(Info), PolyFlags(PolyFlags), format(&format), metadata(metadata), desc(desc), texture(nullptr), uploadBytes(0), diskHit(false)
+	{
+		info.MaxColor = nullptr;
+		if(Info.Palette)
+		{
+			memcpy(palette,Info.Palette,sizeof(palette));
+			info.Palette = palette;
+		}
+		for(int i=0;i<Info.NumMips;i++)
+		{
+			const FMipmapBase *src = Info.Mips[i];
+			mips[i].USize = src->USize;
+			mips[i].VSize = src->VSize;
+			mips[i].UBits = src->UBits;
+			mips[i].VBits = src->VBits;
+			mipData[i].assign(src->DataPtr,src->DataPtr+getMipDataSize(Info,i)); //Rows up to the clamp, as convertMip() reads
+			mips[i].DataPtr = &mipData[i][0];
+			info.Mips[i] = &mips[i];
+		}
+	}
+
+	~ConversionJob()
+	{
+		SAFE_RELEASE(texture);
+	}
+
+	void run() override
+	{
+		ULONGLONG hash = 0;
+		if(diskCache)
+		{
+			hash = hashTexture(info,PolyFlags,desc);
+			texture = createFromDiskCache(diskCache,textureCache,hash,desc,false,uploadBytes);
+			diskHit = texture!=nullptr;
+			if(diskHit)
+				return;
+		}
+
+		D3D10_SUBRESOURCE_DATA data[MAX_MIPS];
+		bool converted = true;
+		for(int i=0;i<info.NumMips;i++)
+		{
+			convertMip(info,*format,PolyFlags,i,data[i]);
+			converted = converted && data[i].pSysMem!=nullptr;
+		}
+		if(desc.MipLevels>(UINT)info.NumMips && !(converted && buildMips(desc,info.NumMips,data)))
+			desc.MipLevels = info.NumMips;
+		if(converted && desc.Format!=format->d3dFormat && !compressMips(desc,data,0,nullptr,1))
+			desc.Format = format->d3dFormat;
+		if(converted)
+		{
+			texture = textureCache->createTexture(desc,*data,false);
+			uploadBytes = TextureCache::getUploadSize(desc,*data);
+			if(texture && diskCache)
+				diskCache->store(hash,desc,data);
+		}
+		for(UINT i=0;i<desc.MipLevels;i++)
+		{
+			delete [] data[i].pSysMem;
+		}
+	}
+};
+
+/**
+\param workers Pool to convert static textures on; NULL to convert them right away.
+\param compressHelpers Pool whose workers help block compress textures converted right away; NULL to compress them on the calling thread only.
+\param diskCache Disk cache for converted textures; NULL for none.
+\param compressThreads Threads to block compress textures converted right away on, the calling one included; 0 to not compress textures.
+\param generateMips Whether textures that come with fewer mips than their size calls for get the rest generated.
+\param realtimeUploadCap Bytes of realtime texture updates per frame before further ones are put off to the next frame; 0 for no cap.
+*/
+TexConverter::TexConverter(TextureCache *textureCache, WorkerPool *workers, WorkerPool *compressHelpers, DiskTextureCache *diskCache, int compressThreads, bool generateMips, size_t realtimeUploadCap): workers(workers), compressHelpers(compressHelpers), diskCache(diskCache), compressThreads(compressThreads), generateMips(generateMips), realtimeUploadCap(realtimeUploadCap), nextTicket(0)
 {
 	this->textureCache = textureCache;
+	directRGB16 = textureCache->supportsFormat(DXGI_FORMAT_B5G6R5_UNORM);
 }
 
 /**
@@ -84,8 +208,9 @@ Fill texture info structure and execute proper conversion of pixel data.
 
 \param Info Unreal texture information, includes cache id, size information, texture data.
 \param PolyFlags Polyflags, see polyflags.h.
+\param allowPaletted Whether a P8 texture may be kept paletted (see formatPalettedGPU); only the diffuse pass supports this.
 */
-void TexConverter::convertAndCache(FTextureInfo& Info,DWORD PolyFlags) const
+void TexConverter::convertAndCache(FTextureInfo& Info,DWORD PolyFlags,bool allowPaletted)
 {
 	if(Info.Format > TEXF_RGBA8)
 	{
@@ -93,13 +218,15 @@ void TexConverter::convertAndCache(FTextureInfo& Info,DWORD PolyFlags) const
 		return;
 	}
 	
-	TextureFormat &format=formats[Info.Format];
-	if(format.supported == false)
+	const TextureFormat *format=&formats[Info.Format];
+	if(format->supported == false)
 	{
 		UD3D10RenderDevice::debugs("Unsupported texture type.");
 		return;
 	}
 
+	const FTextureInfo original = Info; //For the fingerprint, which is compared against the info as the game passes it
+
 	//Unreal 1 S3TC texture fix: if texture info size doesn't match mip size (happens for some textures for some reason), scale up clamp (which is what we use for the size)
 	if(Info.USize != Info.Mips[0]->USize)
 	{
@@ -118,6 +245,17 @@ void TexConverter::convertAndCache(FTextureInfo& Info,DWORD PolyFlags) const
 
 	//Set texture info. These parameters are the same for each usage of the texture.
 	TextureCache::TextureMetaData metadata= buildMetaData(Info,PolyFlags);	
+	if(Info.Format==TEXF_P8 && allowPaletted && textureCache->usesGPUPalettes())
+	{
+		//Falls back to expanding if the palette texture is full
+		metadata.paletteRow = cachePalette(Info,(Info.TextureFlags & TF_RealtimePalette)!=0);
+		if(metadata.paletteRow>=0)
+		{
+			metadata.paletteCacheID = Info.PaletteCacheID;
+			format = &formatPalettedGPU;
+		}
+	}
+	metadata.fingerprint = fingerprint(original,metadata.paletteRow<0);
 	//Mult is a multiplier (so division is only done once here instead of when texture is applied) to normalize texture coordinates.
 	//metadata.width = Info.USize;
 	//metadata.height = Info.VSize;	
@@ -127,20 +265,12 @@ void TexConverter::convertAndCache(FTextureInfo& Info,DWORD PolyFlags) const
 
 	CLAMP(Info.NumMips,0,MAX_MIPS); //Some third party s3tc textures report more mips than the info structure fits	
 
-	//Convert each mip level
-	D3D10_SUBRESOURCE_DATA* data = new (std::nothrow) D3D10_SUBRESOURCE_DATA[Info.NumMips];
-	if(data == nullptr)
-	{
-		return;
-	}
-	for(int i=0;i<Info.NumMips;i++)
-	{
-		convertMip(Info,format,PolyFlags,i,data[i]);
-	}
-
-	//Create a texture from the converted data
 	bool dynamic = ((Info.TextureFlags & TF_RealtimeChanged || Info.TextureFlags & TF_Realtime || Info.TextureFlags & TF_Parametric) != 0);
 
+	//RGB16 is used as is if the device can, unless it's to be block compressed, which is smaller still
+	if(Info.Format==TEXF_RGB16 && directRGB16 && (dynamic || compressThreads==0))
+		format = &formatRGB16Direct;
+
 	D3D10_TEXTURE2D_DESC desc;
 	desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
 	desc.ArraySize = 1;
@@ -150,9 +280,20 @@ void TexConverter::convertAndCache(FTextureInfo& Info,DWORD PolyFlags) const
 	desc.MiscFlags = 0;
 	desc.SampleDesc.Count = 1;
 	desc.SampleDesc.Quality = 0;	
-	desc.Format = format.d3dFormat;
+	desc.Format = format->d3dFormat;
+
+	//Textures with fewer mips than their size calls for get the rest generated; lightmaps and fog are only magnified
+	if(generateMips && format->d3dFormat==DXGI_FORMAT_R8G8B8A8_UNORM && Info.Format!=TEXF_RGBA7)
+		desc.MipLevels = max(desc.MipLevels,countMips(desc.Width,desc.Height));
 	
-	if(dynamic)
+	if(dynamic && desc.MipLevels>(UINT)Info.NumMips) //Updates write the top mip, the GPU generates the rest (see TextureCache::updateMip())
+	{
+		desc.Usage = D3D10_USAGE_DEFAULT;
+		desc.CPUAccessFlags = 0;
+		desc.BindFlags |= D3D10_BIND_RENDER_TARGET;
+		desc.MiscFlags = D3D10_RESOURCE_MISC_GENERATE_MIPS;
+	}
+	else if(dynamic)
 	{
 		desc.Usage = D3D10_USAGE_DYNAMIC;
 		desc.CPUAccessFlags = D3D10_CPU_ACCESS_WRITE;
@@ -162,45 +303,363 @@ void TexConverter::convertAndCache(FTextureInfo& Info,DWORD PolyFlags) const
 		desc.Usage = D3D10_USAGE_IMMUTABLE;
 		desc.CPUAccessFlags = 0;
 	}
-	if(format.blocksize>0) //Compressed textures should be a whole amount of blocks
+	if(format->blocksize>0) //Compressed textures should be a whole amount of blocks
 	{
-		desc.Width += Info.USize%format.blocksize;
-		desc.Height += Info.VSize%format.blocksize;
+		desc.Width += Info.USize%format->blocksize;
+		desc.Height += Info.VSize%format->blocksize;
 	}
+	if(compressThreads>0 && !dynamic)
+		desc.Format = chooseCompressedFormat(Info,PolyFlags,*format,desc);
 
-	ID3D10Texture2D* texture = textureCache->createTexture(desc,*data);
-	if(texture==nullptr)
+	//Static textures that need converting go to the workers if there are any; ones without mips are mostly UI and can't do with a placeholder
+	if(workers && !dynamic && !format->directAssign && Info.NumMips>1 && convertAsync(Info,PolyFlags,*format,metadata,desc))
+		return;
+	pendingTextures.erase(Info.CacheID); //A conversion for an earlier texture with this id (before a level change) mustn't replace this one
+
+	//Converted textures may be on disk from an earlier run
+	ULONGLONG hash = 0;
+	if(diskCache && !dynamic && !format->directAssign)
+	{
+		hash = hashTexture(Info,PolyFlags,desc);
+		size_t uploadBytes;
+		ID3D10Texture2D *texture = createFromDiskCache(diskCache,textureCache,hash,desc,true,uploadBytes);
+		if(texture)
+		{
+			D3D::stats.diskCacheHits++;
+			textureCache->cacheTexture(Info.CacheID,metadata,texture);
+			SAFE_RELEASE(texture);
+			return;
+		}
+		D3D::stats.diskCacheMisses++;
+	}
+
+	//Convert each mip level
+	D3D10_SUBRESOURCE_DATA* data = new (std::nothrow) D3D10_SUBRESOURCE_DATA[desc.MipLevels];
+	if(data == nullptr)
 	{
-		//_putws(Info.Texture->GetFullName());
 		return;
 	}
+	bool converted = true;
+	for(int i=0;i<Info.NumMips;i++)
+	{
+		convertMip(Info,*format,PolyFlags,i,data[i]);
+		converted = converted && data[i].pSysMem!=nullptr;
+	}
+	UINT firstOwned = format->directAssign ? Info.NumMips : 0; //Mips from here on were allocated by us
+	if(desc.MipLevels>(UINT)Info.NumMips && !(converted && buildMips(desc,Info.NumMips,data)))
+	{
+		desc.MipLevels = Info.NumMips;
+		desc.Usage = dynamic ? D3D10_USAGE_DYNAMIC : D3D10_USAGE_IMMUTABLE;
+		desc.CPUAccessFlags = dynamic ? D3D10_CPU_ACCESS_WRITE : 0;
+		desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
+		desc.MiscFlags = 0;
+	}
+	if(desc.Format!=format->d3dFormat)
+	{
+		if(converted && compressMips(desc,data,firstOwned,compressHelpers,compressThreads))
+			firstOwned = 0;
+		else
+			desc.Format = format->d3dFormat;
+	}
 
-	textureCache->cacheTexture(Info.CacheID,metadata,texture);
+	//Create a texture from the converted data
+	ID3D10Texture2D* texture = textureCache->createTexture(desc,*data);
+	if(texture)
+	{
+		textureCache->cacheTexture(Info.CacheID,metadata,texture);
+		if(hash)
+			diskCache->store(hash,desc,data);
+		SAFE_RELEASE(texture);
+	}
 
-	//Delete temporary data
-	if(!format.directAssign)
+	//Delete temporary data, also when creating the texture failed
+	for(UINT i=firstOwned;i<desc.MipLevels;i++)
 	{
-		for(int i=0;i<Info.NumMips;i++)
-		{
-			delete [] data[i].pSysMem;
-		}		
+		delete [] data[i].pSysMem;
 	}
 	delete [] data;
-	SAFE_RELEASE(texture);
+}
+
+/**@name Disk cache */
+//@{
+
+/**
+Hash of everything that goes into a converted texture, to find it in the disk cache.
+\note Only textures that need converting are cached.
+*/
+ULONGLONG TexConverter::hashTexture(const FTextureInfo& Info, DWORD PolyFlags, const D3D10_TEXTURE2D_DESC &desc)
+{
+	UINT params[5] = {desc.Format,desc.Width,desc.Height,desc.MipLevels,(PolyFlags & PF_Masked)!=0};
+	ULONGLONG hash = Misc::hashBytes(params,sizeof(params),0);
+	if(Info.Palette)
+		hash = Misc::hashBytes(Info.Palette,256*sizeof(FColor),hash);
+	for(int i=0;i<Info.NumMips;i++)
+	{
+		const FMipmapBase *mip = Info.Mips[i];
+		hash = Misc::hashBytes(&mip->USize,sizeof(mip->USize),hash);
+		hash = Misc::hashBytes(mip->DataPtr,getMipDataSize(Info,i),hash);
+	}
+	return hash;
+}
+
+/**
+Create a texture from the disk cache, straight from the mapped file.
+\param countUpload See TextureCache::createTexture().
+\param uploadBytes Set to the size of the texture data.
+\return NULL if the texture isn't cached.
+*/
+ID3D10Texture2D *TexConverter::createFromDiskCache(DiskTextureCache *diskCache, const TextureCache *textureCache, ULONGLONG hash, const D3D10_TEXTURE2D_DESC &desc, bool countUpload, size_t &uploadBytes)
+{
+	DiskTextureCache::MappedTexture mapped;
+	if(!diskCache->load(hash,desc,mapped))
+		return nullptr;
+	ID3D10Texture2D *texture = textureCache->createTexture(desc,*mapped.data,countUpload);
+	uploadBytes = TextureCache::getUploadSize(desc,*mapped.data);
+	diskCache->release(mapped);
+	return texture;
+}
+//@}
+
+/**
+Bytes of source data in a mip; rows beyond the VClamp are left out as these can't always be read.
+*/
+size_t TexConverter::getMipDataSize(const FTextureInfo& Info, int mipLevel)
+{
+	const FMipmapBase *mip = Info.Mips[mipLevel];
+	int rows = min(mip->VSize,max(Info.VClamp>>mipLevel,1));
+	switch(Info.Format)
+	{
+	case TEXF_P8:
+		return mip->USize*rows;
+	case TEXF_RGB16:
+		return mip->USize*rows*2;
+	case TEXF_RGB8:
+		return mip->USize*rows*3;
+	case TEXF_DXT1:
+		return max(mip->USize/4,1)*max(mip->VSize/4,1)*8;
+	default:
+		return mip->USize*rows*4;
+	}
+}
+
+/**
+Identification of a texture's contents: its layout, the data of all its mips and, if converted with it, its palette's colors. Used to tell whether
+a CacheID cached before a level change still refers to the same texture; hashing is far cheaper than converting and uploading again.
+\param includePalette Whether the palette is part of the converted texture (it isn't for textures kept paletted).
+\note Realtime and parametric textures only have their layout compared, as their data changes anyway.
+\note Palette colors are hashed rather than the PaletteCacheID, as those are reused across level loads too.
+*/
+QWORD TexConverter::fingerprint(const FTextureInfo& Info, bool includePalette)
+{
+	INT params[6] = {Info.Format,Info.USize,Info.VSize,Info.UClamp,Info.VClamp,Info.NumMips};
+	ULONGLONG hash = Misc::hashBytes(params,sizeof(params),0);
+	if(includePalette && Info.Palette)
+		hash = Misc::hashBytes(Info.Palette,256*sizeof(FColor),hash);
+	if(Info.TextureFlags & (TF_Realtime|TF_Parametric))
+		return hash;
+	for(int i=0;i<min(Info.NumMips,MAX_MIPS);i++)
+		hash = Misc::hashBytes(Info.Mips[i]->DataPtr,getMipDataSize(Info,i),hash);
+	return hash;
+}
+
+/**
+Hand a texture to the workers. Until its job is published, the texture is drawn using its smallest mip, which is cheap to convert right away.
+\return false if no placeholder could be made; the texture should then be converted right away.
+*/
+bool TexConverter::convertAsync(const FTextureInfo& Info, DWORD PolyFlags, const TextureFormat &format, const TextureCache::TextureMetaData &metadata, const D3D10_TEXTURE2D_DESC &desc)
+{
+	int smallest = Info.NumMips-1;
+	D3D10_SUBRESOURCE_DATA data;
+	convertMip(Info,format,PolyFlags,smallest,data);
+	if(data.pSysMem==nullptr)
+		return false;
+
+	D3D10_TEXTURE2D_DESC placeholderDesc = desc;
+	placeholderDesc.Format = format.d3dFormat; //Not compressed; small mips aren't a whole number of blocks
+	placeholderDesc.Width = max(desc.Width>>smallest,1u);
+	placeholderDesc.Height = max(desc.Height>>smallest,1u);
+	placeholderDesc.MipLevels = 1;
+	ID3D10Texture2D *placeholder = textureCache->createTexture(placeholderDesc,data);
+	delete [] data.pSysMem;
+	if(placeholder==nullptr)
+		return false;
+
+	ConversionJob *job = new (std::nothrow) ConversionJob(textureCache,diskCache,Info,PolyFlags,format,metadata,desc,nextTicket);
+	if(job==nullptr)
+	{
+		SAFE_RELEASE(placeholder);
+		return false;
+	}
+
+	textureCache->cacheTexture(Info.CacheID,metadata,placeholder);
+	SAFE_RELEASE(placeholder);
+	pendingTextures[Info.CacheID] = nextTicket++;
+	workers->submit(job);
+	return true;
+}
+
+/**
+Replace placeholders with the textures workers have finished. Call at a frame boundary, so a frame doesn't mix placeholders and real textures for the same id.
+Results for textures that were deleted or resubmitted in the meantime are dropped.
+*/
+void TexConverter::publishFinished()
+{
+	if(!workers)
+		return;
+
+	std::vector<WorkerPool::Job*> finished;
+	workers->collectFinished(finished);
+	for(std::vector<WorkerPool::Job*>::iterator i=finished.begin();i!=finished.end();i++)
+	{
+		ConversionJob *job = static_cast<ConversionJob*>(*i);
+		if(diskCache)
+		{
+			if(job->diskHit)
+				D3D::stats.diskCacheHits++;
+			else
+				D3D::stats.diskCacheMisses++;
+		}
+		std::unordered_map<DWORD64,unsigned int>::iterator pending = pendingTextures.find(job->id);
+		if(pending!=pendingTextures.end() && pending->second==job->ticket)
+		{
+			pendingTextures.erase(pending);
+			if(job->texture && textureCache->textureIsCached(job->id)) //Placeholder may have been evicted since
+			{
+				textureCache->cacheTexture(job->id,job->metadata,job->texture);
+				D3D::stats.textureBytes += job->uploadBytes;
+				D3D::stats.asyncTextures++;
+			}
+		}
+		delete job;
+	}
+}
+
+/**
+Forget textures being converted, so their results get dropped. Call when the texture cache is flushed.
+*/
+void TexConverter::cancelPending()
+{
+	pendingTextures.clear();
 }
 
 /**
 Update a dynamic texture by converting its 0th mip and letting D3D update it.
+Procedural textures are flagged as changed every tick, even when few or none of their rows did. The source rows are hashed and compared with the
+last upload: unchanged textures aren't converted or uploaded at all, and for textures that can take it (see TextureCache::updatesRows()) only the span
+of changed rows is uploaded. Those are the ones with generated mips; with GenerateMips off, as by default, realtime textures are mapped with discard,
+which means writing them whole, so only the skipping of unchanged textures applies. With an upload cap, updates past it are put off to the next frame the texture is used in.
+\param texture The texture's handle.
+\return false if the texture is paletted and its palette no longer fits; it must then be recreated.
 */
-void TexConverter::update(FTextureInfo& Info,DWORD PolyFlags) const
+bool TexConverter::update(FTextureInfo& Info,DWORD PolyFlags,TextureCache::TextureHandle texture) const
 {	
 	D3D10_SUBRESOURCE_DATA data;
 	//Info.bRealtimeChanged=0; //Clear this flag (from other renderes)
 	TextureFormat format = formats[Info.Format];
+	bool paletted = texture->metadata.paletteRow>=0;
+	if(paletted)
+	{
+		if(!updatePalette(Info))
+			return false;
+		format = formatPalettedGPU;
+	}
+	else if(Info.Format==TEXF_RGB16 && directRGB16)
+		format = formatRGB16Direct; //As created, see convertAndCache()
+
+	//Find the rows that changed since the last upload
+	std::vector<QWORD> hashes;
+	UINT rows = Info.VClamp, firstRow = 0, numRows = rows;
+	if(format.blocksize==0)
+	{
+		UINT hashedRows = hashRows(Info,!paletted,hashes);
+		if(!findChangedRows(texture->rowHashes,hashes,hashedRows,firstRow,numRows))
+		{
+			texture->updateDeferred = false;
+			D3D::stats.realtimeBytesSaved += (size_t)rows*Info.UClamp*format.bytesPerPixel;
+			return true;
+		}
+		if(!TextureCache::updatesRows(texture))
+		{
+			firstRow = 0;
+			numRows = rows;
+		}
+	}
+
+	//The first update of a frame always goes through, so textures larger than the cap still get updated
+	size_t bytes = (size_t)numRows*Info.UClamp*format.bytesPerPixel;
+	if(realtimeUploadCap && D3D::stats.realtimeBytes>0 && D3D::stats.realtimeBytes+bytes>realtimeUploadCap)
+	{
+		texture->updateDeferred = true;
+		D3D::stats.realtimeDeferred++;
+		return true;
+	}
+
 	convertMip(Info,format,PolyFlags,0,data);
-	textureCache->updateMip(Info,0,data);
+	if(data.pSysMem==nullptr)
+		return true;
+	textureCache->updateMip(Info,0,data,format.bytesPerPixel,firstRow,numRows);
 	if(!format.directAssign)
 		delete [] data.pSysMem;
+	texture->rowHashes.swap(hashes);
+	texture->updateDeferred = false;
+	D3D::stats.realtimeBytesSaved += (size_t)(rows-numRows)*Info.UClamp*format.bytesPerPixel;
+	return true;
+}
+
+/**
+Hash each row of a texture's top mip as the game supplied it, for finding what changed between realtime updates.
+\param includePalette Also hash the palette, as the last entry; for paletted textures that are expanded, as a new palette changes every row.
+\param hashes Set to a hash per row.
+\return Rows hashed.
+*/
+UINT TexConverter::hashRows(const FTextureInfo& Info, bool includePalette, std::vector<QWORD> &hashes)
+{
+	const FMipmapBase *mip = Info.Mips[0];
+	UINT rows = min(mip->VSize,max(Info.VClamp,1));
+	size_t rowBytes = getMipDataSize(Info,0)/rows;
+	hashes.resize(rows+(includePalette && Info.Palette ? 1 : 0));
+	for(UINT y=0;y<rows;y++)
+		hashes[y] = Misc::hashBytes(mip->DataPtr+y*rowBytes,rowBytes,0);
+	if(hashes.size()>rows)
+		hashes[rows] = Misc::hashBytes(Info.Palette,256*sizeof(FColor),0);
+	return rows;
+}
+
+/**
+Compare row hashes with the last upload's.
+\param rows Rows hashed, see hashRows().
+\param firstRow Set to the first changed row; left alone if everything changed.
+\param numRows Set to the number of rows from firstRow up to and including the last changed one; left alone if everything changed (no last upload, or a new palette).
+\return false if nothing changed.
+*/
+bool TexConverter::findChangedRows(const std::vector<QWORD> &last, const std::vector<QWORD> &hashes, UINT rows, UINT &firstRow, UINT &numRows)
+{
+	if(last.size()!=hashes.size() || (hashes.size()>rows && last[rows]!=hashes[rows]))
+		return true;
+	UINT first = 0;
+	while(first<rows && last[first]==hashes[first])
+		first++;
+	if(first==rows)
+		return false;
+	UINT end = rows;
+	while(last[end-1]==hashes[end-1])
+		end--;
+	firstRow = first;
+	numRows = end-first;
+	return true;
+}
+
+/**
+Point a paletted texture to its current palette, uploading the palette if it's new or realtime. Costs a palette texture row instead of a texture conversion.
+\return false if the palette texture is full; the texture must then be recreated.
+*/
+bool TexConverter::updatePalette(const FTextureInfo& Info) const
+{
+	int row = cachePalette(Info,(Info.TextureFlags & TF_RealtimePalette)!=0);
+	if(row<0)
+		return false;
+	textureCache->setTexturePalette(Info.CacheID,Info.PaletteCacheID,row);
+	return true;
 }
 
 /**
@@ -222,7 +681,7 @@ void TexConverter::convertMip(const FTextureInfo& Info,const TextureFormat &form
 	}
 	else
 	{
-		data.SysMemPitch=Info.Mips[mipLevel]->USize*sizeof(DWORD); //Pitch is set so garbage data outside of UClamp is skipped
+		data.SysMemPitch=Info.Mips[mipLevel]->USize*format.bytesPerPixel; //Pitch is set so garbage data outside of UClamp is skipped
 	}
 
 	//Assign or convert
@@ -243,34 +702,209 @@ void TexConverter::convertMip(const FTextureInfo& Info,const TextureFormat &form
 	}
 }
 
+/**@name Block compression */
+//@{
+
 /**
-Convert from palleted 8bpp to r8g8b8a8.
+Format a static texture is stored in when compression is on. Only textures that end up as R8G8B8A8 and whose size is a whole number of blocks
+(as D3D10 requires of the top mip) are compressed.
+- P8 textures are BC1: their alpha is only ever 0 (masked pixels, see buildPaletteLUT()) or 255.
+- RGB16 and RGB8 textures are opaque, so BC1.
+- RGBA8 textures are BC1 if they're opaque, or masked with only 0 and 255 alpha. Anything else is BC3, as BC1 would also blacken transparent pixels.
+\return The uncompressed format if the texture isn't to be compressed.
 */
-// Globals.
-void TexConverter::fromPaletted(const FTextureInfo& Info,DWORD PolyFlags, void *target,int mipLevel)
+DXGI_FORMAT TexConverter::chooseCompressedFormat(const FTextureInfo& Info, DWORD PolyFlags, const TextureFormat &format, const D3D10_TEXTURE2D_DESC &desc)
 {
-	//If texture is masked with palette index 0 = transparent; make that index black w. alpha 0 (black looks best for the border that gets left after masking)
-	if(PolyFlags & PF_Masked )
+	if(format.d3dFormat!=DXGI_FORMAT_R8G8B8A8_UNORM || desc.Width%4 || desc.Height%4)
+		return format.d3dFormat;
+	if(Info.Format==TEXF_P8 || Info.Format==TEXF_RGB16 || Info.Format==TEXF_RGB8)
+		return DXGI_FORMAT_BC1_UNORM;
+	if(Info.Format!=TEXF_RGBA8)
+		return format.d3dFormat;
+
+	const FMipmapBase *mip = Info.Mips[0];
+	bool masked = (PolyFlags & PF_Masked)!=0;
+	for(UINT y=0;y<desc.Height;y++)
 	{
-		*(DWORD*)(&(Info.Palette->R)) = (DWORD) 0;
+		const BYTE *row = mip->DataPtr+y*mip->USize*4;
+		for(UINT x=0;x<desc.Width;x++)
+		{
+			BYTE alpha = row[x*4+3];
+			if(alpha!=255 && (!masked || alpha!=0))
+				return DXGI_FORMAT_BC3_UNORM;
+		}
 	}
+	return DXGI_FORMAT_BC1_UNORM;
+}
 
-	DWORD *dest = (DWORD*) target;
-	BYTE *source = (BYTE*) Info.Mips[mipLevel]->DataPtr;
-	BYTE *sourceEnd = source + Info.Mips[mipLevel]->USize*Info.Mips[mipLevel]->VSize;
+/**
+Replace converted R8G8B8A8 mips by blocks in the texture's format.
+\param desc Texture description, with the compressed format.
+\param data Mips as made by convertMip(); each gets newly allocated blocks the caller must free.
+\param firstOwned First mip whose R8G8B8A8 data was allocated by convertMip() or buildMips(); these are freed. Earlier ones are the game's.
+\param helpers Pool whose workers help encode; NULL to encode on the calling thread only.
+\param threads Threads to encode on at most, the calling one included.
+\return false if memory ran out; the data is then left as it was.
+*/
+bool TexConverter::compressMips(const D3D10_TEXTURE2D_DESC &desc, D3D10_SUBRESOURCE_DATA *data, UINT firstOwned, WorkerPool *helpers, int threads)
+{
+	D3D10_SUBRESOURCE_DATA blocks[MAX_MIPS];
+	for(UINT i=0;i<desc.MipLevels;i++)
+	{
+		blocks[i].SysMemPitch = BCEncoder::getPitch(desc.Format,max(desc.Width>>i,1u));
+		blocks[i].SysMemSlicePitch = 0;
+		blocks[i].pSysMem = new (std::nothrow) DWORD[blocks[i].SysMemPitch*TextureCache::getMipRows(desc,i)/sizeof(DWORD)];
+		if(blocks[i].pSysMem==nullptr)
+		{
+			UD3D10RenderDevice::debugs("Convert: Error allocating compressed texture memory.");
+			for(UINT j=0;j<i;j++)
+				delete [] blocks[j].pSysMem;
+			return false;
+		}
+	}
 
-	while(source<sourceEnd)
+	BCEncoder::encodeMips(desc.Format,desc.Width,desc.Height,desc.MipLevels,data,blocks,helpers,threads);
+	for(UINT i=0;i<desc.MipLevels;i++)
 	{
-		auto palletedPixel = Info.Palette[*source];
+		if(i>=firstOwned)
+			delete [] data[i].pSysMem;
+		data[i] = blocks[i];
+	}
+	return true;
+}
+//@}
 
-		//Crappy hack for alpha... someone should fix it, but idk who.
-		palletedPixel.A = palletedPixel.A != 0 || palletedPixel.R > 0 || palletedPixel.G > 0 || palletedPixel.B > 0 || *source != 0 ? 255 : 0;
+/**@name Palette expansion
+Paletted textures are expanded through a 256 entry RGBA lookup table that already has the alpha rules applied, so the per-pixel work is a plain table lookup.
+Only AVX2 does the lookup itself in vector registers, with gathers. Without it the lookups stay scalar: the SSE2 path is the scalar loop unrolled sixteen
+pixels at a time with the results written as 16 byte stores. SSSE3's byte shuffles only index 16 entries so offer nothing for a 256 entry table.
+*/
+//@{
 
-		*dest=*(DWORD*)&(palletedPixel);
+/**
+Lookup table for a palette, remembered per thread so the mips of a texture (and other textures using the palette) don't rebuild it.
+Keyed by the palette's colors rather than its PaletteCacheID, as those are reused across level loads and realtime palettes change under the same one.
+*/
+struct PaletteLUT
+{
+	QWORD paletteHash; /**< Misc::hashBytes() of the game's palette */
+	bool masked;
+	bool valid;
+	DWORD colors[256];
+};
+
+typedef void (*PaletteExpansionFunc)(const DWORD *lut, const BYTE *source, DWORD *dest, size_t num);
+
+static void expandPalettedScalar(const DWORD *lut, const BYTE *source, DWORD *dest, size_t num)
+{
+	for(size_t i=0;i<num;i++)
+		dest[i] = lut[source[i]];
+}
 
-		source++;
-		dest++;
+/**
+Scalar table lookups, unrolled; only the stores use SSE2. Not a vectorised lookup, see D3D10ConvertBench for whether it beats the plain loop.
+*/
+static void expandPalettedSSE2(const DWORD *lut, const BYTE *source, DWORD *dest, size_t num)
+{
+	size_t i=0;
+	for(;i+16<=num;i+=16)
+	{
+		const BYTE *s = source+i;
+		_mm_storeu_si128((__m128i*)(dest+i),_mm_setr_epi32(lut[s[0]],lut[s[1]],lut[s[2]],lut[s[3]]));
+		_mm_storeu_si128((__m128i*)(dest+i+4),_mm_setr_epi32(lut[s[4]],lut[s[5]],lut[s[6]],lut[s[7]]));
+		_mm_storeu_si128((__m128i*)(dest+i+8),_mm_setr_epi32(lut[s[8]],lut[s[9]],lut[s[10]],lut[s[11]]));
+		_mm_storeu_si128((__m128i*)(dest+i+12),_mm_setr_epi32(lut[s[12]],lut[s[13]],lut[s[14]],lut[s[15]]));
 	}
+	expandPalettedScalar(lut,source+i,dest+i,num-i);
+}
+
+static void expandPalettedAVX2(const DWORD *lut, const BYTE *source, DWORD *dest, size_t num)
+{
+	size_t i=0;
+	for(;i+8<=num;i+=8)
+	{
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(source+i)));
+		_mm256_storeu_si256((__m256i*)(dest+i),_mm256_i32gather_epi32((const int*)lut,indices,4));
+	}
+	_mm256_zeroupper();
+	expandPalettedScalar(lut,source+i,dest+i,num-i);
+}
+
+/**
+Pick the fastest expansion the CPU and OS support.
+*/
+static PaletteExpansionFunc selectPaletteExpansion()
+{
+	int info[4];
+	__cpuid(info,0);
+	int maxLeaf = info[0];
+	__cpuid(info,1);
+	bool sse2 = (info[3] & (1<<26))!=0;
+	bool osAVX = (info[2] & (1<<27)) && (info[2] & (1<<28)) && (_xgetbv(0) & 6)==6; //OSXSAVE, AVX and YMM state enabled
+	if(osAVX && maxLeaf>=7)
+	{
+		__cpuidex(info,7,0);
+		if(info[1] & (1<<5))
+			return &expandPalettedAVX2;
+	}
+	if(sse2)
+		return &expandPalettedSSE2;
+	return &expandPalettedScalar;
+}
+
+static const PaletteExpansionFunc expandPaletted = selectPaletteExpansion();
+
+/**
+Build the lookup table for a palette. Index 0 is transparent black for masked textures; otherwise a color is opaque unless it's index 0 and completely black and transparent.
+\param paletteHash Key stored with the table, see PaletteLUT.
+*/
+static void buildPaletteLUT(const FTextureInfo &Info, bool masked, QWORD paletteHash, PaletteLUT &lut)
+{
+	for(int i=0;i<256;i++)
+	{
+		FColor c = Info.Palette[i];
+		c.A = 255;
+		lut.colors[i] = *(DWORD*)&c;
+	}
+	const FColor &first = Info.Palette[0];
+	if(masked || (first.A==0 && first.R==0 && first.G==0 && first.B==0))
+		lut.colors[0] = 0;
+
+	lut.paletteHash = paletteHash;
+	lut.masked = masked;
+	lut.valid = true;
+}
+//@}
+
+/**
+Store a texture's palette in the texture cache's palette texture. Colors get the rules for non-masked textures; the shader handles masking.
+\param update Upload even if the palette is already stored.
+\return Palette texture row, -1 if full.
+*/
+int TexConverter::cachePalette(const FTextureInfo &Info, bool update) const
+{
+	PaletteLUT lut;
+	buildPaletteLUT(Info,false,0,lut);
+	return textureCache->cachePalette(Info.PaletteCacheID,lut.colors,update);
+}
+
+/**
+Convert from palleted 8bpp to r8g8b8a8.
+
+\note The game's palette is left untouched; masking is applied to a copy.
+*/
+void TexConverter::fromPaletted(const FTextureInfo& Info,DWORD PolyFlags, void *target,int mipLevel)
+{
+	static thread_local PaletteLUT lut;
+	bool masked = (PolyFlags & PF_Masked)!=0;
+	QWORD paletteHash = Misc::hashBytes(Info.Palette,256*sizeof(FColor),0); //1KB, next to nothing against expanding a mip
+	if(!lut.valid || lut.paletteHash!=paletteHash || lut.masked!=masked)
+		buildPaletteLUT(Info,masked,paletteHash,lut);
+
+	//Only rows up to the clamp are allocated, see convertMip()
+	const FMipmapBase *mip = Info.Mips[mipLevel];
+	size_t rows = min(mip->VSize,max(Info.VClamp>>mipLevel,1));
+	expandPaletted(lut.colors,mip->DataPtr,(DWORD*)target,mip->USize*rows);
 }
 
 /**
@@ -310,3 +944,351 @@ void TexConverter::fromBGRA7(const FTextureInfo& Info,DWORD PolyFlags,void *targ
 		dst2+=USize;
 	}*/
 }
+
+/**@name RGB expansion
+TEXF_RGB16 is 5:6:5 with red in the high bits; TEXF_RGB8 is three bytes per pixel, in the order of RGBA8's first three. Both are expanded to opaque R8G8B8A8.
+The 5 and 6 bit channels are widened by repeating their high bits, so full intensity stays full.
+RGB16 takes SSE2, eight pixels at a time; RGB8 takes SSSE3, whose byte shuffle spreads sixteen pixels from three loads over four stores.
+*/
+//@{
+
+typedef void (*RGBExpansionFunc)(const BYTE *source, DWORD *dest, size_t num);
+
+static void expandRGB16Scalar(const BYTE *source, DWORD *dest, size_t num)
+{
+	const WORD *src = (const WORD*)source;
+	for(size_t i=0;i<num;i++)
+	{
+		DWORD r = (src[i]>>8) & 0xF8, g = (src[i]>>3) & 0xFC, b = (src[i]<<3) & 0xF8;
+		dest[i] = (r|r>>5) | (g|g>>6)<<8 | (b|b>>5)<<16 | 0xFF000000;
+	}
+}
+
+static void expandRGB16SSE2(const BYTE *source, DWORD *dest, size_t num)
+{
+	const WORD *src = (const WORD*)source;
+	const __m128i redBlueMask = _mm_set1_epi16(0xF8);
+	const __m128i greenMask = _mm_set1_epi16(0xFC);
+	const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+	size_t i=0;
+	for(;i+8<=num;i+=8)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i*)(src+i));
+		__m128i r = _mm_and_si128(_mm_srli_epi16(p,8),redBlueMask);
+		__m128i g = _mm_and_si128(_mm_srli_epi16(p,3),greenMask);
+		__m128i b = _mm_and_si128(_mm_slli_epi16(p,3),redBlueMask);
+		r = _mm_or_si128(r,_mm_srli_epi16(r,5));
+		g = _mm_or_si128(g,_mm_srli_epi16(g,6));
+		b = _mm_or_si128(b,_mm_srli_epi16(b,5));
+		__m128i rg = _mm_or_si128(r,_mm_slli_epi16(g,8));
+		__m128i ba = _mm_or_si128(b,alpha);
+		_mm_storeu_si128((__m128i*)(dest+i),_mm_unpacklo_epi16(rg,ba));
+		_mm_storeu_si128((__m128i*)(dest+i+4),_mm_unpackhi_epi16(rg,ba));
+	}
+	expandRGB16Scalar((const BYTE*)(src+i),dest+i,num-i);
+}
+
+static void expandRGB8Scalar(const BYTE *source, DWORD *dest, size_t num)
+{
+	for(size_t i=0;i<num;i++)
+	{
+		const BYTE *s = source+3*i;
+		dest[i] = s[0] | s[1]<<8 | s[2]<<16 | 0xFF000000;
+	}
+}
+
+static void expandRGB8SSSE3(const BYTE *source, DWORD *dest, size_t num)
+{
+	const __m128i spread = _mm_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1); //Four pixels from twelve bytes; -1 gives zero, for the alpha
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	size_t i=0;
+	for(;i+16<=num;i+=16)
+	{
+		const BYTE *s = source+3*i;
+		__m128i a = _mm_loadu_si128((const __m128i*)s);
+		__m128i b = _mm_loadu_si128((const __m128i*)(s+16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(s+32));
+		_mm_storeu_si128((__m128i*)(dest+i),_mm_or_si128(_mm_shuffle_epi8(a,spread),alpha));
+		_mm_storeu_si128((__m128i*)(dest+i+4),_mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b,a,12),spread),alpha));
+		_mm_storeu_si128((__m128i*)(dest+i+8),_mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c,b,8),spread),alpha));
+		_mm_storeu_si128((__m128i*)(dest+i+12),_mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c,4),spread),alpha));
+	}
+	expandRGB8Scalar(source+3*i,dest+i,num-i);
+}
+
+static RGBExpansionFunc selectRGB16Expansion()
+{
+	int info[4];
+	__cpuid(info,1);
+	return (info[3] & (1<<26)) ? &expandRGB16SSE2 : &expandRGB16Scalar;
+}
+
+static RGBExpansionFunc selectRGB8Expansion()
+{
+	int info[4];
+	__cpuid(info,1);
+	return (info[2] & (1<<9)) ? &expandRGB8SSSE3 : &expandRGB8Scalar;
+}
+
+static const RGBExpansionFunc expandRGB16 = selectRGB16Expansion();
+static const RGBExpansionFunc expandRGB8 = selectRGB8Expansion();
+
+/**
+RGB16 to RGBA8, for devices without B5G6R5 and for textures that are block compressed.
+*/
+void TexConverter::fromRGB16(const FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel)
+{
+	const FMipmapBase *mip = Info.Mips[mipLevel];
+	size_t rows = min(mip->VSize,max(Info.VClamp>>mipLevel,1));
+	expandRGB16(mip->DataPtr,(DWORD*)target,mip->USize*rows);
+}
+
+/**
+RGB8 to RGBA8; D3D10 has no 24 bit formats.
+*/
+void TexConverter::fromRGB8(const FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel)
+{
+	const FMipmapBase *mip = Info.Mips[mipLevel];
+	size_t rows = min(mip->VSize,max(Info.VClamp>>mipLevel,1));
+	expandRGB8(mip->DataPtr,(DWORD*)target,mip->USize*rows);
+}
+
+/**
+Time the RGB16 and RGB8 expansions against their scalar versions on random pixels, and check they give the same result. For the D3D10ConvertBench command.
+P8 palette expansion is timed too: the plain lookup loop against the unrolled SSE2 one and, where the CPU has it, AVX2.
+\param pixels Pixels per run; an odd count also covers the scalar tails.
+*/
+void TexConverter::benchmarkExpansion(FOutputDevice &Ar, int pixels)
+{
+	static const TCHAR *names[] = {TEXT("RGB16"),TEXT("RGB8")};
+	static const int sourceBytes[] = {2,3};
+	RGBExpansionFunc scalar[] = {&expandRGB16Scalar,&expandRGB8Scalar};
+	RGBExpansionFunc selected[] = {expandRGB16,expandRGB8};
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	std::vector<DWORD> reference(pixels), result(pixels);
+	for(int f=0;f<2;f++)
+	{
+		//Source from a fixed seed so runs are comparable
+		std::vector<BYTE> source(pixels*sourceBytes[f]);
+		unsigned int seed = 12345;
+		for(size_t i=0;i<source.size();i++)
+		{
+			seed = seed*1664525+1013904223;
+			source[i] = (BYTE)(seed>>24);
+		}
+
+		float ns[2];
+		RGBExpansionFunc funcs[2] = {scalar[f],selected[f]};
+		std::vector<DWORD> *outputs[2] = {&reference,&result};
+		for(int k=0;k<2;k++)
+		{
+			LARGE_INTEGER start, end;
+			QueryPerformanceCounter(&start);
+			funcs[k](&source[0],&(*outputs[k])[0],pixels);
+			QueryPerformanceCounter(&end);
+			ns[k] = 1e9f*(end.QuadPart-start.QuadPart)/(float)freq.QuadPart/pixels;
+		}
+		bool same = memcmp(&reference[0],&result[0],pixels*sizeof(DWORD))==0;
+		Ar.Logf(TEXT("%s: %.2f ns/pixel scalar, %.2f ns/pixel %s; %s."),names[f],ns[0],ns[1],selected[f]==scalar[f] ? TEXT("scalar") : TEXT("SIMD"),
+			same ? TEXT("results match") : TEXT("RESULTS DIFFER"));
+	}
+
+	//P8, through a random lookup table
+	std::vector<BYTE> indices(pixels);
+	DWORD lut[256];
+	unsigned int seed = 54321;
+	for(int i=0;i<256;i++)
+	{
+		seed = seed*1664525+1013904223;
+		lut[i] = seed;
+	}
+	for(int i=0;i<pixels;i++)
+	{
+		seed = seed*1664525+1013904223;
+		indices[i] = (BYTE)(seed>>24);
+	}
+	PaletteExpansionFunc paletteFuncs[3] = {&expandPalettedScalar,&expandPalettedSSE2,&expandPalettedAVX2};
+	int numPaletteFuncs = expandPaletted==&expandPalettedAVX2 ? 3 : 2; //AVX2 is only picked if the CPU and OS support it
+	float ns[3];
+	bool same = true;
+	for(int k=0;k<numPaletteFuncs;k++)
+	{
+		std::vector<DWORD> &output = k==0 ? reference : result;
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		paletteFuncs[k](lut,&indices[0],&output[0],pixels);
+		QueryPerformanceCounter(&end);
+		ns[k] = 1e9f*(end.QuadPart-start.QuadPart)/(float)freq.QuadPart/pixels;
+		if(k>0)
+			same = same && memcmp(&reference[0],&result[0],pixels*sizeof(DWORD))==0;
+	}
+	if(numPaletteFuncs==3)
+		Ar.Logf(TEXT("P8: %.2f ns/pixel scalar, %.2f ns/pixel SSE2 stores, %.2f ns/pixel AVX2; %s."),ns[0],ns[1],ns[2],same ? TEXT("results match") : TEXT("RESULTS DIFFER"));
+	else
+		Ar.Logf(TEXT("P8: %.2f ns/pixel scalar, %.2f ns/pixel SSE2 stores, no AVX2; %s."),ns[0],ns[1],same ? TEXT("results match") : TEXT("RESULTS DIFFER"));
+}
+//@}
+
+/**@name Mip generation
+Each generated mip is a 2x2 box filter of the one above, with rounding. SSE2 does four destination pixels at a time: the eight source pixels of two rows
+are widened to 16 bits, summed in pairs and narrowed again. Odd sizes drop the last row or column, single pixel dimensions repeat.
+*/
+//@{
+
+typedef void (*DownsampleFunc)(const DWORD *row0, const DWORD *row1, DWORD *dest, UINT width, UINT sourceWidth);
+
+static void downsampleRowScalar(const DWORD *row0, const DWORD *row1, DWORD *dest, UINT width, UINT sourceWidth)
+{
+	for(UINT x=0;x<width;x++)
+	{
+		UINT x0 = min(2*x,sourceWidth-1), x1 = min(2*x+1,sourceWidth-1);
+		DWORD p[4] = {row0[x0],row0[x1],row1[x0],row1[x1]};
+		DWORD result = 0;
+		for(int c=0;c<32;c+=8)
+		{
+			DWORD sum = ((p[0]>>c)&0xFF)+((p[1]>>c)&0xFF)+((p[2]>>c)&0xFF)+((p[3]>>c)&0xFF);
+			result |= ((sum+2)>>2)<<c;
+		}
+		dest[x] = result;
+	}
+}
+
+/**
+Box filter two source pixels of each row into a destination pixel, for two destination pixels; in 16 bit lanes.
+*/
+static inline __m128i downsampleTwoSSE2(__m128i a, __m128i b, __m128i zero)
+{
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a,zero),_mm_unpacklo_epi8(b,zero)); //Source pixels 0 and 1, both rows added
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a,zero),_mm_unpackhi_epi8(b,zero)); //Source pixels 2 and 3
+	lo = _mm_add_epi16(lo,_mm_srli_si128(lo,8));
+	hi = _mm_add_epi16(hi,_mm_srli_si128(hi,8));
+	return _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo,hi),_mm_set1_epi16(2)),2);
+}
+
+static void downsampleRowSSE2(const DWORD *row0, const DWORD *row1, DWORD *dest, UINT width, UINT sourceWidth)
+{
+	const __m128i zero = _mm_setzero_si128();
+	UINT x=0;
+	if(sourceWidth>1)
+	{
+		for(;x+4<=width;x+=4)
+		{
+			__m128i first = downsampleTwoSSE2(_mm_loadu_si128((const __m128i*)(row0+2*x)),_mm_loadu_si128((const __m128i*)(row1+2*x)),zero);
+			__m128i second = downsampleTwoSSE2(_mm_loadu_si128((const __m128i*)(row0+2*x+4)),_mm_loadu_si128((const __m128i*)(row1+2*x+4)),zero);
+			_mm_storeu_si128((__m128i*)(dest+x),_mm_packus_epi16(first,second));
+		}
+	}
+	downsampleRowScalar(row0+2*x,row1+2*x,dest+x,width-x,sourceWidth-2*x);
+}
+
+static DownsampleFunc selectDownsample()
+{
+	int info[4];
+	__cpuid(info,1);
+	return (info[3] & (1<<26)) ? &downsampleRowSSE2 : &downsampleRowScalar;
+}
+
+static const DownsampleFunc downsampleRow = selectDownsample();
+
+/**
+Mips in a full chain for a texture size, down to 1x1; at most MAX_MIPS.
+*/
+UINT TexConverter::countMips(UINT width, UINT height)
+{
+	UINT mips = 1;
+	for(UINT size=max(width,height);size>1;size>>=1)
+		mips++;
+	return min(mips,(UINT)MAX_MIPS);
+}
+
+/**
+Generate mips supplied..desc.MipLevels-1 with a downsampling function; see TexConverter::buildMips().
+*/
+static bool buildMipsWith(DownsampleFunc downsample, const D3D10_TEXTURE2D_DESC &desc, UINT supplied, D3D10_SUBRESOURCE_DATA *data)
+{
+	for(UINT i=supplied;i<desc.MipLevels;i++)
+	{
+		UINT width = max(desc.Width>>i,1u), height = max(desc.Height>>i,1u);
+		UINT sourceWidth = max(desc.Width>>(i-1),1u), sourceHeight = max(desc.Height>>(i-1),1u);
+		DWORD *dest = new (std::nothrow) DWORD[width*height];
+		if(dest==nullptr)
+		{
+			UD3D10RenderDevice::debugs("Convert: Error allocating generated mip memory.");
+			for(UINT j=supplied;j<i;j++)
+				delete [] data[j].pSysMem;
+			return false;
+		}
+		const BYTE *source = (const BYTE*)data[i-1].pSysMem;
+		for(UINT y=0;y<height;y++)
+		{
+			const DWORD *row0 = (const DWORD*)(source+min(2*y,sourceHeight-1)*data[i-1].SysMemPitch);
+			const DWORD *row1 = (const DWORD*)(source+min(2*y+1,sourceHeight-1)*data[i-1].SysMemPitch);
+			downsample(row0,row1,dest+y*width,width,sourceWidth);
+		}
+		data[i].pSysMem = dest;
+		data[i].SysMemPitch = width*4;
+		data[i].SysMemSlicePitch = 0;
+	}
+	return true;
+}
+
+/**
+Fill in the mips the game didn't supply by box filtering each from the one above.
+\param desc Texture description with the full number of mips.
+\param supplied Mips already converted; the rest are generated from the last of these.
+\param data R8G8B8A8 data per mip; generated ones are allocated here and must be freed by the caller.
+\return false if memory ran out; no mips are generated then.
+*/
+bool TexConverter::buildMips(const D3D10_TEXTURE2D_DESC &desc, UINT supplied, D3D10_SUBRESOURCE_DATA *data)
+{
+	return buildMipsWith(downsampleRow,desc,supplied,data);
+}
+
+/**
+Time generating a full mip chain for a square texture with the SSE2 and scalar filters, and check they agree. For the D3D10ConvertBench command.
+*/
+void TexConverter::benchmarkMipGeneration(FOutputDevice &Ar, int size)
+{
+	//Pixels from a fixed seed so runs are comparable
+	std::vector<DWORD> top(size*size);
+	unsigned int seed = 12345;
+	for(size_t i=0;i<top.size();i++)
+	{
+		seed = seed*1664525+1013904223;
+		top[i] = seed;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	D3D10_TEXTURE2D_DESC desc;
+	desc.Width = desc.Height = size;
+	desc.MipLevels = countMips(size,size);
+	DownsampleFunc funcs[2] = {&downsampleRowScalar,downsampleRow};
+	D3D10_SUBRESOURCE_DATA chains[2][MAX_MIPS];
+	bool built[2];
+	float ms[2];
+	for(int k=0;k<2;k++)
+	{
+		chains[k][0].pSysMem = &top[0];
+		chains[k][0].SysMemPitch = size*4;
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		built[k] = buildMipsWith(funcs[k],desc,1,chains[k]);
+		QueryPerformanceCounter(&end);
+		ms[k] = 1000.0f*(end.QuadPart-start.QuadPart)/(float)freq.QuadPart;
+	}
+
+	bool same = built[0] && built[1];
+	for(UINT i=1;i<desc.MipLevels && same;i++)
+		same = memcmp(chains[0][i].pSysMem,chains[1][i].pSysMem,chains[0][i].SysMemPitch*max(desc.Height>>i,1u))==0;
+	for(int k=0;k<2;k++)
+	{
+		for(UINT i=1;i<desc.MipLevels && built[k];i++)
+			delete [] chains[k][i].pSysMem;
+	}
+	Ar.Logf(TEXT("Mips for %ix%i: %.3f ms scalar, %.3f ms %s; %s."),size,size,ms[0],ms[1],downsampleRow==&downsampleRowScalar ? TEXT("scalar") : TEXT("SSE2"),
+		same ? TEXT("results match") : TEXT("RESULTS DIFFER"));
+}
+//@}
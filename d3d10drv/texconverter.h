@@ -3,6 +3,9 @@
 */
 
 #pragma once
+#include <unordered_map>
+#include "workerpool.h"
+#include "disktexturecache.h"
 #include "texturecache.h"
 #include "d3d10drv.h"
 
@@ -10,6 +13,17 @@ class TexConverter
 {
 private:
 	TextureCache *textureCache;
+	WorkerPool *workers; /**< Converts static textures in the background; NULL to convert everything right away */
+	WorkerPool *compressHelpers; /**< Workers that help block compress textures converted right away; NULL to compress on the calling thread only */
+	DiskTextureCache *diskCache; /**< Converted textures from earlier runs; NULL if not used */
+	int compressThreads; /**< Threads to block compress static textures on when converting right away; 0 if textures aren't compressed */
+	bool directRGB16; /**< The device has B5G6R5, so RGB16 textures can be assigned as they are */
+	bool generateMips; /**< Complete the mip chains of textures that come with too few */
+	size_t realtimeUploadCap; /**< Bytes of realtime texture updates per frame, see update(); 0 for no cap */
+
+	class ConversionJob;
+	std::unordered_map<DWORD64,unsigned int> pendingTextures; /**< Textures drawn with a placeholder while a worker converts them, with the ticket of the job that will replace it */
+	unsigned int nextTicket;
 
 	/**
 	Format for a texture, tells the conversion functions if data should be allocated, block sizes taken into account, etc
@@ -19,23 +33,45 @@ private:
 		bool supported; /**< Is format supported by us */
 		char blocksize; /**< Block size (in one dimension) in bytes for compressed textures */
 		char pixelsPerBlock; /**< Pixels each block of a compressed texture encodes */
+		char bytesPerPixel; /**< Pixel size of uncompressed D3D formats */
 		bool directAssign; /**< No conversion and temporary storage needed */
 		DXGI_FORMAT d3dFormat; /**< D3D format to use when creating texture */
 		void (*conversionFunc)(const FTextureInfo&, DWORD, void *, int);	/**< Conversion function to use if no direct assignment possible */
 	};
 	static TexConverter::TextureFormat formats[];
+	static const TexConverter::TextureFormat formatPalettedGPU; /**< P8 textures uploaded as indices, looked up in the shader */
+	static const TexConverter::TextureFormat formatRGB16Direct; /**< RGB16 textures assigned as B5G6R5 */
 
 	/**@name Format conversion functions */
 	//@{
 	static void fromPaletted(const FTextureInfo& Info,DWORD PolyFlags,void *target, int mipLevel);
 	static void fromBGRA7(const FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel);
+	static void fromRGB16(const FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel);
+	static void fromRGB8(const FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel);
 	//@}
 
 	static void convertMip(const FTextureInfo& Info,const TextureFormat &format, DWORD PolyFlags,int mipLevel, D3D10_SUBRESOURCE_DATA &data);
+	static DXGI_FORMAT chooseCompressedFormat(const FTextureInfo& Info, DWORD PolyFlags, const TextureFormat &format, const D3D10_TEXTURE2D_DESC &desc);
+	static bool compressMips(const D3D10_TEXTURE2D_DESC &desc, D3D10_SUBRESOURCE_DATA *data, UINT firstOwned, WorkerPool *helpers, int threads);
+	static UINT countMips(UINT width, UINT height);
+	static bool buildMips(const D3D10_TEXTURE2D_DESC &desc, UINT supplied, D3D10_SUBRESOURCE_DATA *data);
+	static UINT hashRows(const FTextureInfo& Info, bool includePalette, std::vector<QWORD> &hashes);
+	static bool findChangedRows(const std::vector<QWORD> &last, const std::vector<QWORD> &hashes, UINT rows, UINT &firstRow, UINT &numRows);
 	static TextureCache::TextureMetaData buildMetaData(const FTextureInfo& Info, DWORD PolyFlags,DWORD customPolyFlags=0);
+	int cachePalette(const FTextureInfo &Info, bool update) const;
+	static ULONGLONG hashTexture(const FTextureInfo& Info, DWORD PolyFlags, const D3D10_TEXTURE2D_DESC &desc);
+	static ID3D10Texture2D *createFromDiskCache(DiskTextureCache *diskCache, const TextureCache *textureCache, ULONGLONG hash, const D3D10_TEXTURE2D_DESC &desc, bool countUpload, size_t &uploadBytes);
+	bool convertAsync(const FTextureInfo& Info, DWORD PolyFlags, const TextureFormat &format, const TextureCache::TextureMetaData &metadata, const D3D10_TEXTURE2D_DESC &desc);
 	
 public:
-	TexConverter(TextureCache *textureCache);
-	void convertAndCache(FTextureInfo& Info, DWORD PolyFlags) const;
-	void update(FTextureInfo& Info,DWORD PolyFlags) const;
+	TexConverter(TextureCache *textureCache, WorkerPool *workers, WorkerPool *compressHelpers, DiskTextureCache *diskCache, int compressThreads, bool generateMips, size_t realtimeUploadCap);
+	static size_t getMipDataSize(const FTextureInfo& Info, int mipLevel);
+	static QWORD fingerprint(const FTextureInfo& Info, bool includePalette);
+	void convertAndCache(FTextureInfo& Info, DWORD PolyFlags, bool allowPaletted=true);
+	void publishFinished();
+	void cancelPending();
+	bool update(FTextureInfo& Info,DWORD PolyFlags,TextureCache::TextureHandle texture) const;
+	bool updatePalette(const FTextureInfo& Info) const;
+	static void benchmarkExpansion(FOutputDevice &Ar, int pixels);
+	static void benchmarkMipGeneration(FOutputDevice &Ar, int size);
 };
\ No newline at end of file
@@ -2,6 +2,8 @@
 Cache for game textures; also handles the external extra textures.
 */
 
+#include <vector>
+#include <algorithm>
 #include "texturecache.h"
 #include "d3d10drv.h"
 
@@ -10,17 +12,61 @@ Cache for game textures; also handles the external extra textures.
 const TextureCache::ExternalTexture TextureCache::externalTextures[TextureCache::DUMMY_NUM_EXTERNAL_TEXTURES] = {{".detail",1},{".bump",0},{".height",0}};
 
 
-TextureCache::TextureCache(ID3D10Device *device)
+/**
+\param GPUPalettes Create the palette texture so P8 textures can be kept paletted; see TexConverter::formatPalettedGPU.
+\param budget Bytes of textures to keep, 0 for no limit.
+*/
+TextureCache::TextureCache(ID3D10Device *device, bool GPUPalettes, size_t budget): bucketsFilled(0), budget(budget), totalBytes(0), frame(1), evictionFailedFrame(0), generation(0), reclaimFrame(0), paletteTexture(nullptr), paletteView(nullptr), boundPaletteRow(-1)
 {
 	this->device = device;
+	for(int i=0;i<DUMMY_NUM_TEXTURE_PASSES;i++)
+	{
+		texturePasses.boundTextureID[i]=0;
+		texturePasses.boundTexture[i]=nullptr;
+		texturePasses.boundVersion[i]=0;
+		texturePasses.lastHit[i]=nullptr;
+	}
+	rehash(MIN_BUCKETS);
+
+	if(!GPUPalettes)
+		return;
+
+	D3D10_TEXTURE2D_DESC desc;
+	desc.Width = 256;
+	desc.Height = PALETTE_ROWS;
+	desc.MipLevels = 1;
+	desc.ArraySize = 1;
+	desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+	desc.SampleDesc.Count = 1;
+	desc.SampleDesc.Quality = 0;
+	desc.Usage = D3D10_USAGE_DEFAULT;
+	desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
+	desc.CPUAccessFlags = 0;
+	desc.MiscFlags = 0;
+	if(FAILED(device->CreateTexture2D(&desc,nullptr,&paletteTexture)) || FAILED(device->CreateShaderResourceView(paletteTexture,nullptr,&paletteView)))
+	{
+		UD3D10RenderDevice::debugs("Error creating palette texture, paletted textures will be expanded.");
+		SAFE_RELEASE(paletteTexture);
+		paletteView = nullptr;
+		return;
+	}
+	Shader_Unreal::setPaletteTexture(paletteView);
+}
+
+TextureCache::~TextureCache()
+{
+	SAFE_RELEASE(paletteView);
+	SAFE_RELEASE(paletteTexture);
 }
 
 /**
 Create a texture from a descriptor and data to fill it with.
 \param desc Direct3D texture description.
 \param data Data to fill the texture with.
+\param countUpload Add the upload to D3D::stats; worker threads pass false and leave counting to the game thread.
+\note Safe to call from worker threads.
 */
-ID3D10Texture2D *TextureCache::createTexture(const D3D10_TEXTURE2D_DESC &desc,const D3D10_SUBRESOURCE_DATA &data) const
+ID3D10Texture2D *TextureCache::createTexture(const D3D10_TEXTURE2D_DESC &desc,const D3D10_SUBRESOURCE_DATA &data,bool countUpload) const
 {
 	//Creates a texture, setting the TextureInfo's data member.
 	HRESULT hr;	
@@ -32,45 +78,200 @@ ID3D10Texture2D *TextureCache::createTexture(const D3D10_TEXTURE2D_DESC &desc,co
 		UD3D10RenderDevice::debugs("Error creating texture resource.");
 		return nullptr;
 	}
+
+	if(countUpload)
+		D3D::stats.textureBytes += getUploadSize(desc,data);
 	return texture;
 }
 
+/**
+Bytes of initial data a texture is created with.
+\param data Initial data for each mip.
+*/
+size_t TextureCache::getUploadSize(const D3D10_TEXTURE2D_DESC &desc, const D3D10_SUBRESOURCE_DATA &data)
+{
+	size_t bytes=0;
+	for(UINT i=0;i<desc.MipLevels;i++)
+	{
+		bytes += (&data)[i].SysMemPitch*getMipRows(desc,i);
+	}
+	return bytes;
+}
+
+/**
+Rows of initial data of a mip; for compressed formats these are rows of blocks.
+*/
+UINT TextureCache::getMipRows(const D3D10_TEXTURE2D_DESC &desc, UINT mip)
+{
+	UINT rows = max(desc.Height>>mip,1);
+	if(desc.Format>=DXGI_FORMAT_BC1_TYPELESS && desc.Format<=DXGI_FORMAT_BC5_SNORM)
+		rows = (rows+3)/4;
+	return rows;
+}
+
+/**
+Returns true if the device can create and sample textures of a format; not all are required for D3D10 (B5G6R5 for one).
+*/
+bool TextureCache::supportsFormat(DXGI_FORMAT format) const
+{
+	UINT support;
+	if(FAILED(device->CheckFormatSupport(format,&support)))
+		return false;
+	return (support & (D3D10_FORMAT_SUPPORT_TEXTURE2D|D3D10_FORMAT_SUPPORT_SHADER_SAMPLE))==(D3D10_FORMAT_SUPPORT_TEXTURE2D|D3D10_FORMAT_SUPPORT_SHADER_SAMPLE);
+}
+
 /**
 Update a single texture mip using a copy operation.
-\param id CacheID to insert texture with.
+Realtime textures (water, fire) change mid-frame while geometry using them is buffered or recorded. Rather than drawing that geometry first and writing
+the texture it's bound to, updates go to the next of a ring of copies, and the texture's version is increased. Buffered geometry keeps the view that was
+bound with it and recorded commands bind the version they were recorded with, so only geometry using the copy about to be reused must be drawn first.
+Single mip dynamic textures and ones whose mips the GPU generates get copies; others are updated in place.
+\param Info Texture; its CacheID must be cached.
 \param mipNum Mip level to update.
 \param data Data to write to the mip.
+\param bytesPerPixel Pixel size of the texture's format.
+\param firstRow First row that changed.
+\param numRows Rows that changed; only these are uploaded if updatesRows(), otherwise the whole mip is.
+\note Recorded commands using a version older than getOldestKeptVersion() must be flushed first.
 */
-void TextureCache::updateMip(const FTextureInfo& Info,int mipNum,const D3D10_SUBRESOURCE_DATA &data) const
+void TextureCache::updateMip(const FTextureInfo& Info,int mipNum,const D3D10_SUBRESOURCE_DATA &data,UINT bytesPerPixel,UINT firstRow,UINT numRows)
 {
-	//If texture is currently bound, draw buffers before updating
+	CachedTexture &entry = *find(Info.CacheID);
+	unsigned int version = entry.metadata.version+1;
+	int slot = -1;
+	if(entry.versioned && prepareCopy(entry,version%REALTIME_COPIES))
+		slot = version%REALTIME_COPIES;
+
+	//Geometry buffered with the texture that's about to be written must be drawn first
 	for(int i=0;i<TextureCache::DUMMY_NUM_TEXTURE_PASSES;i++)
 	{
-		if(texturePasses.boundTextureID[i]==Info.CacheID)
+		if(texturePasses.boundTextureID[i]==Info.CacheID && (slot<0 || texturePasses.boundVersion[i]+REALTIME_COPIES<=version))
 		{
 			D3D::render();
+			D3D::stats.realtimeFlushes++;
 			break;
 		}
 	}
 
-	//Update
-	const auto& entry = textureCache.find(Info.CacheID)->second;
-	//device->UpdateSubresource(entry.texture,mipNum,nullptr,(void*) data.pSysMem,data.SysMemPitch,data.SysMemSlicePitch);
+	ID3D10Texture2D *target = slot>=0 ? entry.copies[slot] : entry.texture;
+	ID3D10ShaderResourceView *targetView = slot>=0 ? entry.copyViews[slot] : entry.resourceView;
+	D3D10_TEXTURE2D_DESC desc;
+	target->GetDesc(&desc);
+	size_t rowBytes = Info.UClamp*bytesPerPixel>>mipNum;
+	if(desc.Usage==D3D10_USAGE_DEFAULT) //Dynamic texture with generated mips (see TexConverter::convertAndCache()); can't be mapped, but rows can be written
+	{
+		UINT mipRows = max(desc.Height>>mipNum,1u);
+		numRows = min(numRows,mipRows-min(firstRow,mipRows));
+		if(numRows<mipRows && target!=entry.texture) //The copy is some versions behind; bring it up to date before writing the rows that changed
+			device->CopyResource(target,entry.texture);
+		D3D10_BOX box = {0,firstRow,0,max(desc.Width>>mipNum,1u),firstRow+numRows,1};
+		device->UpdateSubresource(target,mipNum,&box,(const BYTE*)data.pSysMem+firstRow*data.SysMemPitch,data.SysMemPitch,0);
+		if(desc.MiscFlags & D3D10_RESOURCE_MISC_GENERATE_MIPS)
+			device->GenerateMips(targetView);
+	}
+	else
+	{
+		//device->UpdateSubresource(entry.texture,mipNum,nullptr,(void*) data.pSysMem,data.SysMemPitch,data.SysMemSlicePitch);
+
+		//UpdateSubResource leads to flickering on nvidia
+		D3D10_MAPPED_TEXTURE2D Mapping;
+		target->Map(mipNum,D3D10_MAP_WRITE_DISCARD,0,&Mapping);
+
+		unsigned char* pDst = static_cast<unsigned char*>(Mapping.pData);
+		const unsigned char* pSrc = static_cast<const unsigned char*>(data.pSysMem);
+		for (int y = 0; y < Info.VClamp; y++)
+		{
+			memcpy(pDst, pSrc, rowBytes);
+			pSrc += data.SysMemPitch;
+			pDst += Mapping.RowPitch;
+		}
+
+		target->Unmap(mipNum);
+		numRows = Info.VClamp; //Discarding means writing everything
+	}
 
-	//UpdateSubResource leads to flickering on nvidia
-	D3D10_MAPPED_TEXTURE2D Mapping;
-	entry.texture->Map(mipNum,D3D10_MAP_WRITE_DISCARD,0,&Mapping);
+	//The written copy becomes the texture
+	if(slot>=0 && target!=entry.texture)
+	{
+		SAFE_RELEASE(entry.texture);
+		SAFE_RELEASE(entry.resourceView);
+		target->AddRef();
+		targetView->AddRef();
+		entry.texture = target;
+		entry.resourceView = targetView;
+	}
+	entry.metadata.version = version;
+	D3D::stats.textureBytes += rowBytes*numRows;
+	D3D::stats.realtimeBytes += rowBytes*numRows;
+	D3D::stats.realtimeUpdates++;
+}
 
-	unsigned char* pDst = static_cast<unsigned char*>(Mapping.pData);
-	const unsigned char* pSrc = static_cast<const unsigned char*>(data.pSysMem);
-	for (int y = 0; y < Info.VClamp; y++)
+/**
+Make sure a realtime texture has a copy in a ring slot; the ring is started with the texture itself on the first update.
+\return false if the copy couldn't be created; the texture is then updated in place from now on.
+*/
+bool TextureCache::prepareCopy(CachedTexture &entry, unsigned int slot)
+{
+	if(entry.copies[slot])
+		return true;
+	unsigned int current = entry.metadata.version%REALTIME_COPIES;
+	if(entry.copies[current]==nullptr)
 	{
-		memcpy(pDst, pSrc, Info.UClamp*sizeof(DWORD)>>mipNum);
-		pSrc += data.SysMemPitch;
-		pDst += Mapping.RowPitch;
+		entry.texture->AddRef();
+		entry.resourceView->AddRef();
+		entry.copies[current] = entry.texture;
+		entry.copyViews[current] = entry.resourceView;
 	}
 
-	entry.texture->Unmap(mipNum);
+	D3D10_TEXTURE2D_DESC desc;
+	entry.texture->GetDesc(&desc);
+	if(FAILED(device->CreateTexture2D(&desc,nullptr,&entry.copies[slot])) || FAILED(device->CreateShaderResourceView(entry.copies[slot],nullptr,&entry.copyViews[slot])))
+	{
+		UD3D10RenderDevice::debugs("Error creating realtime texture copy, updating in place.");
+		SAFE_RELEASE(entry.copies[slot]);
+		entry.copyViews[slot] = nullptr;
+		entry.versioned = false;
+		return false;
+	}
+	size_t bytes = getTextureBytes(entry.copies[slot]);
+	entry.bytes += bytes;
+	totalBytes += bytes;
+	return true;
+}
+
+/**
+Oldest version of a texture that's still intact after its next update; recorded commands using an older one must be drawn before updating.
+\param texture Handle from findTexture().
+*/
+unsigned int TextureCache::getOldestKeptVersion(TextureHandle texture)
+{
+	unsigned int next = texture->metadata.version+1;
+	if(!texture->versioned)
+		return next;
+	return next>=REALTIME_COPIES ? next+1-REALTIME_COPIES : 0;
+}
+
+/**
+Returns true if updateMip() can upload just the rows that changed; mappable (dynamic usage) textures are always written whole, as textures can only be mapped with discard.
+Only realtime textures with generated mips are default usage, so with GenerateMips off this is always false.
+\param texture Handle from findTexture().
+*/
+bool TextureCache::updatesRows(TextureHandle texture)
+{
+	D3D10_TEXTURE2D_DESC desc;
+	texture->texture->GetDesc(&desc);
+	return desc.Usage==D3D10_USAGE_DEFAULT;
+}
+
+/**
+View of a version of a texture, falling back to the current one for versions no longer kept.
+\param version Version to bind; -1 for the current one.
+*/
+ID3D10ShaderResourceView *TextureCache::getView(const CachedTexture &entry, int version)
+{
+	if(version<0 || (unsigned int)version==entry.metadata.version || entry.copyViews[version%REALTIME_COPIES]==nullptr || (unsigned int)version+REALTIME_COPIES<=entry.metadata.version)
+		return entry.resourceView;
+	return entry.copyViews[version%REALTIME_COPIES];
 }
 
 /**
@@ -95,6 +296,7 @@ Create a resource view (texture usable by shader) from a filled-in texture and c
 \param metadata Texture metadata.
 \param tex A filled Direct3D texture.
 \param extraIndex Index of the extra external texture slot to use (optional)
+\note A texture already cached with the id (a placeholder, see TexConverter::convertAsync()) is replaced, keeping its generation.
 */
 void TextureCache::cacheTexture(unsigned __int64 id,const TextureMetaData &metadata, ID3D10Texture2D *tex, int extraIndex)
 {
@@ -120,8 +322,29 @@ void TextureCache::cacheTexture(unsigned __int64 id,const TextureMetaData &metad
 	//Cache texture
 	if(extraIndex==-1)
 	{
-		CachedTexture c;
+		unsigned int textureGeneration = generation;
+		TextureHandle old = find(id);
+		if(old)
+		{
+			textureGeneration = old->generation;
+			deleteTexture(id);
+		}
+
+		unsigned int slot;
+		if(!freeSlots.empty())
+		{
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else
+		{
+			slot = (unsigned int)slots.size();
+			slots.push_back(CachedTexture());
+		}
+		CachedTexture &c = slots[slot];
+		c.id = id;
 		c.metadata = metadata;
+		c.metadata.version = 0;
 		tex->AddRef();
 		c.texture = tex;
 		c.resourceView = r;
@@ -129,15 +352,39 @@ void TextureCache::cacheTexture(unsigned __int64 id,const TextureMetaData &metad
 		{
 			c.externalTextures[i]=nullptr;			
 		}
-		textureCache[id]=c;	
+		c.versioned = (desc.Usage==D3D10_USAGE_DYNAMIC && desc.MipLevels==1) || (desc.MiscFlags & D3D10_RESOURCE_MISC_GENERATE_MIPS);
+		for(unsigned int i=0;i<REALTIME_COPIES;i++)
+		{
+			c.copies[i]=nullptr;
+			c.copyViews[i]=nullptr;
+		}
+		c.rowHashes.clear();
+		c.updateDeferred = false;
+		c.bytes = getTextureBytes(tex);
+		c.lastUsedFrame = frame;
+		c.generation = textureGeneration;
+		insert(id,slot);
+		c.used = true; //Only now, as insert() may rebuild the table from the used slots
+		totalBytes += c.bytes;
 	}
 	else //add extra texture
 	{
-		CachedTexture *c = &textureCache[id];
+		CachedTexture *c = find(id);
+		if(c==nullptr)
+		{
+			SAFE_RELEASE(r);
+			return;
+		}
 		c->externalTextures[extraIndex] = r;
 		c->metadata.externalTextures[extraIndex]=true;
+		size_t bytes = getTextureBytes(tex);
+		c->bytes += bytes;
+		totalBytes += bytes;
 	}
 
+	if(budget && totalBytes>budget)
+		evict();
+
 }
 
 /**
@@ -146,7 +393,7 @@ Returns true if texture is in cache.
 */
 bool TextureCache::textureIsCached(DWORD64 id) const
 {	
-	return textureCache.find(id) != textureCache.end();
+	return find(id)!=nullptr;
 }
 
 /**
@@ -155,9 +402,101 @@ Returns texture metadata.
 */
 const TextureCache::TextureMetaData &TextureCache::getTextureMetaData(DWORD64 id) const
 {
-	return textureCache.find(id)->second.metadata;
+	return find(id)->metadata;
 }
 
+/**
+Find a texture for a pass. Surfaces mostly share their textures with the previous primitive, so the last texture found for the pass is tried before the hash table.
+\param id CacheID for texture.
+\param pass Pass the texture is for; only selects which last hit to try.
+\return Handle; NULL if texture not found.
+*/
+TextureCache::TextureHandle TextureCache::findTexture(DWORD64 id, TexturePass pass)
+{
+	TextureHandle texture = texturePasses.lastHit[pass];
+	if(texture && texture->id==id)
+	{
+		D3D::stats.textureLookupsSaved++;
+		return texture;
+	}
+	texture = find(id);
+	if(texture)
+		texturePasses.lastHit[pass] = texture;
+	return texture;
+}
+
+/**
+Returns texture metadata without binding the texture. Marks the texture as used this frame, as the caller is about to draw (or record) with it.
+\param texture Handle from findTexture().
+*/
+const TextureCache::TextureMetaData *TextureCache::useTexture(TextureHandle texture)
+{
+	texture->lastUsedFrame = frame;
+	return &texture->metadata;
+}
+
+/**
+Returns the bucket holding a CacheID, or the empty bucket that ends its probe sequence.
+Fibonacci hashing spreads CacheIDs, which differ mostly in their object index bits, over the table.
+*/
+size_t TextureCache::findBucket(DWORD64 id) const
+{
+	D3D::stats.textureLookups++;
+	size_t mask = buckets.size()-1;
+	size_t i = (size_t)((id*0x9E3779B97F4A7C15ull)>>32) & mask;
+	while(buckets[i].slot!=EMPTY_BUCKET && (buckets[i].slot==DELETED_BUCKET || buckets[i].id!=id))
+		i = (i+1) & mask;
+	return i;
+}
+
+/**
+Look a texture up in the hash table.
+\return Handle; NULL if texture not found.
+*/
+TextureCache::TextureHandle TextureCache::find(DWORD64 id) const
+{
+	const Bucket &b = buckets[findBucket(id)];
+	if(b.slot==EMPTY_BUCKET)
+		return nullptr;
+	return const_cast<TextureHandle>(&slots[b.slot]);
+}
+
+/**
+Add a CacheID to the hash table. The id must not be in it yet.
+*/
+void TextureCache::insert(DWORD64 id, unsigned int slot)
+{
+	if((bucketsFilled+1)*4>buckets.size()*3)
+	{
+		//Grow if mostly live entries, otherwise rebuilding at the same size gets rid of the tombstones
+		size_t live = slots.size()-freeSlots.size();
+		rehash(live*2>buckets.size() ? buckets.size()*2 : buckets.size());
+	}
+	size_t mask = buckets.size()-1;
+	size_t i = (size_t)((id*0x9E3779B97F4A7C15ull)>>32) & mask;
+	while(buckets[i].slot!=EMPTY_BUCKET && buckets[i].slot!=DELETED_BUCKET)
+		i = (i+1) & mask;
+	if(buckets[i].slot==EMPTY_BUCKET)
+		bucketsFilled++;
+	buckets[i].id = id;
+	buckets[i].slot = slot;
+}
+
+/**
+Rebuild the hash table from the slots.
+\param numBuckets Power of two.
+*/
+void TextureCache::rehash(size_t numBuckets)
+{
+	Bucket empty = {0,EMPTY_BUCKET};
+	buckets.assign(numBuckets,empty);
+	bucketsFilled = 0;
+	for(size_t i=0;i<slots.size();i++)
+	{
+		if(slots[i].used)
+			insert(slots[i].id,(unsigned int)i);
+	}
+}
 
 /**
 Set the texture for a texture pass (diffuse, lightmap, etc).
@@ -165,33 +504,109 @@ Texture is only set if it's not already the current one for that pass.
 Cached polygons (using the previous set of textures) are drawn before the switch is made.
 \param id CacheID for texture. NULL sets no texture for the pass (by disabling it using a shader constant).
 \param extraIndex Index of the extra external texture slot to use (optional), -1 for none.
+\param version Version of a realtime texture to bind (see updateMip()), as recorded; -1 for the current one.
 \return texture metadata so renderer can use parameters such as scale/pan; NULL is texture not found
 */
-const TextureCache::TextureMetaData *TextureCache::setTexture(const Shader_Unreal* shader,TexturePass pass,DWORD64 id, int extraIndex)
+const TextureCache::TextureMetaData *TextureCache::setTexture(const Shader_Unreal* shader,TexturePass pass,DWORD64 id, int extraIndex, int version)
 {	
-	static TextureMetaData *metadata[DUMMY_NUM_TEXTURE_PASSES]; //Cache this so it can even be returned when no texture was actually set (because same id as last time)	
-
-	if(id!=texturePasses.boundTextureID[pass]) //If different texture than previous one, draw geometry in buffer and switch to new texture
+	const CachedTexture *bound = texturePasses.boundTexture[pass];
+	bool newVersion = bound && extraIndex==-1 && (version<0 ? bound->metadata.version : (unsigned int)version)!=texturePasses.boundVersion[pass];
+	if(id!=texturePasses.boundTextureID[pass] || newVersion) //If different texture than previous one, draw geometry in buffer and switch to new texture
 	{			
 		texturePasses.boundTextureID[pass]=id;
 		
 		D3D::render();
+		D3D::stats.textureBinds++;
 
 		//Turn on and switch to new texture			
-		CachedTexture *tex;
-		if(!textureIsCached(id)) //Texture not in cache, conversion probably went wrong.
+		CachedTexture *tex = findTexture(id,pass);
+		texturePasses.boundTexture[pass] = tex;
+		if(tex==nullptr) //Texture not in cache, conversion probably went wrong.
 			return nullptr;
-		tex = &textureCache[id];
-		if(extraIndex==-1)
-			shader->setTexture(pass,tex->resourceView);
-		else
+		ID3D10ShaderResourceView *view = getView(*tex,version);
+		texturePasses.boundVersion[pass] = view==tex->resourceView ? tex->metadata.version : (unsigned int)version;
+		if(extraIndex!=-1)
 			shader->setTexture(pass,tex->externalTextures[extraIndex]);
+		else if(tex->metadata.paletteRow<0)
+			shader->setTexture(pass,view);
+
+		//Paletted textures are bound as indices; the shaders are told which to sample
+		if(pass==PASS_DIFFUSE && extraIndex==-1 && (tex->metadata.paletteRow>=0 || boundPaletteRow>=0))
+		{
+			shader->setDiffusePalette(view,tex->metadata.paletteRow);
+			boundPaletteRow = tex->metadata.paletteRow;
+		}
 			
-		metadata[pass] = &tex->metadata;
+		tex->lastUsedFrame = frame;
 		
 	}
 
-	return metadata[pass];
+	return texturePasses.boundTexture[pass] ? &texturePasses.boundTexture[pass]->metadata : nullptr;
+}
+
+/**
+Returns true if P8 textures can be kept paletted.
+*/
+bool TextureCache::usesGPUPalettes() const
+{
+	return paletteView!=nullptr;
+}
+
+/**
+Store a palette in the palette texture. A palette update costs a 1KB upload instead of reconverting the textures using it.
+\param paletteCacheID The palette's FTextureInfo::PaletteCacheID.
+\param colors 256 RGBA colors.
+\param update Upload even if the palette is already stored (for realtime palettes).
+\return Palette texture row; -1 if the palette texture is full.
+*/
+int TextureCache::cachePalette(QWORD paletteCacheID, const DWORD *colors, bool update)
+{
+	int row;
+	std::unordered_map<QWORD,std::pair<int,unsigned int>>::iterator i = paletteRows.find(paletteCacheID);
+	if(i!=paletteRows.end())
+	{
+		row = i->second.first;
+		if(!update && i->second.second==generation)
+			return row;
+		i->second.second = generation; //PaletteCacheIDs from before a level change may now belong to a different palette, so those are uploaded again once
+	}
+	else
+	{
+		if(paletteRows.size()>=PALETTE_ROWS)
+			return -1;
+		row = (int)paletteRows.size();
+		paletteRows[paletteCacheID] = std::make_pair(row,generation);
+	}
+
+	if(row==boundPaletteRow) //Draw buffered geometry with the old palette first
+		D3D::render();
+	D3D10_BOX box = {0,(UINT)row,0,256,(UINT)row+1,1};
+	device->UpdateSubresource(paletteTexture,0,&box,colors,256*sizeof(DWORD),0);
+	D3D::stats.textureBytes += 256*sizeof(DWORD);
+	return row;
+}
+
+/**
+Point a cached paletted texture to a different palette.
+\param id CacheID for texture.
+\param paletteCacheID PaletteCacheID of the palette.
+\param row Palette texture row, from cachePalette().
+*/
+void TextureCache::setTexturePalette(DWORD64 id, QWORD paletteCacheID, int row)
+{
+	TextureHandle texture = find(id);
+	if(texture==nullptr)
+		return;
+	texture->metadata.paletteRow = row;
+	texture->metadata.paletteCacheID = paletteCacheID;
+
+	//Rebind if bound, so the shaders get the new row
+	if(texturePasses.boundTextureID[PASS_DIFFUSE]==id)
+	{
+		D3D::render();
+		texturePasses.boundTextureID[PASS_DIFFUSE]=0;
+		texturePasses.boundTexture[PASS_DIFFUSE]=nullptr;
+	}
 }
 
 /**
@@ -199,18 +614,202 @@ Delete a texture (so it can be overwritten with an updated one).
 */
 void TextureCache::deleteTexture(DWORD64 id)
 {
-	std::unordered_map<DWORD64,CachedTexture>::iterator i = textureCache.find(id);
-	if(i==textureCache.end())
+	size_t bucket = findBucket(id);
+	if(buckets[bucket].slot==EMPTY_BUCKET)
 		return;
-	SAFE_RELEASE(i->second.texture);
-	SAFE_RELEASE(i->second.resourceView);
+	unsigned int slot = buckets[bucket].slot;
+	CachedTexture *tex = &slots[slot];
+
+	//Unbind, so a replacement with the same id gets bound
+	for(int j=0;j<DUMMY_NUM_TEXTURE_PASSES;j++)
+	{
+		if(texturePasses.boundTextureID[j]==id)
+		{
+			D3D::render();
+			texturePasses.boundTextureID[j]=0;
+			texturePasses.boundTexture[j]=nullptr;
+		}
+		if(texturePasses.lastHit[j]==tex)
+			texturePasses.lastHit[j]=nullptr;
+	}
+	SAFE_RELEASE(tex->texture);
+	SAFE_RELEASE(tex->resourceView);
 	
 	for(int j=0;j<DUMMY_NUM_EXTERNAL_TEXTURES;j++)
 	{
-		SAFE_RELEASE(i->second.externalTextures[j]);
+		SAFE_RELEASE(tex->externalTextures[j]);
+	}
+	for(unsigned int j=0;j<REALTIME_COPIES;j++)
+	{
+		SAFE_RELEASE(tex->copies[j]);
+		SAFE_RELEASE(tex->copyViews[j]);
+	}
+
+	totalBytes -= tex->bytes;
+	tex->used = false;
+	freeSlots.push_back(slot);
+	buckets[bucket].slot = DELETED_BUCKET;
+}
+
+/**
+Returns true if the texture is bound to a pass.
+*/
+bool TextureCache::isBound(DWORD64 id) const
+{
+	for(int i=0;i<DUMMY_NUM_TEXTURE_PASSES;i++)
+	{
+		if(texturePasses.boundTextureID[i]==id)
+			return true;
+	}
+	return false;
+}
+
+/**
+Delete least recently used textures until the cache is back under its budget, with some slack so this doesn't run for each new texture.
+Stale textures (see newGeneration()) are evicted before any current ones. Textures used this frame or still bound are kept, even if that means staying over budget. Recorded commands (see CommandList) only use textures looked up this frame, so are safe.
+*/
+void TextureCache::evict()
+{
+	if(evictionFailedFrame==frame)
+		return;
+
+	std::vector<std::pair<unsigned int,DWORD64>> candidates; //Last used frame, id
+	for(std::deque<CachedTexture>::const_iterator i=slots.begin();i!=slots.end();i++)
+	{
+		if(i->used && i->lastUsedFrame!=frame && !isBound(i->id))
+			candidates.push_back(std::make_pair(i->generation==generation?i->lastUsedFrame:0,i->id)); //Stale textures go first
+	}
+	std::sort(candidates.begin(),candidates.end());
+
+	size_t target = budget/10*9;
+	for(std::vector<std::pair<unsigned int,DWORD64>>::const_iterator i=candidates.begin();i!=candidates.end() && totalBytes>target;i++)
+	{
+		deleteTexture(i->second);
+		D3D::stats.textureEvictions++;
+	}
+	if(totalBytes>budget)
+		evictionFailedFrame = frame;
+}
+
+/**
+Video memory size of a texture.
+*/
+size_t TextureCache::getTextureBytes(ID3D10Resource *resource)
+{
+	ID3D10Texture2D *tex;
+	if(FAILED(resource->QueryInterface(__uuidof(ID3D10Texture2D),(void**)&tex)))
+		return 0;
+	D3D10_TEXTURE2D_DESC desc;
+	tex->GetDesc(&desc);
+	tex->Release();
+
+	size_t bytes=0;
+	for(UINT i=0;i<desc.MipLevels;i++)
+	{
+		UINT width = max(desc.Width>>i,1);
+		UINT rowBytes;
+		switch(desc.Format)
+		{
+		case DXGI_FORMAT_BC1_TYPELESS:
+		case DXGI_FORMAT_BC1_UNORM:
+		case DXGI_FORMAT_BC1_UNORM_SRGB:
+		case DXGI_FORMAT_BC4_TYPELESS:
+		case DXGI_FORMAT_BC4_UNORM:
+		case DXGI_FORMAT_BC4_SNORM:
+			rowBytes = (width+3)/4*8;
+			break;
+		case DXGI_FORMAT_BC2_TYPELESS:
+		case DXGI_FORMAT_BC2_UNORM:
+		case DXGI_FORMAT_BC2_UNORM_SRGB:
+		case DXGI_FORMAT_BC3_TYPELESS:
+		case DXGI_FORMAT_BC3_UNORM:
+		case DXGI_FORMAT_BC3_UNORM_SRGB:
+		case DXGI_FORMAT_BC5_TYPELESS:
+		case DXGI_FORMAT_BC5_UNORM:
+		case DXGI_FORMAT_BC5_SNORM:
+			rowBytes = (width+3)/4*16;
+			break;
+		case DXGI_FORMAT_R8_UINT:
+			rowBytes = width;
+			break;
+		case DXGI_FORMAT_B5G6R5_UNORM:
+			rowBytes = width*2;
+			break;
+		default:
+			rowBytes = width*4;
+		}
+		bytes += rowBytes*getMipRows(desc,i);
 	}
+	return bytes;
+}
 
-	textureCache.erase(i);
+/**
+Start a new frame for the least recently used tracking.
+*/
+void TextureCache::newFrame()
+{
+	frame++;
+	if(reclaimFrame && frame>=reclaimFrame)
+		reclaimStale();
+	if(budget && totalBytes>budget)
+		evict();
+}
+
+/**
+Start a new cache generation; used instead of flush() when the game flushes for a level change.
+CacheIDs are derived from object indices, so after loading a level an id may stand for a different texture. Rather than deleting everything, textures are
+marked stale: when one is used again, the renderer checks its fingerprint (see TexConverter::fingerprint()) and either revalidates it or converts it again.
+Stale textures that aren't used again are deleted a while later, see reclaimStale(), or earlier by the budget.
+*/
+void TextureCache::newGeneration()
+{
+	generation++;
+	reclaimFrame = frame+STALE_RECLAIM_FRAMES;
+}
+
+/**
+Returns true if the texture is from an older generation, so its fingerprint should be checked before use.
+\param texture Handle from findTexture().
+*/
+bool TextureCache::isStale(TextureHandle texture) const
+{
+	return texture->generation!=generation;
+}
+
+/**
+Move a stale texture to the current generation after its fingerprint matched.
+\param texture Handle from findTexture().
+*/
+void TextureCache::revalidate(TextureHandle texture)
+{
+	texture->generation = generation;
+}
+
+/**
+Delete stale textures that weren't used since the level change. Bound ones are skipped; they're picked up by eviction later.
+*/
+void TextureCache::reclaimStale()
+{
+	reclaimFrame = 0;
+	std::vector<DWORD64> stale;
+	for(std::deque<CachedTexture>::const_iterator i=slots.begin();i!=slots.end();i++)
+	{
+		if(i->used && i->generation!=generation && !isBound(i->id))
+			stale.push_back(i->id);
+	}
+	for(std::vector<DWORD64>::const_iterator i=stale.begin();i!=stale.end();i++)
+	{
+		deleteTexture(*i);
+		D3D::stats.texturesReclaimed++;
+	}
+}
+
+/**
+Returns the bytes of video memory used by cached textures.
+*/
+size_t TextureCache::getTotalBytes() const
+{
+	return totalBytes;
 }
 
 /**
@@ -222,25 +821,39 @@ void TextureCache::flush()
 	for(int i=0;i<DUMMY_NUM_TEXTURE_PASSES;i++)
 	{
 		texturePasses.boundTextureID[i]=0;
+		texturePasses.boundTexture[i]=nullptr;
+		texturePasses.lastHit[i]=nullptr;
 	}
 
 	//Delete textures
-	for(std::unordered_map<DWORD64,CachedTexture>::iterator i=textureCache.begin();i!=textureCache.end();i++)
+	for(std::deque<CachedTexture>::iterator i=slots.begin();i!=slots.end();i++)
 	{	
-		while(i->second.resourceView)
+		if(!i->used)
+			continue;
+		while(i->resourceView)
 		{
-			SAFE_RELEASE(i->second.resourceView);
+			SAFE_RELEASE(i->resourceView);
 		}
 
-		while(i->second.texture)
+		while(i->texture)
 		{
-			SAFE_RELEASE(i->second.texture);
+			SAFE_RELEASE(i->texture);
 		}
 		
 		for(int j=0;j<DUMMY_NUM_EXTERNAL_TEXTURES;j++)
 		{
-			SAFE_RELEASE(i->second.externalTextures[j]);
+			SAFE_RELEASE(i->externalTextures[j]);
+		}
+		for(unsigned int j=0;j<REALTIME_COPIES;j++)
+		{
+			SAFE_RELEASE(i->copies[j]);
+			SAFE_RELEASE(i->copyViews[j]);
 		}
 	}
-	textureCache.clear();
+	slots.clear();
+	freeSlots.clear();
+	rehash(MIN_BUCKETS);
+	paletteRows.clear(); //boundPaletteRow stays, it's what the shaders still have set
+	totalBytes = 0;
+	reclaimFrame = 0;
 }
\ No newline at end of file
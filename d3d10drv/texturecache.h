@@ -5,6 +5,8 @@ class TextureCache;
 #include <d3d10.h>
 #include <d3dx10.h>
 #include <unordered_map>
+#include <vector>
+#include <deque>
 #include "shader_unreal.h"
 
 
@@ -22,6 +24,8 @@ public:
 	External textures: textures that don't replace another texture, but are extra bumpmaps, detail textures etc.
 	*/
 	enum ExternalTextures{EXTRA_TEX_DETAIL,EXTRA_TEX_BUMP,EXTRA_TEX_HEIGHT,DUMMY_NUM_EXTERNAL_TEXTURES};
+
+	static const unsigned int REALTIME_COPIES = 3; /**< Versions of a realtime texture kept at once: the current one and two that buffered or recorded geometry may still use */
 	
 	struct ExternalTexture
 	{
@@ -42,17 +46,37 @@ public:
 		bool masked; /**< Tracked to fix masking issues, see UD3D10RenderDevice::PrecacheTexture */
 		bool externalTextures[DUMMY_NUM_EXTERNAL_TEXTURES]; /**< Which extra texture slots are used */
 		DWORD customPolyFlags; /**< To allow override textures to have their own polyflags set in a file */
+		int paletteRow; /**< Palette texture row for textures stored as R8_UINT indices (GPUPalettes option); -1 for regular textures */
+		QWORD paletteCacheID; /**< PaletteCacheID of the palette in paletteRow */
+		QWORD fingerprint; /**< See TexConverter::fingerprint(); checked when a texture from before a level change is used again */
+		unsigned int version; /**< Realtime updates so far, see updateMip(); recorded commands bind the version they were recorded with */
 	};
 
 	/** Cached, API format texture */
 	struct CachedTexture
 	{
+		DWORD64 id; /**< CacheID */
+		bool used; /**< False for free slots, see TextureCache::freeSlots */
 		TextureMetaData metadata;
 		ID3D10ShaderResourceView* resourceView;
 		ID3D10Texture2D* texture;
 		ID3D10ShaderResourceView* externalTextures[DUMMY_NUM_EXTERNAL_TEXTURES]; /**< Extra detail/bump textures which can be used even if the game doesn't offer any, see texconversion.cpp */
+		size_t bytes; /**< Video memory taken by the texture and its external textures, for the budget */
+		unsigned int lastUsedFrame; /**< Frame the texture was last bound or looked up for drawing, for eviction */
+		unsigned int generation; /**< Cache generation the texture was created or last revalidated in; older ones are stale */
+		bool versioned; /**< Realtime texture that can be updated into a copy, see updateMip() */
+		ID3D10Texture2D *copies[REALTIME_COPIES]; /**< Copy holding each version modulo REALTIME_COPIES; empty until the first update. texture is one of these */
+		ID3D10ShaderResourceView *copyViews[REALTIME_COPIES];
+		std::vector<QWORD> rowHashes; /**< Hashes of the source rows (and palette) of the last realtime upload, see TexConverter::update(); empty until the first one */
+		bool updateDeferred; /**< A realtime update was put off by the per-frame upload cap; it's made the next time the texture is used */
 	};
 
+	/**
+	Handle to a cached texture, from findTexture(). Lets a texture be looked up once and then checked, updated and bound without hashing its CacheID again.
+	\note Stays valid until the texture is deleted; textures used this frame aren't evicted, so handles of textures found for drawing last the frame.
+	*/
+	typedef CachedTexture *TextureHandle;
+
 
 private:
 	/**
@@ -61,27 +85,108 @@ private:
 	struct
 	{
 		DWORD64 boundTextureID[DUMMY_NUM_TEXTURE_PASSES]; /**< CPU side bound texture IDs for the various passes as defined in the shader */
+		TextureHandle boundTexture[DUMMY_NUM_TEXTURE_PASSES]; /**< Texture for boundTextureID; NULL if it wasn't cached */
+		unsigned int boundVersion[DUMMY_NUM_TEXTURE_PASSES]; /**< Version of the bound texture; an updated texture is bound again */
+		TextureHandle lastHit[DUMMY_NUM_TEXTURE_PASSES]; /**< Last texture found for each pass by findTexture(), checked before the hash table */
 	} texturePasses;
 
-
-	std::unordered_map <unsigned __int64, CachedTexture> textureCache; /**< The actual cache */
+	/**@name The actual cache
+	Textures live in slots that never move, so handles and metadata pointers stay valid while other textures come and go.
+	They're found through an open addressing hash table (linear probing) of CacheIDs and slot numbers, which keeps a lookup to a cache line or two
+	instead of following std::unordered_map's node chains.
+	*/
+	//@{
+	struct Bucket
+	{
+		DWORD64 id;
+		unsigned int slot; /**< Index in slots; EMPTY_BUCKET or DELETED_BUCKET if none */
+	};
+	static const unsigned int EMPTY_BUCKET = 0xFFFFFFFF;
+	static const unsigned int DELETED_BUCKET = 0xFFFFFFFE; /**< Tombstone, so probing continues past removed entries */
+	static const unsigned int MIN_BUCKETS = 1024; /**< Power of two */
+	std::vector<Bucket> buckets; /**< Size is a power of two */
+	size_t bucketsFilled; /**< Used and deleted buckets; the table is rebuilt once these reach 3/4 */
+	std::deque<CachedTexture> slots; /**< Deque so slots don't move when it grows */
+	std::vector<unsigned int> freeSlots;
+	size_t findBucket(DWORD64 id) const;
+	TextureHandle find(DWORD64 id) const;
+	void insert(DWORD64 id, unsigned int slot);
+	void rehash(size_t numBuckets);
+	//@}
 
 
 	ID3D10Device *device;
 
+	/**@name Budget
+	Least recently used textures are evicted when the cache grows over its budget, see evict().
+	*/
+	//@{
+	size_t budget; /**< In bytes, 0 for none */
+	size_t totalBytes;
+	unsigned int frame; /**< Current frame, for CachedTexture::lastUsedFrame */
+	unsigned int evictionFailedFrame; /**< Frame in which eviction couldn't get under budget; not retried until the next frame */
+	void evict();
+	bool isBound(DWORD64 id) const;
+	static size_t getTextureBytes(ID3D10Resource *resource);
+	//@}
+
+	/**@name Generations
+	Level changes don't empty the cache but start a new generation, see newGeneration().
+	*/
+	//@{
+	static const unsigned int STALE_RECLAIM_FRAMES = 600; /**< Frames after a level change until stale textures that weren't used again are deleted */
+	unsigned int generation;
+	unsigned int reclaimFrame; /**< Frame at which stale textures are deleted; 0 if there's nothing to reclaim */
+	void reclaimStale();
+	//@}
+
+	bool prepareCopy(CachedTexture &entry, unsigned int slot);
+	static ID3D10ShaderResourceView *getView(const CachedTexture &entry, int version);
+
+	/**@name GPU palettes
+	All palettes of paletted textures live in one texture, a row each. Only palette changes need uploading, see cachePalette().
+	*/
+	//@{
+	static const int PALETTE_ROWS = 4096;
+	ID3D10Texture2D *paletteTexture;
+	ID3D10ShaderResourceView *paletteView; /**< NULL if textures aren't kept paletted */
+	std::unordered_map<QWORD,std::pair<int,unsigned int>> paletteRows; /**< Palette texture row and generation it was uploaded in, for each PaletteCacheID */
+	int boundPaletteRow; /**< Palette row set in the shaders for the bound diffuse texture */
+	//@}
+
 public:
 	/**@name Texture cache */
 	//@{
 
-	TextureCache(ID3D10Device *device);
-	ID3D10Texture2D *createTexture(const D3D10_TEXTURE2D_DESC &desc, const D3D10_SUBRESOURCE_DATA &data) const;
-	void updateMip(const FTextureInfo& Info,int mipNum, const D3D10_SUBRESOURCE_DATA &data) const;
+	TextureCache(ID3D10Device *device, bool GPUPalettes, size_t budget);
+	~TextureCache();
+	ID3D10Texture2D *createTexture(const D3D10_TEXTURE2D_DESC &desc, const D3D10_SUBRESOURCE_DATA &data, bool countUpload=true) const;
+	static size_t getUploadSize(const D3D10_TEXTURE2D_DESC &desc, const D3D10_SUBRESOURCE_DATA &data);
+	static UINT getMipRows(const D3D10_TEXTURE2D_DESC &desc, UINT mip);
+	bool supportsFormat(DXGI_FORMAT format) const;
+	void updateMip(const FTextureInfo& Info,int mipNum, const D3D10_SUBRESOURCE_DATA &data, UINT bytesPerPixel, UINT firstRow, UINT numRows);
+	static unsigned int getOldestKeptVersion(TextureHandle texture);
+	static bool updatesRows(TextureHandle texture);
 	bool loadFileTexture(TCHAR* fileName, ID3D10Texture2D **tex, D3DX10_IMAGE_LOAD_INFO *loadInfo) const;
 	void cacheTexture(unsigned __int64 id,const TextureMetaData &metadata, ID3D10Texture2D *tex,int extraIndex=-1);
 	bool textureIsCached(DWORD64 id) const;	
 	const TextureMetaData &getTextureMetaData(DWORD64 id) const;
-	const TextureMetaData *setTexture(const Shader_Unreal* shader, TexturePass pass,DWORD64 id,int extraIndex=-1);
+	TextureHandle findTexture(DWORD64 id, TexturePass pass);
+	const TextureMetaData *useTexture(TextureHandle texture);
+	const TextureMetaData *setTexture(const Shader_Unreal* shader, TexturePass pass,DWORD64 id,int extraIndex=-1,int version=-1);
 	void deleteTexture(DWORD64 id);
 	void flush();
+	void newFrame();
+	size_t getTotalBytes() const;
+	void newGeneration();
+	bool isStale(TextureHandle texture) const;
+	void revalidate(TextureHandle texture);
+	//@}
+
+	/**@name GPU palettes */
+	//@{
+	bool usesGPUPalettes() const;
+	int cachePalette(QWORD paletteCacheID, const DWORD *colors, bool update);
+	void setTexturePalette(DWORD64 id, QWORD paletteCacheID, int row);
 	//@}
 };
\ No newline at end of file
@@ -1,5 +1,5 @@
 /**
-Shader for sprites. Expands point sprites to a quad.
+Shader for sprites. Each tile is an instance of a quad; the vertex shader places its corners.
 */
 
 #include "common.fxh"
@@ -7,6 +7,7 @@ Shader for sprites. Expands point sprites to a quad.
 
 struct VS_INPUT
 {	
+	float2 corner: TEXCOORD0; //Quad corner, 0 or 1 on each axis
 	float4 XYWH : POSITION0; //In pixels: X, Y, width, height
 	float4 UVWH: POSITION1; //Texture U, V, width, height
 	float4 color: COLOR0;
@@ -14,15 +15,6 @@ struct VS_INPUT
 	uint flags: BLENDINDICES;
 };
 
-struct GS_INPUT
-{	
-	float4 XYWH: POSITION0;
-	float4 UVWH: POSITION1;
-	float4 color: COLOR0;
-	float z: PSIZE0;
-	uint flags: BLENDINDICES;
-};
-
 
 struct PS_INPUT
 {	
@@ -35,77 +27,29 @@ struct PS_INPUT
 //--------------------------------------------------------------------------------------
 // Vertex Shader
 //--------------------------------------------------------------------------------------
-GS_INPUT VS( VS_INPUT input )
+PS_INPUT VS( VS_INPUT input )
 {
-	GS_INPUT output = (GS_INPUT)input;
+	PS_INPUT output = (PS_INPUT)0;
 
 	//Scale screen coords to -1,1 ranges
-	output.XYWH.xz/=0.5*viewportWidth;
-	output.XYWH.yw/=-0.5*viewportHeight;
+	float4 XYWH = input.XYWH;
+	XYWH.xz/=0.5*viewportWidth;
+	XYWH.yw/=-0.5*viewportHeight;
 
-
-	output.color = unrealColor(input.color,input.flags);
+	output.pos.x = -1+XYWH.x+input.corner.x*XYWH.z;
+	output.pos.y =  1+XYWH.y+input.corner.y*XYWH.w;
 
 	//Perform perspective projection on Z
-	float4 projected=mul(float4(1,1,output.z,1),projection);
-	output.z = projected.z/ projected.w;
-	output.z=clamp(output.z,0,99999999); //ATI fix
-
-	return output;
-}
-
-//--------------------------------------------------------------------------------------
-// Geometry Shader
-//--------------------------------------------------------------------------------------
-[maxvertexcount(4)]
-void GS( point GS_INPUT input[1], inout TriangleStream <PS_INPUT> triStream )
-{
-	PS_INPUT output = (PS_INPUT)0;
-	
-	output.pos.z = input[0].z;
+	float4 projected=mul(float4(1,1,input.z,1),projection);
+	output.pos.z = projected.z/ projected.w;
+	output.pos.z=clamp(output.pos.z,0,99999999); //ATI fix
 	output.pos.w = 1;
-	output.color = input[0].color;
-	output.flags = input[0].flags;
 
-	
+	output.tex = input.UVWH.xy+input.corner*input.UVWH.zw;
+	output.color = unrealColor(input.color,input.flags);
+	output.flags = input.flags;
 
-	//Left right top bottom
-	float4 pos;
-	pos.x = -1+input[0].XYWH.x;
-	pos.y = pos.x +input[0].XYWH.z;
-	pos.z =  1+input[0].XYWH.y;
-	pos.w =  pos.z + input[0].XYWH.w;
-
-	//Left right top bottom
-	float4 tex;
-	tex.x = input[0].UVWH.x;
-	tex.y = tex.x + input[0].UVWH.z;	
-	tex.z = input[0].UVWH.y;
-	tex.w = tex.z + input[0].UVWH.w;
-	
-	//Left top
-	output.pos.xy = pos.xz;
-	output.tex.xy = tex.xz;
-	triStream.Append(output);
-	
-	//Left bottom
-	output.pos.xy = pos.xw;
-	output.tex.xy = tex.xw;
-	triStream.Append(output);
-
-	//Right top
-	output.pos.xy = pos.yz;
-	output.tex.xy = tex.yz;
-	output.pos.z = input[0].z;
-	triStream.Append(output);
-	
-	//Right bottom
-	output.pos.xy = pos.yw;
-	output.tex.xy = tex.yw;
-	output.pos.z = input[0].z;
-	triStream.Append(output);
-	
-	triStream.RestartStrip();
+	return output;
 }
 
 
@@ -118,8 +62,8 @@ PS_OUTPUT PS( PS_INPUT input)
 	PS_OUTPUT output;
 	 
 	output.color= input.color;	
-	float4 diffuse = texDiffuse.SampleBias(sam,input.tex,LODBIAS);
-	float4 diffusePoint = texDiffuse.SampleBias(samPoint,input.tex,LODBIAS);
+	float4 diffuse = sampleDiffuse(sam,input.tex,input.flags,false);
+	float4 diffusePoint = sampleDiffuse(samPoint,input.tex,input.flags,true);
 		
 	output.color*=diffuseTexture(diffuse,diffusePoint,input.flags);
 
@@ -134,7 +78,7 @@ technique10 Render
 	pass Standard
 	{
 		SetVertexShader( CompileShader( vs_4_0, VS() ) );
-		SetGeometryShader( CompileShader( gs_4_0, GS()) );
+		SetGeometryShader( NULL );
 		SetPixelShader( CompileShader( ps_4_0, PS() ) );
 	
 		SetRasterizerState(rstate_NoMSAA);             
@@ -0,0 +1,617 @@
+/**
+\class TraceRecorder
+Records the calls the game makes to the renderer into a binary trace file, for a number of frames.
+
+Each call is stored as a TraceRecordType byte followed by its parameters. To keep traces small, only the fields the renderer actually uses are written:
+vertex positions for complex surfaces, and position, light, fog and texture coordinates for gouraud polygons. Scene nodes are only written when they change.
+Texture payloads (mips and palette) are written once per CacheID, before the first call that uses them, and again each time a realtime texture has changed
+or the texture's palette did. After a flush, payloads are written again when next used, so a replayer doesn't have to keep textures across levels.
+Calls refer to textures by CacheID along with the per-call pan and flags.
+
+Without a file, the recorder produces a stream of records instead, taken a frame at a time; this is the command stream of the render thread (see RenderThread).
+
+\class TraceReplayer
+Feeds a trace recorded by TraceRecorder back through a render device's interface, as fast as possible.
+Textures are rebuilt into FTextureInfos; calls get a scene node with the device's own viewport, but with the recorded field of view.
+As the same scenes are drawn every time regardless of the game's state, this makes for a reproducible benchmark of the renderer.
+Replaying a stream works the same, except that the field of view isn't set on the game's actor but is available through getFovAngle(),
+and likewise the brightness and level of a flush through getFlushBrightness() and getFlushLevel(); the render thread can't read those off the game's objects.
+*/
+
+#include "trace.h"
+#include "texconverter.h"
+
+static const DWORD TRACE_MAGIC = 'TGHK';
+static const DWORD TRACE_VERSION = 3; /**< 2: payloads are written again after flushes; 3: flushes carry their state */
+
+TraceRecorder::TraceRecorder(const TCHAR *fileName, int frames): file(fileName,std::ios::binary), framesLeft(frames), started(false), haveFrame(false), frame(0)
+{
+	write(TRACE_MAGIC);
+	write(TRACE_VERSION);
+}
+
+/**
+Record a stream rather than a file; recording starts right away and goes on until the recorder is deleted.
+*/
+TraceRecorder::TraceRecorder(): framesLeft(1), started(true), haveFrame(false), frame(0)
+{
+
+}
+
+TraceRecorder::~TraceRecorder()
+{
+	writeFile();
+}
+
+bool TraceRecorder::isOpen() const
+{
+	return file.is_open() && file.good();
+}
+
+/**
+Returns true when all requested frames have been recorded, or writing failed.
+*/
+bool TraceRecorder::isDone() const
+{
+	return framesLeft<=0 || !file.good();
+}
+
+/**
+Write buffered records to the file.
+*/
+void TraceRecorder::writeFile()
+{
+	if(!file.is_open() || buffer.empty())
+		return;
+	file.write((const char*)buffer.data(),buffer.size());
+	buffer.clear();
+}
+
+/**
+Take the records made since the last call.
+\param stream Receives the records; its previous contents are discarded, but its storage is reused for the next records.
+*/
+void TraceRecorder::takeStream(std::vector<BYTE> &stream)
+{
+	stream.clear();
+	stream.swap(buffer);
+}
+
+/**
+Write the scene node if it differs from the last one written.
+*/
+void TraceRecorder::writeFrame(const FSceneNode *Frame)
+{
+	FSceneNode node;
+	memcpy(&node,Frame,sizeof(FSceneNode));
+	node.Viewport = nullptr;
+	node.Level = nullptr;
+	node.Parent = node.Sibling = node.Child = nullptr;
+	node.Span = nullptr;
+	node.Draw[0] = node.Draw[1] = node.Draw[2] = nullptr;
+	node.Sprite = nullptr;
+	FLOAT fovAngle = Frame->Viewport->Actor->FovAngle;
+
+	if(haveFrame && fovAngle==lastFovAngle && memcmp(&node,&lastFrame,sizeof(FSceneNode))==0)
+		return;
+
+	write((BYTE)TRACE_FRAME);
+	write(node);
+	write(fovAngle);
+	memcpy(&lastFrame,&node,sizeof(FSceneNode));
+	lastFovAngle = fovAngle;
+	haveFrame = true;
+}
+
+/**
+Write a texture's payload if it isn't in the trace yet or its contents changed.
+Realtime textures keep their changed flag for every call of the frame, so they're written at most once per frame.
+*/
+void TraceRecorder::writeTexture(const FTextureInfo &Info)
+{
+	std::unordered_map<QWORD,RecordedTexture>::const_iterator recorded = recordedTextures.find(Info.CacheID);
+	if(recorded!=recordedTextures.end() && recorded->second.paletteCacheID==Info.PaletteCacheID && (!(Info.TextureFlags & TF_RealtimeChanged) || recorded->second.frame==frame))
+		return;
+	RecordedTexture record = {Info.PaletteCacheID,frame};
+	recordedTextures[Info.CacheID] = record;
+
+	write((BYTE)TRACE_TEXTURE);
+	write(Info.CacheID);
+	write(Info.PaletteCacheID);
+	write((BYTE)Info.Format);
+	write(Info.UScale);
+	write(Info.VScale);
+	write(Info.USize);
+	write(Info.VSize);
+	write(Info.UClamp);
+	write(Info.VClamp);
+	write(Info.NumMips);
+	write(Info.MaxColor ? *Info.MaxColor : FColor(255,255,255,255));
+	write((BYTE)(Info.Palette!=nullptr));
+	if(Info.Palette)
+		writeBytes(Info.Palette,256*sizeof(FColor));
+	for(int i=0;i<Info.NumMips;i++)
+	{
+		size_t size = TexConverter::getMipDataSize(Info,i);
+		write(Info.Mips[i]->USize);
+		write(Info.Mips[i]->VSize);
+		write(Info.Mips[i]->UBits);
+		write(Info.Mips[i]->VBits);
+		write((DWORD)size);
+		writeBytes(Info.Mips[i]->DataPtr,size);
+	}
+}
+
+/**
+Write a reference to an already written texture, with the fields that can differ per call.
+*/
+void TraceRecorder::writeTextureRef(const FTextureInfo *Info)
+{
+	if(!Info)
+	{
+		write((QWORD)0);
+		return;
+	}
+	write(Info->CacheID);
+	write(Info->Pan);
+	write(Info->TextureFlags);
+}
+
+void TraceRecorder::recordLock(const FPlane &FlashScale, const FPlane &FlashFog, const FPlane &ScreenClear, DWORD RenderLockFlags)
+{
+	started = true;
+	frame++;
+	write((BYTE)TRACE_LOCK);
+	write(FlashScale);
+	write(FlashFog);
+	write(ScreenClear);
+	write(RenderLockFlags);
+}
+
+void TraceRecorder::recordUnlock(UBOOL Blit)
+{
+	if(!started)
+		return;
+	write((BYTE)TRACE_UNLOCK);
+	write(Blit);
+	if(!file.is_open()) //Streams don't end
+		return;
+	framesLeft--;
+	writeFile();
+	if(framesLeft<=0)
+		file.flush();
+}
+
+/**
+\param brightness The client's brightness at the flush.
+\param level The viewport's level at the flush; only its identity is recorded.
+*/
+void TraceRecorder::recordFlush(FLOAT brightness, const ULevel *level, UBOOL AllowPrecache)
+{
+	if(!started)
+		return;
+	write((BYTE)TRACE_FLUSH);
+	write(brightness);
+	write((QWORD)(size_t)level);
+	write(AllowPrecache);
+	recordedTextures.clear();
+}
+
+void TraceRecorder::recordSetSceneNode(const FSceneNode *Frame)
+{
+	if(!started)
+		return;
+	writeFrame(Frame);
+	write((BYTE)TRACE_SETSCENENODE);
+}
+
+void TraceRecorder::recordPrecacheTexture(const FTextureInfo &Info, DWORD PolyFlags)
+{
+	if(!started)
+		return;
+	writeTexture(Info);
+	write((BYTE)TRACE_PRECACHE);
+	writeTextureRef(&Info);
+	write(PolyFlags);
+}
+
+void TraceRecorder::recordComplexSurface(const FSceneNode *Frame, const FSurfaceInfo &Surface, const FSurfaceFacet &Facet)
+{
+	if(!started)
+		return;
+	const FTextureInfo *passes[] = {Surface.Texture,Surface.LightMap,Surface.MacroTexture,Surface.DetailTexture,Surface.FogMap,Surface.BumpMap};
+	writeFrame(Frame);
+	for(int i=0;i<ARRAY_COUNT(passes);i++)
+	{
+		if(passes[i])
+			writeTexture(*passes[i]);
+	}
+
+	write((BYTE)TRACE_COMPLEXSURFACE);
+	write(Surface.PolyFlags);
+	write(Surface.FlatColor);
+	for(int i=0;i<ARRAY_COUNT(passes);i++)
+		writeTextureRef(passes[i]);
+	write(Facet.MapCoords);
+	write(Facet.MapUncoords);
+
+	INT numPolys = 0;
+	for(FSavedPoly* Poly=Facet.Polys; Poly; Poly=Poly->Next)
+		numPolys++;
+	write(numPolys);
+	for(FSavedPoly* Poly=Facet.Polys; Poly; Poly=Poly->Next)
+	{
+		write(Poly->NumPts);
+		for(int i=0;i<Poly->NumPts;i++)
+			write(Poly->Pts[i]->Point);
+	}
+}
+
+void TraceRecorder::recordGouraudPolygon(const FSceneNode *Frame, const FTextureInfo &Info, FTransTexture **Pts, int NumPts, DWORD PolyFlags)
+{
+	if(!started)
+		return;
+	writeFrame(Frame);
+	writeTexture(Info);
+	write((BYTE)TRACE_GOURAUDPOLYGON);
+	writeTextureRef(&Info);
+	write(PolyFlags);
+	write(NumPts);
+	for(int i=0;i<NumPts;i++)
+	{
+		write(Pts[i]->Point);
+		write(Pts[i]->Light);
+		write(Pts[i]->Fog);
+		write(Pts[i]->U);
+		write(Pts[i]->V);
+	}
+}
+
+void TraceRecorder::recordTile(const FSceneNode *Frame, const FTextureInfo &Info, FLOAT X, FLOAT Y, FLOAT XL, FLOAT YL, FLOAT U, FLOAT V, FLOAT UL, FLOAT VL, FLOAT Z, const FPlane &Color, const FPlane &Fog, DWORD PolyFlags)
+{
+	if(!started)
+		return;
+	writeFrame(Frame);
+	writeTexture(Info);
+	write((BYTE)TRACE_TILE);
+	writeTextureRef(&Info);
+	FLOAT coords[] = {X,Y,XL,YL,U,V,UL,VL,Z};
+	write(coords);
+	write(Color);
+	write(Fog);
+	write(PolyFlags);
+}
+
+void TraceRecorder::recordClearZ(const FSceneNode *Frame)
+{
+	if(!started)
+		return;
+	writeFrame(Frame);
+	write((BYTE)TRACE_CLEARZ);
+}
+
+void TraceRecorder::recordEndFlash()
+{
+	if(!started)
+		return;
+	write((BYTE)TRACE_ENDFLASH);
+}
+
+TraceReplayer::TraceReplayer(URenderDevice *device): device(device), pos(0), fovAngle(90.0f), flushBrightness(0.5f), flushLevel(nullptr), streaming(false)
+{
+	memset(&frame,0,sizeof(FSceneNode));
+}
+
+TraceReplayer::~TraceReplayer()
+{
+	deleteTextures();
+}
+
+void TraceReplayer::deleteTextures()
+{
+	for(std::unordered_map<QWORD,Texture*>::iterator t=textures.begin();t!=textures.end();t++)
+		delete t->second;
+	textures.clear();
+}
+
+FLOAT TraceReplayer::getFovAngle() const
+{
+	return fovAngle;
+}
+
+/** Brightness of the flush being replayed */
+FLOAT TraceReplayer::getFlushBrightness() const
+{
+	return flushBrightness;
+}
+
+/** Level of the flush being replayed; only for comparing, it may be gone */
+const ULevel *TraceReplayer::getFlushLevel() const
+{
+	return flushLevel;
+}
+
+/**
+Read a whole trace into memory, so replaying isn't slowed down by file access.
+\return false if the file can't be read or isn't a trace.
+*/
+bool TraceReplayer::load(const TCHAR *fileName)
+{
+	std::ifstream file(fileName,std::ios::binary|std::ios::ate);
+	if(!file.good())
+		return false;
+	size_t size = (size_t)file.tellg();
+	if(size<2*sizeof(DWORD))
+		return false;
+	trace.resize(size);
+	file.seekg(0);
+	file.read((char*)&trace[0],size);
+	if(!file.good())
+		return false;
+
+	pos = 0;
+	if(read<DWORD>()!=TRACE_MAGIC || read<DWORD>()!=TRACE_VERSION)
+	{
+		UD3D10RenderDevice::debugs("Not a trace file or wrong version.");
+		return false;
+	}
+	return true;
+}
+
+/**
+Create or update a texture from its payload.
+*/
+void TraceReplayer::readTexture()
+{
+	QWORD id = read<QWORD>();
+	Texture *&tex = textures[id];
+	if(!tex)
+		tex = new Texture;
+
+	FTextureInfo &info = tex->info;
+	info.CacheID = id;
+	info.PaletteCacheID = read<QWORD>();
+	info.Format = (ETextureFormat)read<BYTE>();
+	info.UScale = read<FLOAT>();
+	info.VScale = read<FLOAT>();
+	info.USize = read<INT>();
+	info.VSize = read<INT>();
+	info.UClamp = read<INT>();
+	info.VClamp = read<INT>();
+	info.NumMips = min(read<INT>(),(INT)MAX_MIPS);
+	tex->maxColor = read<FColor>();
+	info.MaxColor = &tex->maxColor;
+	info.Palette = nullptr;
+	if(read<BYTE>())
+	{
+		for(int i=0;i<256;i++)
+			tex->palette[i] = read<FColor>();
+		info.Palette = tex->palette;
+	}
+	for(int i=0;i<info.NumMips;i++)
+	{
+		FMipmap &mip = tex->mips[i];
+		mip.USize = read<INT>();
+		mip.VSize = read<INT>();
+		mip.UBits = read<BYTE>();
+		mip.VBits = read<BYTE>();
+		DWORD size = read<DWORD>();
+		if(pos+size>trace.size())
+		{
+			UD3D10RenderDevice::debugs("Truncated trace.");
+			pos = trace.size();
+			return;
+		}
+
+		//Allocate the full mip even though rows past the clamp aren't stored, so conversion can't read past the end
+		tex->data[i].resize(max((size_t)size,(size_t)mip.USize*mip.VSize*4));
+		memcpy(&tex->data[i][0],&trace[pos],size);
+		pos += size;
+		mip.DataPtr = &tex->data[i][0];
+		info.Mips[i] = &mip;
+	}
+}
+
+/**
+Look up the texture a call refers to and apply the per-call fields.
+\return nullptr if the call used no texture for this slot. Unknown textures mean the trace is corrupt; replaying then stops.
+*/
+FTextureInfo *TraceReplayer::readTextureRef()
+{
+	QWORD id = read<QWORD>();
+	if(id==0)
+		return nullptr;
+	std::unordered_map<QWORD,Texture*>::iterator t = textures.find(id);
+	if(t==textures.end())
+	{
+		UD3D10RenderDevice::debugs("Trace refers to unknown texture.");
+		pos = trace.size();
+		return nullptr;
+	}
+	FTextureInfo *info = &t->second->info;
+	info->Pan = read<FVector>();
+	info->TextureFlags = read<DWORD>();
+	return info;
+}
+
+/**
+Replay the loaded trace from the start.
+\return Number of frames drawn, or -1 if the trace is corrupt.
+*/
+int TraceReplayer::replay()
+{
+	FLOAT oldFovAngle = device->Viewport->Actor->FovAngle;
+	streaming = false;
+	int frames = run(2*sizeof(DWORD));
+	device->Viewport->Actor->FovAngle = oldFovAngle;
+	return frames;
+}
+
+/**
+Replay records taken from a stream recorder. Textures are kept for the next stream, until a flush.
+\param stream Records; left as they are.
+\return Number of frames drawn, or -1 if the stream is corrupt.
+*/
+int TraceReplayer::replayStream(std::vector<BYTE> &stream)
+{
+	streaming = true;
+	trace.swap(stream);
+	int frames = run(0);
+	trace.swap(stream);
+	return frames;
+}
+
+int TraceReplayer::run(size_t start)
+{
+	int frames = 0;
+	pos = start;
+
+	while(pos<trace.size())
+	{
+		switch(read<BYTE>())
+		{
+		case TRACE_LOCK:
+			{
+				FPlane flashScale = read<FPlane>();
+				FPlane flashFog = read<FPlane>();
+				FPlane screenClear = read<FPlane>();
+				DWORD flags = read<DWORD>();
+				device->Lock(flashScale,flashFog,screenClear,flags,nullptr,nullptr);
+			}
+			break;
+		case TRACE_UNLOCK:
+			device->Unlock(read<UBOOL>());
+			frames++;
+			break;
+		case TRACE_FLUSH:
+			flushBrightness = read<FLOAT>();
+			flushLevel = (const ULevel*)(size_t)read<QWORD>();
+			device->Flush(read<UBOOL>());
+			deleteTextures(); //Written again when next used
+			break;
+		case TRACE_FRAME:
+			frame = read<FSceneNode>();
+			frame.Viewport = device->Viewport;
+			fovAngle = read<FLOAT>();
+			if(!streaming)
+				device->Viewport->Actor->FovAngle = fovAngle;
+			break;
+		case TRACE_SETSCENENODE:
+			device->SetSceneNode(&frame);
+			break;
+		case TRACE_TEXTURE:
+			readTexture();
+			break;
+		case TRACE_PRECACHE:
+			{
+				FTextureInfo *info = readTextureRef();
+				DWORD polyFlags = read<DWORD>();
+				if(info)
+					device->PrecacheTexture(*info,polyFlags);
+			}
+			break;
+		case TRACE_COMPLEXSURFACE:
+			{
+				FSurfaceInfo surface;
+				surface.PolyFlags = read<DWORD>();
+				surface.FlatColor = read<FColor>();
+				surface.Level = nullptr;
+				surface.Texture = readTextureRef();
+				surface.LightMap = readTextureRef();
+				surface.MacroTexture = readTextureRef();
+				surface.DetailTexture = readTextureRef();
+				surface.FogMap = readTextureRef();
+				surface.BumpMap = readTextureRef();
+
+				FSurfaceFacet facet;
+				facet.MapCoords = read<FCoords>();
+				facet.MapUncoords = read<FCoords>();
+				facet.Span = nullptr;
+
+				//Read points first; pointers into the scratch buffers are only set up once these are done growing
+				INT numPolys = read<INT>();
+				transforms.clear();
+				size_t polyBytes = 0;
+				polyOffsets.resize(numPolys);
+				polyCounts.resize(numPolys);
+				for(int p=0;p<numPolys;p++)
+				{
+					polyCounts[p] = read<INT>();
+					polyOffsets[p] = polyBytes;
+					polyBytes += sizeof(FSavedPoly)+polyCounts[p]*sizeof(FTransform*);
+					for(int i=0;i<polyCounts[p];i++)
+					{
+						FTransform t;
+						t.Point = read<FVector>();
+						transforms.push_back(t);
+					}
+				}
+				polys.resize(polyBytes);
+				FSavedPoly *prev = nullptr;
+				size_t vert = 0;
+				facet.Polys = nullptr;
+				for(int p=0;p<numPolys;p++)
+				{
+					FSavedPoly *poly = (FSavedPoly*)&polys[polyOffsets[p]];
+					poly->Next = nullptr;
+					poly->User = nullptr;
+					poly->NumPts = polyCounts[p];
+					for(int i=0;i<polyCounts[p];i++)
+						poly->Pts[i] = &transforms[vert++];
+					if(prev)
+						prev->Next = poly;
+					else
+						facet.Polys = poly;
+					prev = poly;
+				}
+				if(surface.Texture)
+					device->DrawComplexSurface(&frame,surface,facet);
+			}
+			break;
+		case TRACE_GOURAUDPOLYGON:
+			{
+				FTextureInfo *info = readTextureRef();
+				DWORD polyFlags = read<DWORD>();
+				int numPts = read<int>();
+				transTextures.resize(numPts);
+				transTexturePtrs.resize(numPts);
+				for(int i=0;i<numPts;i++)
+				{
+					FTransTexture &t = transTextures[i];
+					t.Point = read<FVector>();
+					t.Light = read<FPlane>();
+					t.Fog = read<FPlane>();
+					t.U = read<FLOAT>();
+					t.V = read<FLOAT>();
+					transTexturePtrs[i] = &t;
+				}
+				if(info && numPts>0)
+					device->DrawGouraudPolygon(&frame,*info,&transTexturePtrs[0],numPts,polyFlags,nullptr);
+			}
+			break;
+		case TRACE_TILE:
+			{
+				FTextureInfo *info = readTextureRef();
+				FLOAT c[9];
+				for(int i=0;i<9;i++)
+					c[i] = read<FLOAT>();
+				FPlane color = read<FPlane>();
+				FPlane fog = read<FPlane>();
+				DWORD polyFlags = read<DWORD>();
+				if(info)
+					device->DrawTile(&frame,*info,c[0],c[1],c[2],c[3],c[4],c[5],c[6],c[7],nullptr,c[8],color,fog,polyFlags);
+			}
+			break;
+		case TRACE_CLEARZ:
+			device->ClearZ(&frame);
+			break;
+		case TRACE_ENDFLASH:
+			device->EndFlash();
+			break;
+		default:
+			UD3D10RenderDevice::debugs("Corrupt trace.");
+			return -1;
+		}
+	}
+	return frames;
+}
@@ -0,0 +1,139 @@
+/**
+\file trace.h
+*/
+
+#pragma once
+
+class TraceRecorder;
+class TraceReplayer;
+
+#include <fstream>
+#include <vector>
+#include <unordered_map>
+#include "d3d10drv.h"
+
+/** Record types in a trace file; each record starts with one of these as a BYTE */
+enum TraceRecordType
+{
+	TRACE_LOCK,
+	TRACE_UNLOCK,
+	TRACE_FLUSH, /**< With the brightness, level and AllowPrecache the game flushed with */
+	TRACE_FRAME, /**< Scene node; used by all following calls that take a frame, until the next one */
+	TRACE_SETSCENENODE,
+	TRACE_TEXTURE, /**< Texture payload, stored before the first call using the CacheID and again when a realtime texture changed */
+	TRACE_PRECACHE,
+	TRACE_COMPLEXSURFACE,
+	TRACE_GOURAUDPOLYGON,
+	TRACE_TILE,
+	TRACE_CLEARZ,
+	TRACE_ENDFLASH,
+};
+
+class TraceRecorder
+{
+private:
+	/** Payload of a CacheID in the trace */
+	struct RecordedTexture
+	{
+		QWORD paletteCacheID; /**< Palette it was written with */
+		unsigned int frame; /**< Frame it was last written in; a changed realtime texture is written once per frame */
+	};
+
+	std::ofstream file; /**< Not open when recording a stream */
+	std::vector<BYTE> buffer; /**< Records not yet written to the file or taken as a stream */
+	int framesLeft;
+	bool started; /**< Recording starts at the first Lock() so the trace holds whole frames */
+	FSceneNode lastFrame; /**< Last written scene node, with pointers cleared */
+	FLOAT lastFovAngle;
+	bool haveFrame;
+	unsigned int frame; /**< Counts Lock() calls */
+	std::unordered_map<QWORD,RecordedTexture> recordedTextures; /**< CacheIDs whose payloads are in the trace */
+
+	template<class T> void write(const T &val){writeBytes(&val,sizeof(T));}
+	void writeBytes(const void *data, size_t size){buffer.insert(buffer.end(),(const BYTE*)data,(const BYTE*)data+size);}
+	void writeFile();
+	void writeFrame(const FSceneNode *Frame);
+	void writeTexture(const FTextureInfo &Info);
+	void writeTextureRef(const FTextureInfo *Info);
+
+public:
+	TraceRecorder(const TCHAR *fileName, int frames);
+	TraceRecorder();
+	~TraceRecorder();
+	bool isOpen() const;
+	bool isDone() const;
+	void takeStream(std::vector<BYTE> &stream);
+	void recordLock(const FPlane &FlashScale, const FPlane &FlashFog, const FPlane &ScreenClear, DWORD RenderLockFlags);
+	void recordUnlock(UBOOL Blit);
+	void recordFlush(FLOAT brightness, const ULevel *level, UBOOL AllowPrecache);
+	void recordSetSceneNode(const FSceneNode *Frame);
+	void recordPrecacheTexture(const FTextureInfo &Info, DWORD PolyFlags);
+	void recordComplexSurface(const FSceneNode *Frame, const FSurfaceInfo &Surface, const FSurfaceFacet &Facet);
+	void recordGouraudPolygon(const FSceneNode *Frame, const FTextureInfo &Info, FTransTexture **Pts, int NumPts, DWORD PolyFlags);
+	void recordTile(const FSceneNode *Frame, const FTextureInfo &Info, FLOAT X, FLOAT Y, FLOAT XL, FLOAT YL, FLOAT U, FLOAT V, FLOAT UL, FLOAT VL, FLOAT Z, const FPlane &Color, const FPlane &Fog, DWORD PolyFlags);
+	void recordClearZ(const FSceneNode *Frame);
+	void recordEndFlash();
+};
+
+class TraceReplayer
+{
+private:
+	/** Texture rebuilt from a trace; the FTextureInfo points into this */
+	struct Texture
+	{
+		FTextureInfo info;
+		FMipmap mips[MAX_MIPS];
+		std::vector<BYTE> data[MAX_MIPS];
+		FColor palette[256];
+		FColor maxColor;
+	};
+
+	URenderDevice *device;
+	std::vector<BYTE> trace;
+	size_t pos;
+	std::unordered_map<QWORD,Texture*> textures;
+	FSceneNode frame;
+	FLOAT fovAngle;
+	FLOAT flushBrightness;
+	const ULevel *flushLevel; /**< Only to tell levels apart; the level may be gone */
+	bool streaming; /**< Replaying a stream for the render thread; the game's objects are left alone */
+
+	/**@name Scratch storage for calls, reused between records */
+	//@{
+	std::vector<FTransform> transforms;
+	std::vector<FTransTexture> transTextures;
+	std::vector<FTransTexture*> transTexturePtrs;
+	std::vector<BYTE> polys; /**< FSavedPoly is variable length */
+	std::vector<size_t> polyOffsets;
+	std::vector<INT> polyCounts;
+	//@}
+
+	/** Read a value; past the end of the trace, this returns zeroes and makes replaying stop */
+	template<class T> T read()
+	{
+		T val;
+		if(pos+sizeof(T)>trace.size())
+		{
+			memset(&val,0,sizeof(T));
+			pos = trace.size();
+			return val;
+		}
+		memcpy(&val,&trace[pos],sizeof(T));
+		pos+=sizeof(T);
+		return val;
+	}
+	void readTexture();
+	FTextureInfo *readTextureRef();
+	void deleteTextures();
+	int run(size_t start);
+
+public:
+	TraceReplayer(URenderDevice *device);
+	~TraceReplayer();
+	bool load(const TCHAR *fileName);
+	int replay();
+	int replayStream(std::vector<BYTE> &stream);
+	FLOAT getFovAngle() const;
+	FLOAT getFlushBrightness() const;
+	const ULevel *getFlushLevel() const;
+};
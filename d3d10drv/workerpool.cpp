@@ -0,0 +1,131 @@
+/**
+\class WorkerPool
+Threads that run jobs off the game thread, for example texture conversion (see TexConverter).
+
+Jobs are run in submission order, after any helper jobs: those help a thread that waits on them, such as BCEncoder::encodeMips() splitting a texture
+over the workers, so they jump the queue and are deleted once run. Finished jobs aren't acted on by the workers; the game thread collects them at a point of its choosing,
+so results can be published at a frame boundary without any locking on the game thread's side apart from collectFinished().
+Workers run at below normal priority and are kept off the game thread's core by their affinity mask.
+*/
+
+#include "workerpool.h"
+
+/**
+\param numThreads Number of workers; with 0 jobs are never run.
+\param affinityMask Cores the workers may run on.
+*/
+WorkerPool::WorkerPool(int numThreads, DWORD_PTR affinityMask): stopping(false)
+{
+	for(int i=0;i<numThreads;i++)
+	{
+		threads.push_back(std::thread(&WorkerPool::workerMain,this,affinityMask));
+	}
+}
+
+/**
+Stops the workers after their current job; jobs not yet run or collected are deleted.
+*/
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for(std::vector<std::thread>::iterator i=threads.begin();i!=threads.end();i++)
+	{
+		i->join();
+	}
+
+	for(std::deque<Job*>::iterator i=queued.begin();i!=queued.end();i++)
+	{
+		delete *i;
+	}
+	for(std::deque<Job*>::iterator i=helpers.begin();i!=helpers.end();i++)
+	{
+		delete *i;
+	}
+	for(std::vector<Job*>::iterator i=finished.begin();i!=finished.end();i++)
+	{
+		delete *i;
+	}
+}
+
+/**
+Number of workers to use for a set of cores: one per core, at most maxThreads.
+*/
+int WorkerPool::countThreads(DWORD_PTR affinityMask, int maxThreads)
+{
+	int num=0;
+	for(;affinityMask;affinityMask&=affinityMask-1)
+		num++;
+	return min(num,maxThreads);
+}
+
+void WorkerPool::workerMain(DWORD_PTR affinityMask)
+{
+	SetThreadAffinityMask(GetCurrentThread(),affinityMask);
+	SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_BELOW_NORMAL);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while(true)
+	{
+		while(!stopping && queued.empty() && helpers.empty())
+			wake.wait(lock);
+		if(stopping)
+			return;
+
+		if(!helpers.empty())
+		{
+			Job *job = helpers.front();
+			helpers.pop_front();
+			lock.unlock();
+			job->run();
+			delete job;
+			lock.lock();
+			continue;
+		}
+
+		Job *job = queued.front();
+		queued.pop_front();
+		lock.unlock();
+		job->run();
+		lock.lock();
+		finished.push_back(job);
+	}
+}
+
+/**
+Queue a job. The pool owns it until it's returned by collectFinished().
+*/
+void WorkerPool::submit(Job *job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queued.push_back(job);
+	}
+	wake.notify_one();
+}
+
+/**
+Queue a job ahead of the ones submitted with submit(). The pool deletes it once it has run; it's never returned by collectFinished().
+*/
+void WorkerPool::submitHelper(Job *job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		helpers.push_back(job);
+	}
+	wake.notify_one();
+}
+
+/**
+Take the jobs that have finished running; the caller deletes them.
+\param jobs Finished jobs are appended to this.
+*/
+void WorkerPool::collectFinished(std::vector<Job*> &jobs)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	jobs.insert(jobs.end(),finished.begin(),finished.end());
+	finished.clear();
+}
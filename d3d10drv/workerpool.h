@@ -0,0 +1,46 @@
+/**
+\file workerpool.h
+*/
+
+#pragma once
+
+class WorkerPool;
+
+#include <windows.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class WorkerPool
+{
+public:
+	/** Work item. run() is called on a worker thread; the job is then handed back through collectFinished(), or deleted if it's a helper */
+	class Job
+	{
+	public:
+		virtual ~Job(){}
+		virtual void run()=0;
+	};
+
+private:
+	std::vector<std::thread> threads;
+	std::deque<Job*> queued;
+	std::deque<Job*> helpers;
+	std::vector<Job*> finished;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping;
+
+	void workerMain(DWORD_PTR affinityMask);
+
+public:
+	WorkerPool(int numThreads, DWORD_PTR affinityMask);
+	~WorkerPool();
+	static int countThreads(DWORD_PTR affinityMask, int maxThreads);
+	int getNumThreads() const { return (int)threads.size(); }
+	void submit(Job *job);
+	void submitHelper(Job *job);
+	void collectFinished(std::vector<Job*> &jobs);
+};
@@ -0,0 +1,436 @@
+/**
+\class WorldGeometryBuffer
+Keeps BSP facet vertices on the GPU across frames.
+
+The world is static apart from texture panning, which only affects the facets' surface records (see Shader_ComplexSurface). A facet's vertices are
+therefore uploaded once, the first time it's drawn, and every later draw only writes indices into the dynamic index buffer.
+Facets are found by a key computed from their map coordinates and points, so movers and anything else that changes shape simply become new facets.
+When the vertices or surface slots run out, facets not drawn in the last two frames are evicted, and their storage goes to new facets with the same number of vertices;
+a mover keeps its vertex count, so its new positions take the place of its old ones. Only if that doesn't make room is everything thrown away, as on level changes.
+
+Indices are 16 bit, relative to the start of the FanEncoder::WINDOW_SIZE vertex window the fan is in; facets never cross a window boundary. Fans from another
+window than the buffered ones make those get drawn first, so geometry from one window is drawn together as much as possible.
+How fans become indices depends on the FanEncoder mode. Like DynamicGeometryBuffer, the indices of a whole CommandList can also be written as one batch.
+*/
+
+#include "worldgeometrybuffer.h"
+#include "d3d10drv.h"
+
+WorldGeometryBuffer::WorldGeometryBuffer(ID3D10Device* device) : 
+GeometryBuffer(device),
+numVerts(0),
+uploadedVerts(0),
+frame(0),
+evictedFrame(0),
+numSurfaces(0),
+clear(true),
+reportedDroppedFans(false),
+mappedIBuffer(nullptr),
+baseVertex(0)
+{
+	indexFormat = DXGI_FORMAT_R16_UINT;
+}
+
+/**
+\param vertexCapacity Number of vertices that can be cached.
+\param size Number of indices buffered per frame before they have to be drawn and discarded.
+\param maxSurfaces Number of facets that can be cached; each gets a surface record slot.
+*/
+bool WorldGeometryBuffer::create(size_t vertexCapacity, size_t size, UINT maxSurfaces)
+{
+	this->vertexCapacity = vertexCapacity;
+	this->size = size;
+	this->maxSurfaces = maxSurfaces;
+	facets.reserve(maxSurfaces);
+
+	D3D10_BUFFER_DESC vertexBufferDesc;
+	vertexBufferDesc.Usage            = D3D10_USAGE_DEFAULT;
+	vertexBufferDesc.ByteWidth        = sizeof(Vertex_ComplexSurface)*vertexCapacity;
+	vertexBufferDesc.BindFlags        = D3D10_BIND_VERTEX_BUFFER;
+	vertexBufferDesc.CPUAccessFlags   = 0;
+	vertexBufferDesc.MiscFlags        = 0;
+
+	D3D10_BUFFER_DESC indexBufferDesc;
+	indexBufferDesc.Usage            = D3D10_USAGE_DYNAMIC;
+	indexBufferDesc.ByteWidth        = sizeof(WORD)*size;
+	indexBufferDesc.BindFlags        = D3D10_BIND_INDEX_BUFFER;
+	indexBufferDesc.CPUAccessFlags   = D3D10_CPU_ACCESS_WRITE;
+	indexBufferDesc.MiscFlags        = 0;
+
+	if(FanEncoder::getMode()==FanEncoder::MODE_TABLE)
+	{
+		D3D10_SUBRESOURCE_DATA table;
+		FanEncoder::describeTable(indexBufferDesc,table);
+		return GeometryBuffer::create(0,sizeof(Vertex_ComplexSurface),&vertexBufferDesc,&indexBufferDesc,nullptr,&table);
+	}
+	return GeometryBuffer::create(0,sizeof(Vertex_ComplexSurface),&vertexBufferDesc,&indexBufferDesc,nullptr,nullptr);
+}
+
+void WorldGeometryBuffer::map()
+{
+	if(mappedIBuffer!=nullptr)
+		return;
+
+	D3D10_MAP m;
+	if(clear)
+	{
+		numIndices=0;
+		numUndrawnIndices=0;
+		m = D3D10_MAP_WRITE_DISCARD;
+		clear=false;
+	}
+	else
+	{
+		m = D3D10_MAP_WRITE_NO_OVERWRITE;
+	}
+
+	D3D::stats.bufferMaps++;
+	if(FAILED(indexBuffer->Map(m,0,(void**)&mappedIBuffer)))
+	{
+		UD3D10RenderDevice::debugs("Failed to map index buffer.");
+		mappedIBuffer = nullptr;
+	}
+}
+
+bool WorldGeometryBuffer::unmap()
+{
+	if(mappedIBuffer==nullptr)
+		return 0;
+	indexBuffer->Unmap();
+	mappedIBuffer=nullptr;
+	return 1;
+}
+
+/**
+Copy vertices of newly cached facets to the vertex buffer.
+*/
+void WorldGeometryBuffer::upload()
+{
+	const Vertex_ComplexSurface *reused = reusedVertices.data();
+	for(std::vector<Facet>::const_iterator f=reusedFacets.begin();f!=reusedFacets.end();f++)
+	{
+		D3D10_BOX box = {f->firstVertex*stride,0,0,(f->firstVertex+f->numVerts)*stride,1,1};
+		device->UpdateSubresource(vertexBuffer,0,&box,reused,0,0);
+		reused += f->numVerts;
+	}
+	D3D::stats.vertexBytes += reusedVertices.size()*stride;
+	reusedFacets.clear();
+	reusedVertices.clear();
+
+	if(newVertices.empty())
+		return;
+	D3D10_BOX box = {uploadedVerts*stride,0,0,numVerts*stride,1,1};
+	device->UpdateSubresource(vertexBuffer,0,&box,&newVertices[0],0,0);
+	D3D::stats.vertexBytes += newVertices.size()*stride;
+	uploadedVerts = numVerts;
+	newVertices.clear();
+}
+
+/**
+Move facets not drawn this frame or the last to the free storage. Nothing can refer to them anymore, as every frame's geometry is drawn by its end.
+*/
+void WorldGeometryBuffer::evictStale()
+{
+	evictedFrame = frame;
+	for(std::unordered_map<unsigned long long,Facet>::iterator i=facets.begin();i!=facets.end();)
+	{
+		if(frame-i->second.usedFrame>1)
+		{
+			freeFacets[i->second.numVerts].push_back(i->second);
+			i = facets.erase(i);
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+/**
+Look up a facet.
+\return The facet, or nullptr if it isn't cached.
+*/
+WorldGeometryBuffer::Facet *WorldGeometryBuffer::findFacet(unsigned long long key)
+{
+	std::unordered_map<unsigned long long,Facet>::iterator i = facets.find(key);
+	if(i==facets.end())
+	{
+		D3D::stats.worldFacetMisses++;
+		return nullptr;
+	}
+	D3D::stats.worldFacetHits++;
+	return &i->second;
+}
+
+/**
+Make room for a new facet; fill its vertices through getVertices().
+New facets go after the stored ones; once those run out, they take the storage of evicted facets of the same size (see evictStale()).
+\param num Total number of vertices of the facet's polygons.
+\return The facet, or nullptr if the cache is full. Everything drawn from the cache must be drawn before reset() can make room.
+*/
+WorldGeometryBuffer::Facet *WorldGeometryBuffer::addFacet(unsigned long long key, UINT num)
+{
+	if(num>FanEncoder::WINDOW_SIZE)
+		return nullptr;
+
+	UINT first = numVerts;
+	if(first%FanEncoder::WINDOW_SIZE+num>FanEncoder::WINDOW_SIZE) //Start at the next index window; the skipped vertices are unused
+		first += FanEncoder::WINDOW_SIZE-first%FanEncoder::WINDOW_SIZE;
+	if(first+num<=vertexCapacity && numSurfaces<maxSurfaces)
+	{
+		numVerts = first;
+		Facet f = {numVerts,num,numSurfaces++,frame-1};
+		numVerts += num;
+		newVertices.resize(numVerts-uploadedVerts);
+		return &(facets[key] = f);
+	}
+
+	std::unordered_map<UINT,std::vector<Facet>>::iterator free = freeFacets.find(num);
+	if((free==freeFacets.end() || free->second.empty()) && evictedFrame!=frame)
+	{
+		evictStale();
+		free = freeFacets.find(num);
+	}
+	if(free==freeFacets.end() || free->second.empty())
+		return nullptr;
+
+	Facet f = free->second.back();
+	free->second.pop_back();
+	f.usedFrame = frame-1;
+	if(f.firstVertex>=uploadedVerts) //Evicted before its vertices went out; they're still in newVertices
+		return &(facets[key] = f);
+	reusedFacets.push_back(f);
+	reusedVertices.resize(reusedVertices.size()+num);
+	return &(facets[key] = f);
+}
+
+/**
+Get storage for a newly added facet's vertices.
+\note Pointer is only valid until the next addFacet().
+*/
+Vertex_ComplexSurface *WorldGeometryBuffer::getVertices(const Facet *facet)
+{
+	if(facet->firstVertex<uploadedVerts) //In the storage of an evicted facet
+		return &reusedVertices[reusedVertices.size()-facet->numVerts];
+	return &newVertices[facet->firstVertex-uploadedVerts];
+}
+
+/**
+Mark a facet as drawn this frame.
+\return Whether it was already drawn this frame; if so, its surface record may only change after that geometry was drawn.
+*/
+bool WorldGeometryBuffer::useFacet(Facet *facet)
+{
+	bool used = facet->usedFrame==frame;
+	facet->usedFrame = frame;
+	return used;
+}
+
+/**
+Forget all cached facets. Any geometry using them must be drawn first.
+*/
+void WorldGeometryBuffer::reset()
+{
+	facets.clear();
+	newVertices.clear();
+	freeFacets.clear();
+	reusedFacets.clear();
+	reusedVertices.clear();
+	numSurfaces = 0;
+	numVerts = 0;
+	uploadedVerts = 0;
+}
+
+/**
+Generate indices for a triangle fan of cached vertices. Buffered indices are drawn first if the fan doesn't fit.
+\param firstVertex Index of the fan's first vertex in the cache.
+\return BATCH_ADDED, or BATCH_FULL if the fan doesn't fit even an emptied buffer, or the buffer can't be mapped; nothing is written then.
+*/
+WorldGeometryBuffer::BatchResult WorldGeometryBuffer::indexTriangleFan(UINT firstVertex, int num)
+{
+	FanEncoder::Mode mode = FanEncoder::getMode();
+	if(mode==FanEncoder::MODE_TABLE) //Nothing to write, the fan is drawn with its own base vertex
+	{
+		FanEncoder::Fan f = {firstVertex,num};
+		tableFans.push_back(f);
+		numUndrawnIndices += FanEncoder::countDrawnIndices(num);
+		return BATCH_ADDED;
+	}
+
+	int newIndices = FanEncoder::countIndices(mode,num);
+	if(numIndices+newIndices>size)
+	{
+		D3D::render();
+		unmap(); //Drawing leaves the buffer mapped if nothing was undrawn, which would keep map() from discarding it
+		clear=true;
+	}
+	if(mappedIBuffer==nullptr)
+		map();
+	if(mappedIBuffer==nullptr || numIndices+newIndices>size)
+	{
+		if(!reportedDroppedFans)
+		{
+			UD3D10RenderDevice::debugs("WorldGeometryBuffer: Index buffer unusable; dropping world geometry.");
+			reportedDroppedFans = true;
+		}
+		return BATCH_FULL;
+	}
+	UINT window = firstVertex-firstVertex%FanEncoder::WINDOW_SIZE;
+	if(window!=baseVertex) //Buffered indices are relative to another window; draw them first
+	{
+		if(numUndrawnIndices>0)
+		{
+			D3D::render();
+			D3D::stats.indexWindows++;
+			map();
+			if(mappedIBuffer==nullptr)
+				return BATCH_FULL;
+		}
+		baseVertex = window;
+	}
+
+	FanEncoder::write(mode,&mappedIBuffer[numIndices],(WORD)(firstVertex-baseVertex),num);
+	numIndices += newIndices;
+	numUndrawnIndices += newIndices;
+	D3D::stats.indexBytes += newIndices*sizeof(WORD);
+	return BATCH_ADDED;
+}
+
+/**
+Map the index buffer for a batch of fans, making it larger if they don't fit. Index the fans with batchTriangleFan().
+If the buffer can't grow, the batch starts on an emptied buffer and batchTriangleFan() reports when it's full.
+\note Nothing may be buffered and no shader may be current, as the index buffer may be recreated.
+*/
+void WorldGeometryBuffer::beginBatch(size_t indices)
+{
+	batchFans.clear();
+	if(FanEncoder::getMode()==FanEncoder::MODE_TABLE)
+		return;
+
+	if(indices>size)
+	{
+		size_t newSize = size;
+		while(newSize<indices)
+			newSize *= 2;
+		D3D10_BUFFER_DESC indexBufferDesc;
+		indexBufferDesc.Usage            = D3D10_USAGE_DYNAMIC;
+		indexBufferDesc.ByteWidth        = sizeof(WORD)*newSize;
+		indexBufferDesc.BindFlags        = D3D10_BIND_INDEX_BUFFER;
+		indexBufferDesc.CPUAccessFlags   = D3D10_CPU_ACCESS_WRITE;
+		indexBufferDesc.MiscFlags        = 0;
+		ID3D10Buffer *buffer;
+		if(SUCCEEDED(device->CreateBuffer(&indexBufferDesc,nullptr,&buffer)))
+		{
+			unmap();
+			SAFE_RELEASE(indexBuffer);
+			indexBuffer = buffer;
+			size = newSize;
+			clear = true;
+		}
+		else
+		{
+			UD3D10RenderDevice::debugs("WorldGeometryBuffer: Failed to grow index buffer.");
+		}
+	}
+	if(numIndices+indices>size)
+	{
+		unmap();
+		clear = true;
+	}
+	map();
+}
+
+/**
+Generate indices for a fan of a batch.
+\param firstVertex Index of the fan's first vertex in the cache.
+\param range Range the fan is added to; an empty one starts at the fan.
+\return See BatchResult.
+*/
+WorldGeometryBuffer::BatchResult WorldGeometryBuffer::batchTriangleFan(UINT firstVertex, int num, DrawRange &range)
+{
+	FanEncoder::Mode mode = FanEncoder::getMode();
+	UINT window = firstVertex-firstVertex%FanEncoder::WINDOW_SIZE;
+	if(range.numIndices==0)
+	{
+		range.firstIndex = numIndices;
+		range.baseVertex = window;
+		range.firstFan = batchFans.size();
+		range.numFans = 0;
+	}
+
+	if(mode==FanEncoder::MODE_TABLE)
+	{
+		FanEncoder::Fan f = {firstVertex,num};
+		batchFans.push_back(f);
+		range.numFans++;
+		range.numIndices += FanEncoder::countDrawnIndices(num);
+		return BATCH_ADDED;
+	}
+
+	if(window!=range.baseVertex)
+	{
+		D3D::stats.indexWindows++;
+		return BATCH_NEW_RANGE;
+	}
+	if(mappedIBuffer==nullptr || numIndices+FanEncoder::countIndices(mode,num)>size) //Only if growing or mapping failed
+	{
+		if(mappedIBuffer!=nullptr && numIndices>0) //Fits in the emptied buffer of a new batch
+			return BATCH_FULL;
+		if(!reportedDroppedFans)
+		{
+			UD3D10RenderDevice::debugs("WorldGeometryBuffer: Index buffer unusable; dropping world geometry.");
+			reportedDroppedFans = true;
+		}
+		return BATCH_ADDED;
+	}
+	int newIndices = FanEncoder::write(mode,&mappedIBuffer[numIndices],(WORD)(firstVertex-window),num);
+	numIndices += newIndices;
+	range.numIndices += newIndices;
+	D3D::stats.indexBytes += newIndices*sizeof(WORD);
+	return BATCH_ADDED;
+}
+
+/**
+Unmap the index buffer and upload vertices of facets added since the last draw.
+*/
+void WorldGeometryBuffer::endBatch()
+{
+	unmap();
+	upload();
+}
+
+/**
+Make the next draw() draw a range of the last batch.
+*/
+void WorldGeometryBuffer::queueRange(const DrawRange &range)
+{
+	numIndices = range.firstIndex+(FanEncoder::getMode()==FanEncoder::MODE_TABLE ? 0 : range.numIndices);
+	numUndrawnIndices = range.numIndices;
+	baseVertex = range.baseVertex;
+	if(FanEncoder::getMode()==FanEncoder::MODE_TABLE)
+		tableFans.assign(batchFans.begin()+range.firstFan,batchFans.begin()+range.firstFan+range.numFans);
+}
+
+void WorldGeometryBuffer::draw()
+{
+	if(numUndrawnIndices==0)
+		return;
+	unmap();
+	upload();
+	if(FanEncoder::getMode()==FanEncoder::MODE_TABLE)
+	{
+		FanEncoder::drawTable(device,tableFans);
+		numUndrawnIndices=0;
+		return;
+	}
+	D3D::stats.drawCalls++;
+	D3D::stats.indices += numUndrawnIndices;
+	device->DrawIndexed(numUndrawnIndices,numIndices-numUndrawnIndices,baseVertex);
+	numUndrawnIndices=0;
+}
+
+void WorldGeometryBuffer::newFrame()
+{
+	clear=true;
+	frame++;
+}
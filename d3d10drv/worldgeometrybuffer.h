@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include "geometrybuffer.h"
+#include "fanencoder.h"
+#include "vertexformats.h"
+
+
+class WorldGeometryBuffer: public GeometryBuffer
+{
+public:
+	/** A cached facet; its vertices are stored back to back, polygon after polygon */
+	struct Facet
+	{
+		UINT firstVertex;
+		UINT numVerts;
+		UINT surface; /**< Slot of the facet's ComplexSurfaceRecord, stored in its vertices */
+		unsigned int usedFrame; /**< Last frame the facet was drawn in */
+	};
+
+private:
+	std::unordered_map<unsigned long long,Facet> facets;
+	std::vector<Vertex_ComplexSurface> newVertices; /**< Vertices of facets added since the last upload */
+	std::unordered_map<UINT,std::vector<Facet>> freeFacets; /**< Storage and surface slots of evicted facets, by vertex count */
+	std::vector<Facet> reusedFacets; /**< Facets added since the last upload in the storage of evicted ones */
+	std::vector<Vertex_ComplexSurface> reusedVertices; /**< Vertices of reusedFacets, back to back */
+	unsigned int evictedFrame; /**< Frame of the last eviction; there's no point in looking again within a frame */
+	UINT numSurfaces; //Number of surface slots handed out, including those of evicted facets
+	UINT numVerts; //Number of stored verts, uploaded or not
+	UINT uploadedVerts; //Number of verts in the vertex buffer
+	size_t vertexCapacity; //Maximum number of stored verts
+	size_t size; //Maximum size of index buffer
+	UINT maxSurfaces; //Maximum number of facets
+	unsigned int frame;
+	bool clear;
+	bool reportedDroppedFans; //Whether dropping fans that can't be indexed at all was logged
+	WORD *mappedIBuffer; //Memmapped version of index buffer; not used in table mode, where the index buffer is the fixed fan table
+	UINT baseVertex; //First vertex of the window the indices are relative to
+	std::vector<FanEncoder::Fan> tableFans; //Fans to draw in table mode
+	std::vector<FanEncoder::Fan> batchFans; //Fans of the current batch in table mode
+	void map();
+	bool unmap();
+	void upload();
+	void evictStale();
+
+public:
+	/** Outcome of batchTriangleFan() and indexTriangleFan() */
+	enum BatchResult
+	{
+		BATCH_ADDED, /**< Indexed in the range, or dropped if the index buffer can't be used at all */
+		BATCH_NEW_RANGE, /**< The fan is in another 16 bit window than the range; end the range and add the fan to a new one */
+		BATCH_FULL, /**< The index buffer is full and couldn't grow; draw what's batched and add the fan to a new batch. From indexTriangleFan(): the fan doesn't fit even an emptied buffer and wasn't indexed */
+	};
+
+	WorldGeometryBuffer(ID3D10Device* device);
+
+	bool create(size_t vertexCapacity, size_t size, UINT maxSurfaces);
+
+	//From GeometryBuffer
+	void draw() override;
+	void newFrame() override;
+
+	Facet *findFacet(unsigned long long key);
+	Facet *addFacet(unsigned long long key, UINT num);
+	Vertex_ComplexSurface *getVertices(const Facet *facet);
+	bool useFacet(Facet *facet);
+	void reset();
+	BatchResult indexTriangleFan(UINT firstVertex, int num);
+
+	void beginBatch(size_t indices);
+	BatchResult batchTriangleFan(UINT firstVertex, int num, DrawRange &range);
+	void endBatch();
+	void queueRange(const DrawRange &range);
+};